@@ -0,0 +1,477 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "backend.h"
+
+#define RAM_CHUNK (1024 * 1024)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t device = PTHREAD_MUTEX_INITIALIZER; // For slow.
+static Backend *backends; // The outermost ones.
+
+static Backend *open1(char const *spec, int flags);
+static Backend *openposix(char const *path, int flags);
+static Backend *openmap(char const *path, int flags, int ram);
+static Backend *openslow(char const *spec, int flags);
+static void drop(Backend *b);
+
+static ssize_t posixpread(Backend *b, uchar *buf, size_t n, off_t offset);
+static ssize_t posixpwrite(Backend *b, uchar const *buf, size_t n, off_t offset);
+static off_t posixsize(Backend *b);
+static int posixflush(Backend *b);
+static int posixdiscard(Backend *b, off_t offset, off_t len);
+static void posixclose(Backend *b);
+
+static ssize_t mappread(Backend *b, uchar *buf, size_t n, off_t offset);
+static ssize_t mappwrite(Backend *b, uchar const *buf, size_t n, off_t offset);
+static off_t mapsize(Backend *b);
+static int mapflush(Backend *b);
+static int mapdiscard(Backend *b, off_t offset, off_t len);
+static void mapclose(Backend *b);
+
+static ssize_t slowpread(Backend *b, uchar *buf, size_t n, off_t offset);
+static ssize_t slowpwrite(Backend *b, uchar const *buf, size_t n, off_t offset);
+static off_t slowsize(Backend *b);
+static int slowflush(Backend *b);
+static int slowdiscard(Backend *b, off_t offset, off_t len);
+static void slowclose(Backend *b);
+static void slowdown(Backend *b, size_t n);
+
+int
+bopen(char const *spec, int flags)
+{
+	struct stat statbuf;
+	Backend *b;
+
+	if (
+		strncmp(spec, "ram:", 4) != 0
+		&& strncmp(spec, "mmap:", 5) != 0
+		&& strncmp(spec, "slow:", 5) != 0
+	)
+		return open(spec, flags);
+
+	if ((b = open1(spec, flags)) == nil)
+		return -1;
+
+	if (fstat(b->fd, &statbuf) != 0) {
+		b->close(b);
+		return -1;
+	}
+	b->dev = statbuf.st_dev;
+	b->ino = statbuf.st_ino;
+
+	pthread_mutex_lock(&lock);
+	b->next = backends;
+	backends = b;
+	pthread_mutex_unlock(&lock);
+	return b->fd;
+}
+
+// Descriptors are reused once closed: the file must be the same.
+Backend *
+backend(int fd)
+{
+	struct stat statbuf;
+	Backend *b;
+
+	pthread_mutex_lock(&lock);
+	for (b = backends; b != nil && b->fd != fd; b = b->next)
+		;
+	pthread_mutex_unlock(&lock);
+
+	if (b == nil)
+		return nil;
+	if (fstat(fd, &statbuf) != 0 || statbuf.st_dev != b->dev || statbuf.st_ino != b->ino) {
+		drop(b);
+		return nil;
+	}
+	return b;
+}
+
+char const *
+bpath(char const *spec)
+{
+	for (;;) {
+		if (strncmp(spec, "ram:", 4) == 0)
+			return nil;
+		if (strncmp(spec, "mmap:", 5) == 0)
+			spec = &spec[5];
+		else if (strncmp(spec, "slow:", 5) == 0 && strchr(&spec[5], ':') != nil)
+			spec = strchr(&spec[5], ':') + 1;
+		else
+			return spec;
+	}
+}
+
+off_t
+bsize(int fd)
+{
+	Backend *b = backend(fd);
+
+	return b != nil? b->size(b): lseek(fd, 0, SEEK_END);
+}
+
+// Plain descriptors are left to the kernel (as they always were).
+int
+bflush(int fd)
+{
+	Backend *b = backend(fd);
+
+	return b != nil? b->flush(b): 1;
+}
+
+int
+bdiscard(int fd, off_t offset, off_t len)
+{
+	Backend *b = backend(fd);
+
+	if (b != nil)
+		return b->discard(b, offset, len);
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+}
+
+static Backend *
+open1(char const *spec, int flags)
+{
+	if (strncmp(spec, "ram:", 4) == 0)
+		return openmap(&spec[4], flags, 1);
+	if (strncmp(spec, "mmap:", 5) == 0)
+		return openmap(&spec[5], flags, 0);
+	if (strncmp(spec, "slow:", 5) == 0)
+		return openslow(&spec[5], flags);
+	return openposix(spec, flags);
+}
+
+static Backend *
+openposix(char const *path, int flags)
+{
+	Backend *b;
+
+	if ((b = (Backend *)calloc(1, sizeof(Backend))) == nil)
+		return nil;
+
+	if ((b->fd = open(path, flags)) == -1) {
+		free(b);
+		return nil;
+	}
+
+	b->name = "posix";
+	b->pread = posixpread;
+	b->pwrite = posixpwrite;
+	b->size = posixsize;
+	b->flush = posixflush;
+	b->discard = posixdiscard;
+	b->close = posixclose;
+	return b;
+}
+
+// A memfd with a copy of the file, or the file itself, mapped.
+static Backend *
+openmap(char const *path, int flags, int ram)
+{
+	Backend *b;
+	int fd;
+	int prot;
+
+	if ((b = (Backend *)calloc(1, sizeof(Backend))) == nil)
+		return nil;
+	b->fd = -1;
+	b->map = MAP_FAILED;
+
+	fd = open(path, ram? O_RDONLY: flags);
+	do {
+		if (fd == -1 || (b->len = lseek(fd, 0, SEEK_END)) == (off_t)-1)
+			;
+		else if (ram && (b->fd = memfd_create(path, 0)) == -1)
+			;
+		else if (ram && ftruncate(b->fd, b->len) != 0)
+			;
+		else
+			break;
+
+		goto error;
+	} while (0);
+
+	if (!ram) {
+		b->fd = fd;
+		fd = -1;
+	}
+
+	// The memfd is always writable (it is only memory).
+	prot = ram || (flags & O_ACCMODE) != O_RDONLY? PROT_READ | PROT_WRITE: PROT_READ;
+	if (0 < b->len && (b->map = (uchar *)mmap(nil, b->len, prot, MAP_SHARED, b->fd, 0)) == MAP_FAILED)
+		goto error;
+
+	for (off_t pos = 0; ram && pos < b->len;) {
+		size_t count = b->len - pos < RAM_CHUNK? (size_t)(b->len - pos): RAM_CHUNK;
+		ssize_t n = pread(fd, &b->map[pos], count, pos);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			goto error;
+		}
+		pos += n;
+	}
+
+	if (0 <= fd)
+		close(fd);
+
+	b->name = ram? "ram": "mmap";
+	b->pread = mappread;
+	b->pwrite = mappwrite;
+	b->size = mapsize;
+	b->flush = mapflush;
+	b->discard = mapdiscard;
+	b->close = mapclose;
+	return b;
+
+error:
+	{
+		int err = errno;
+
+		if (b->map != MAP_FAILED)
+			munmap(b->map, b->len);
+		if (0 <= fd)
+			close(fd);
+		if (0 <= b->fd)
+			close(b->fd);
+		free(b);
+		errno = err;
+	}
+	return nil;
+}
+
+// "<µs>[,<MB/s>]:<device>"
+static Backend *
+openslow(char const *spec, int flags)
+{
+	Backend *b, *inner;
+	char *endptr;
+	double latency, mbs;
+
+	errno = 0;
+	latency = strtod(spec, &endptr);
+	mbs = 0;
+	if (errno == 0 && *endptr == ',')
+		mbs = strtod(&endptr[1], &endptr);
+	if (errno != 0 || *endptr != ':' || latency < 0 || mbs < 0) {
+		errno = EINVAL;
+		return nil;
+	}
+
+	if ((inner = open1(&endptr[1], flags)) == nil)
+		return nil;
+	if ((b = (Backend *)calloc(1, sizeof(Backend))) == nil) {
+		inner->close(inner);
+		return nil;
+	}
+
+	b->name = "slow";
+	b->fd = inner->fd;
+	b->inner = inner;
+	b->latency = latency / 1e6;
+	b->rate = mbs * 1000 * 1000;
+	b->pread = slowpread;
+	b->pwrite = slowpwrite;
+	b->size = slowsize;
+	b->flush = slowflush;
+	b->discard = slowdiscard;
+	b->close = slowclose;
+	return b;
+}
+
+// Its descriptor is somebody else's by now.
+static void
+drop(Backend *b)
+{
+	Backend **p;
+
+	pthread_mutex_lock(&lock);
+	for (p = &backends; *p != nil && *p != b; p = &(*p)->next)
+		;
+	if (*p != nil)
+		*p = b->next;
+	pthread_mutex_unlock(&lock);
+
+	for (Backend *i = b; i != nil; i = i->inner)
+		i->fd = -1;
+	b->close(b);
+}
+
+static ssize_t
+posixpread(Backend *b, uchar *buf, size_t n, off_t offset)
+{
+	return pread(b->fd, buf, n, offset);
+}
+
+static ssize_t
+posixpwrite(Backend *b, uchar const *buf, size_t n, off_t offset)
+{
+	return pwrite(b->fd, buf, n, offset);
+}
+
+static off_t
+posixsize(Backend *b)
+{
+	return lseek(b->fd, 0, SEEK_END);
+}
+
+static int
+posixflush(Backend *b)
+{
+	return fdatasync(b->fd) == 0;
+}
+
+static int
+posixdiscard(Backend *b, off_t offset, off_t len)
+{
+	return fallocate(b->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+}
+
+static void
+posixclose(Backend *b)
+{
+	if (0 <= b->fd)
+		close(b->fd);
+	free(b);
+}
+
+static ssize_t
+mappread(Backend *b, uchar *buf, size_t n, off_t offset)
+{
+	if (b->len <= offset)
+		return 0;
+	if (b->len - offset < (off_t)n)
+		n = b->len - offset;
+
+	memcpy(buf, &b->map[offset], n);
+	return n;
+}
+
+// Mappings do not grow.
+static ssize_t
+mappwrite(Backend *b, uchar const *buf, size_t n, off_t offset)
+{
+	if (b->len <= offset) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (b->len - offset < (off_t)n)
+		n = b->len - offset;
+
+	memcpy(&b->map[offset], buf, n);
+	return n;
+}
+
+static off_t
+mapsize(Backend *b)
+{
+	return b->len;
+}
+
+static int
+mapflush(Backend *b)
+{
+	return b->len == 0 || msync(b->map, b->len, MS_SYNC) == 0;
+}
+
+static int
+mapdiscard(Backend *b, off_t offset, off_t len)
+{
+	if (b->len < offset + len) {
+		errno = ENOSPC;
+		return 0;
+	}
+
+	memset(&b->map[offset], 0, len);
+	return 1;
+}
+
+static void
+mapclose(Backend *b)
+{
+	if (0 < b->len)
+		munmap(b->map, b->len);
+	if (0 <= b->fd)
+		close(b->fd);
+	free(b);
+}
+
+static ssize_t
+slowpread(Backend *b, uchar *buf, size_t n, off_t offset)
+{
+	ssize_t done = b->inner->pread(b->inner, buf, n, offset);
+
+	slowdown(b, done < 0? 0: done);
+	return done;
+}
+
+static ssize_t
+slowpwrite(Backend *b, uchar const *buf, size_t n, off_t offset)
+{
+	ssize_t done = b->inner->pwrite(b->inner, buf, n, offset);
+
+	slowdown(b, done < 0? 0: done);
+	return done;
+}
+
+static off_t
+slowsize(Backend *b)
+{
+	return b->inner->size(b->inner);
+}
+
+static int
+slowflush(Backend *b)
+{
+	slowdown(b, 0);
+	return b->inner->flush(b->inner);
+}
+
+static int
+slowdiscard(Backend *b, off_t offset, off_t len)
+{
+	slowdown(b, 0);
+	return b->inner->discard(b->inner, offset, len);
+}
+
+static void
+slowclose(Backend *b)
+{
+	b->inner->close(b->inner);
+	free(b);
+}
+
+// One I/O at a time, as a single queue device.
+static void
+slowdown(Backend *b, size_t n)
+{
+	struct timespec ts;
+	double t;
+
+	t = b->latency + (0 < b->rate? n / b->rate: 0);
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+
+	pthread_mutex_lock(&device);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+	pthread_mutex_unlock(&device);
+}
@@ -0,0 +1,48 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// Storage backends. Besides a path, the devices can be given as
+//	ram:<file>	a copy of the file in memory (nothing is written back)
+//	mmap:<file>	the file, mapped in memory
+//	slow:<µs>[,<MB/s>]:<device>	with latency (and bandwidth) per I/O
+// Every backend is still a file descriptor (the file, or a memfd), so
+// that locks, fstat... keep working. The data goes through the backend
+// in preadfull, pwritefull, bsize, bflush and bdiscard; anything else
+// sees the same data, but not the latency.
+
+typedef struct Backend Backend;
+
+struct Backend {
+	char const *name;
+	ssize_t (*pread)(Backend *b, uchar *buf, size_t n, off_t offset);
+	ssize_t (*pwrite)(Backend *b, uchar const *buf, size_t n, off_t offset);
+	off_t (*size)(Backend *b);
+	int (*flush)(Backend *b);
+	int (*discard)(Backend *b, off_t offset, off_t len);
+	void (*close)(Backend *b);
+
+	int fd;
+	dev_t dev; // To tell a reused descriptor.
+	ino_t ino;
+
+	// ram, mmap.
+	uchar *map;
+	off_t len;
+
+	// slow.
+	Backend *inner;
+	double latency; // s.
+	double rate; // B/s (0 for no limit).
+
+	Backend *next;
+};
+
+// It returns the descriptor, or -1 (with errno set).
+int bopen(char const *spec, int flags);
+Backend *backend(int fd); // nil for plain descriptors.
+// The file behind the device (nil if it is only in memory).
+char const *bpath(char const *spec);
+off_t bsize(int fd);
+int bflush(int fd);
+int bdiscard(int fd, off_t offset, off_t len);
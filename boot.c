@@ -5,13 +5,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "u.h"
 #include "f7disk.h"
 #include "ptable.h"
+#include "copy.h"
+#include "hash.h"
+#include "merkle.h"
+#include "digest.h"
+#include "backend.h"
+#include "iolimit.h"
 
 void
 f7_cpboot(int argc, char **argv)
@@ -19,19 +27,33 @@ f7_cpboot(int argc, char **argv)
 	off_t size[2], reqsectors;
 	int fd[2];
 	PartEntry p[4];
+	int sector;
+	int kinds = 0;
 
 	fd[0] = -1;
 	fd[1] = -1;
 
-	if (argc != 4) {
+	if (argc < 4) {
 		usage();
 		goto cleanup;
 	}
+	if (5 <= argc && strcmp(argv[4], "--digest") == 0) {
+		if (argc < 6 || (kinds = digestkinds(argv[5])) == 0) {
+			usage();
+			goto cleanup;
+		}
+		ioargs(argc, argv, 6);
+	} else {
+		ioargs(argc, argv, 4);
+	}
 
-	fd[0] = open(argv[2], O_RDWR);
+	fd[0] = devopen(argv[2], O_RDWR);
 	if (fd[0] == -1)
 		goto openerror;
-	fd[1] = open(argv[3], O_RDONLY);
+	if (strcmp(argv[3], "-") == 0)
+		fd[1] = dup(STDIN_FILENO);
+	else
+		fd[1] = open(argv[3], O_RDONLY);
 	if (fd[1] == -1)
 		goto openerror;
 
@@ -39,10 +61,8 @@ f7_cpboot(int argc, char **argv)
 		goto cleanup;
 
 	do {
-		if ((size[0] = lseek(fd[0], 0, SEEK_END)) == (off_t)-1)
+		if ((size[0] = bsize(fd[0])) == (off_t)-1)
 			perror("Could not retrieve the drive file size");
-		else if ((off_t)-1 == lseek(fd[0], 0, SEEK_SET))
-			perror("Could not seek the drive file offset");
 		else
 			break;
 
@@ -65,12 +85,14 @@ f7_cpboot(int argc, char **argv)
 		goto cleanup;
 	} while (0);
 
-	reqsectors = size[1] / 512 + (size[1] % 512 != 0? 1: 0);
-	if (size[0] / 512 < reqsectors) {
+	// In the LBA unit of the partition table.
+	sector = lbasize(fd[0]);
+	reqsectors = size[1] / sector + (size[1] % sector != 0? 1: 0);
+	if (size[0] / sector < reqsectors) {
 		fprintf(
 			stderr
 			, "The drive has not enough sectors (%ld < %jd).\n"
-			, size[0] / 512
+			, size[0] / sector
 			, reqsectors
 		);
 
@@ -102,117 +124,60 @@ f7_cpboot(int argc, char **argv)
 		}
 	}
 
-	do {
+	{
 		ssize_t n;
-		size_t count;
-		off_t rem;
-		struct stat statbuf;
-		uchar *buf;
+		uchar mbr[512];
+		Copy c;
+		Digest d;
+		int ok;
 
+		n = preadfull(fd[1], mbr, 512, 0);
 		do {
-			if (fstat(fd[0], &statbuf) < 0)
-				perror("Could not use stat over the file");
-			else if ((buf = (uchar *)malloc(statbuf.st_blksize)) == nil)
-				fprintf(stderr, "Could not allocate the copy buffer.\n");
+			if (n < 0)
+				perror("Could not read the bootloader");
+			else if (n < 512)
+				fprintf(stderr, "Could not read the MBR of the bootloader.\n");
+			else if (mbr[510] != 0x55 || mbr[511] != 0xAA)
+				fprintf(stderr, "MBR magic number not found in the bootloader.\n");
+			// Just before the disk signature.
+			else if (pwritefull(fd[0], mbr, 0x1B8, 0) < 0x1B8)
+				perror("Could not copy the MBR");
+			// Just after the partition table.
+			else if (pwritefull(fd[0], &mbr[0x1FE], 2, 0x1FE) < 2)
+				perror("Could not copy the MBR");
 			else
 				break;
 
 			goto cleanup;
 		} while (0);
 
-		size[1] -= (6 + 4 * 16);
-		rem = size[1];
-		{
-			count = 512;
-			n = read(fd[1], buf, count);
-			if ((size_t)n == count) do {
-				if (buf[510] != 0x55 || buf[511] != 0xAA) {
-					fprintf(stderr, "MBR magic number not found in the bootloader.\n");
-					goto rwerror;
-				}
-
-				// Just before the disk signature.
-				count = 0x1B8;
-				n = write(fd[0], buf, count);
-				if (0 < n)
-					rem -= n;
-
-				if ((size_t)n != count)
-					break;
-
-				// Just after the partition table.
-				if ((off_t)-1 == lseek(fd[0], 0x1FE, SEEK_SET)) {
-					perror("Could not seek the drive file offset");
-					goto rwerror;
-				}
-
-				count = 2;
-				n = write(fd[0], &buf[0x1FE], count);
-				if (0 < n)
-					rem -= n;
-			} while(0);
-
-			do {
-				if (n < 0)
-					perror("Could not copy the MBR");
-				else if ((size_t)n < count)
-					fprintf(stderr, "Could not copy the MBR.\n");
-				else
-					break;
-
-				if (rem < size[1])
-					fprintf(
-						stderr
-						, "WARNING: %jd/%jd bytes were actually copied.\n"
-						, rem
-						, size[1]
-					);
-
-				goto rwerror;
-			} while(0);
-		}
-
-		while (0 < rem) {
-			if (statbuf.st_blksize < rem)
-				count = statbuf.st_blksize;
-			else
-				count = rem;
-
-			n = read(fd[1], buf, count);
-			if ((size_t)n == count) {
-				n = write(fd[0], buf, count);
-				if (0 < n)
-					rem -= n;
-			}
-
-			do {
-				if (n < 0)
-					perror("Could not copy the whole bootloader");
-				else if ((size_t)n < count)
-					fprintf(stderr, "Could not copy the whole bootloader.\n");
-				else
-					break;
-
-				fprintf(
-					stderr
-					, "WARNING: %jd/%jd bytes were actually copied.\n"
-					, rem
-					, size[1]
-				);
-
-				goto rwerror;
-			} while(0);
+		copyinit(&c, fd[0], fd[1], "bootloader");
+		c.dstoff = 512;
+		c.srcoff = 512;
+		c.size = size[1] - 512;
+
+		// Of the whole bootloader, as read (the MBR too).
+		if (kinds != 0) {
+			if (!digeststart(&d, kinds, nil))
+				goto cleanup;
+			digestfeed(&d, mbr, 512);
+			c.observe = digestfeed;
+			c.wait = digestwait;
+			c.arg = &d;
+			c.behind = DIGEST_BEHIND;
 		}
-
-		free(buf);
-		break;
-rwerror:
-		free(buf);
-		goto cleanup;
-	} while(0);
+		ok = copydata(&c);
+		if (kinds != 0)
+			digestend(&d);
+		if (!ok)
+			goto cleanup;
+		if (kinds != 0)
+			digestprint(&d, stdout);
+	}
 
 	close(fd[1]);
 	close(fd[0]);
+	iostats();
 	return;
 
 openerror:
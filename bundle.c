@@ -0,0 +1,587 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "f7disk.h"
+#include "ptable.h"
+#include "f7part.h"
+#include "copy.h"
+#include "hash.h"
+#include "merkle.h"
+#include "compress.h"
+#include "cache.h"
+#include "iolimit.h"
+#include "bundle.h"
+#include "probe.h"
+
+// The index (little endian):
+//	0	"F7BUNDLE"
+//	8	version (1), reserved (3 bytes)
+//	12	number of entries
+//	16	alignment of the payloads
+//	24	XXH64 of the entries
+//	32	XXH64 of the above
+// and then, from B_HEADER, an entry per slot:
+//	0	slot
+//	4	flags (BUNDLE_LZ4)
+//	8	offset of the payload
+//	16	length of the payload
+//	24	root of the hash index of the payload (as stored)
+// The payloads follow the index, aligned, in the order of the entries
+// (so that a bundle can be streamed).
+
+#define B_MAGIC "F7BUNDLE"
+#define B_HEADER 64
+#define B_ENTRY 32
+#define B_ALIGN 4096
+#define B_SKIP (64 * 1024)
+// What a compressed payload may take (there is no slot to limit it).
+#define B_LIMIT (LBA_MAX * SECTOR_MAX)
+
+typedef struct {
+	int fd;
+	char const *file;
+} Image;
+
+static int cmpentry(void const *a, void const *b);
+static ssize_t readat(int fd, int stream, uchar *buf, size_t len, off_t offset);
+static ssize_t readimage(void *arg, uchar *buf, size_t len);
+static void feed(void *arg, uchar const *buf, size_t len);
+static int skipto(int fd, off_t *pos, off_t offset);
+
+int
+bundleread(int fd, int stream, Bundle *b)
+{
+	uchar head[B_HEADER];
+	uchar *index;
+	ssize_t n;
+	off_t end;
+
+	memset(b, 0, sizeof(*b));
+
+	n = readat(fd, stream, head, B_HEADER, 0);
+	do {
+		if (n < 0)
+			perror("Could not read the bundle");
+		else if (n != B_HEADER || memcmp(head, B_MAGIC, 8) != 0)
+			fprintf(stderr, "Not a bundle (F7BUNDLE).\n");
+		else if (head[8] != 0x01)
+			fprintf(stderr, "Unknown bundle version (%d).\n", head[8]);
+		else if (getle(&head[32], 8) != xxh64(head, 32, 0))
+			fprintf(stderr, "The bundle index is corrupted.\n");
+		else
+			break;
+
+		return 0;
+	} while (0);
+
+	b->n = getle(&head[12], 4);
+	b->align = getle(&head[16], 8);
+	b->index = B_HEADER + (off_t)b->n * B_ENTRY;
+	if (
+		b->n < 1 || F7_SLOTS_MAX < b->n
+		|| b->align < 512 || ERASE_MAX < b->align || b->align % 512 != 0
+	) {
+		fprintf(stderr, "The bundle index is corrupted.\n");
+		return 0;
+	}
+
+	if ((index = (uchar *)malloc(b->n * B_ENTRY)) == nil) {
+		fprintf(stderr, "Could not allocate the bundle index.\n");
+		return 0;
+	}
+	n = readat(fd, stream, index, b->n * B_ENTRY, B_HEADER);
+	do {
+		if (n < 0)
+			perror("Could not read the bundle");
+		else if (n != b->n * B_ENTRY)
+			fprintf(stderr, "The bundle is truncated.\n");
+		else if (getle(&head[24], 8) != xxh64(index, b->n * B_ENTRY, 0))
+			fprintf(stderr, "The bundle index is corrupted.\n");
+		else if ((b->e = (BundleEntry *)calloc(b->n, sizeof(BundleEntry))) == nil)
+			fprintf(stderr, "Could not allocate the bundle index.\n");
+		else
+			break;
+
+		free(index);
+		return 0;
+	} while (0);
+
+	// In order, aligned and without overlapping.
+	end = b->index;
+	for (int i = 0; i < b->n; ++i) {
+		uchar const *p = &index[i * B_ENTRY];
+		BundleEntry *e = &b->e[i];
+
+		e->slot = getle(&p[0], 4);
+		e->flags = getle(&p[4], 4);
+		e->offset = getle(&p[8], 8);
+		e->length = getle(&p[16], 8);
+		e->hash = getle(&p[24], 8);
+
+		if (
+			e->slot < 0 || F7_SLOTS_MAX <= e->slot
+			|| (0 < i && e->slot <= e[-1].slot)
+			|| (e->flags & ~BUNDLE_LZ4) != 0
+			|| e->offset < end || e->offset % b->align != 0
+			|| e->length < 0 || B_LIMIT < e->length
+		) {
+			fprintf(stderr, "The bundle index is corrupted.\n");
+			free(index);
+			bundlefree(b);
+			return 0;
+		}
+		end = e->offset + e->length;
+	}
+
+	free(index);
+	return 1;
+}
+
+void
+bundlefree(Bundle *b)
+{
+	free(b->e);
+	b->e = nil;
+}
+
+void
+f7_mkbundle(int argc, char **argv)
+{
+	Bundle b;
+	Image *img;
+	uchar *index, head[B_HEADER];
+	off_t pos;
+	int out;
+	int compress = 0;
+	int i;
+
+	if (argc < 4) {
+		usage();
+		exit(1);
+	}
+
+	// "<slot>=<image>" up to the options.
+	for (b.n = 0; 3 + b.n < argc && strncmp(argv[3 + b.n], "--", 2) != 0; ++b.n)
+		;
+	i = 3 + b.n;
+	if (i < argc && strcmp(argv[i], "--store-compressed") == 0) {
+		compress = 1;
+		i += 1;
+	}
+	ioargs(argc, argv, i);
+	if (b.n == 0 || F7_SLOTS_MAX < b.n) {
+		usage();
+		exit(1);
+	}
+
+	b.align = B_ALIGN;
+	b.index = B_HEADER + (off_t)b.n * B_ENTRY;
+	b.e = (BundleEntry *)calloc(b.n, sizeof(BundleEntry));
+	img = (Image *)calloc(b.n, sizeof(Image));
+	index = (uchar *)calloc(b.n, B_ENTRY);
+	if (b.e == nil || img == nil || index == nil) {
+		fprintf(stderr, "Could not allocate the bundle index.\n");
+		exit(1);
+	}
+
+	for (int k = 0; k < b.n; ++k) {
+		char *eq = strchr(argv[3 + k], '=');
+
+		if (eq == nil || eq == argv[3 + k] || eq[1] == '\0') {
+			usage();
+			exit(1);
+		}
+		*eq = '\0';
+		b.e[k].slot = atol2(argv[3 + k]);
+		b.e[k].flags = compress? BUNDLE_LZ4: 0;
+		// The image, for now (cmpentry keeps it with its slot).
+		b.e[k].offset = k;
+		if (b.e[k].slot < 0 || F7_SLOTS_MAX <= b.e[k].slot) {
+			usage();
+			exit(1);
+		}
+		img[k].file = &eq[1];
+		img[k].fd = -1;
+	}
+	qsort(b.e, b.n, sizeof(BundleEntry), cmpentry);
+	for (int k = 1; k < b.n; ++k)
+		if (b.e[k].slot == b.e[k - 1].slot) {
+			fprintf(stderr, "The slot #%d is given twice.\n", b.e[k].slot);
+			exit(1);
+		}
+
+	out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out == -1) {
+		fprintf(stderr, "Cannot open the bundle %s: %s\n", argv[2], strerror(errno));
+		exit(1);
+	}
+
+	pos = (b.index + B_ALIGN - 1) / B_ALIGN * B_ALIGN;
+	for (int k = 0; k < b.n; ++k) {
+		BundleEntry *e = &b.e[k];
+		Image *im = &img[e->offset];
+		Merkle m;
+		char cpath[PATH_MAX], now[PATH_MAX];
+		int cacheable, cached;
+		int ok;
+
+		if (strcmp(im->file, "-") == 0)
+			im->fd = dup(STDIN_FILENO);
+		else
+			im->fd = open(im->file, O_RDONLY);
+		if (im->fd == -1) {
+			fprintf(stderr, "Cannot open the payload %s: %s\n", im->file, strerror(errno));
+			close(out);
+			exit(1);
+		}
+
+		merkleinit(&m, 0);
+		// What is stored compressed is not the payload (as hashed).
+		cacheable = !compress && cachepath(im->fd, cpath, sizeof(cpath));
+		cached = cacheable && cacheload(cpath, &m, 0);
+		if (compress) {
+			off_t raw;
+
+			e->length = zstore(out, pos, B_LIMIT, readimage, im, &m, &raw);
+			ok = 0 <= e->length;
+		} else {
+			Copy c;
+
+			// A stream, so that pipes and FIFOs are payloads too.
+			copyinit(&c, out, im->fd, "payload");
+			c.dstoff = pos;
+			c.size = B_LIMIT;
+			c.stream = 1;
+			c.observe = cached? nil: feed;
+			c.arg = &m;
+			ok = copydata(&c);
+			e->length = c.copied;
+		}
+
+		if (ok && cacheable && (!cachepath(im->fd, now, sizeof(now)) || strcmp(now, cpath) != 0)) {
+			fprintf(stderr, "The payload %s has changed while it was read.\n", im->file);
+			ok = 0;
+		}
+		close(im->fd);
+
+		if (!ok || !merklefinish(&m)) {
+			merklefree(&m);
+			close(out);
+			exit(1);
+		}
+		if (cacheable && !cached)
+			cachesave(cpath, &m);
+		e->offset = pos;
+		e->hash = merkleroot(&m);
+		merklefree(&m);
+
+		printf(
+			"Slot #%d = %jd bytes%s\n"
+			, e->slot
+			, (intmax_t)e->length
+			, compress? " (stored compressed)": ""
+		);
+		pos = (pos + e->length + B_ALIGN - 1) / B_ALIGN * B_ALIGN;
+	}
+
+	for (int k = 0; k < b.n; ++k) {
+		uchar *p = &index[k * B_ENTRY];
+
+		putle(&p[0], b.e[k].slot, 4);
+		putle(&p[4], b.e[k].flags, 4);
+		putle(&p[8], b.e[k].offset, 8);
+		putle(&p[16], b.e[k].length, 8);
+		putle(&p[24], b.e[k].hash, 8);
+	}
+	memset(head, 0, B_HEADER);
+	memcpy(head, B_MAGIC, 8);
+	head[8] = 0x01;
+	putle(&head[12], b.n, 4);
+	putle(&head[16], b.align, 8);
+	putle(&head[24], xxh64(index, b.n * B_ENTRY, 0), 8);
+	putle(&head[32], xxh64(head, 32, 0), 8);
+
+	do {
+		if (pwritefull(out, head, B_HEADER, 0) != B_HEADER)
+			perror("Could not write the bundle index");
+		else if (pwritefull(out, index, b.n * B_ENTRY, B_HEADER) != b.n * B_ENTRY)
+			perror("Could not write the bundle index");
+		else if (ftruncate(out, pos) != 0)
+			perror("Could not set the bundle size");
+		else if (close(out) != 0)
+			perror("Could not write the bundle");
+		else
+			break;
+
+		exit(1);
+	} while (0);
+	iostats();
+
+	free(index);
+	free(img);
+	bundlefree(&b);
+}
+
+// The slots are written in ascending offsets, as the payloads come,
+// and they are only marked as active (all at once) if every one
+// of them matches its hash.
+void
+f7_loadbundle(int argc, char **argv)
+{
+	int fd, bfd;
+	int entry;
+	int stream;
+	PartEntry p[4];
+	uchar header[F7_HEADER_MAX];
+	MetaF7 meta;
+	uvlong set[F7_SLOTS_MAX / 64];
+	Bundle b;
+	off_t first, last, pos;
+	vlong awrites, uwrites;
+	off_t erase;
+	int lock;
+	int ok;
+
+	if (argc < 5) {
+		usage();
+		exit(1);
+	}
+	ioargs(argc, argv, 5);
+
+	entry = atol2(argv[3]);
+	if (entry < 0 || 3 < entry) {
+		usage();
+		exit(1);
+	}
+
+	if (strcmp(argv[4], "-") == 0)
+		bfd = dup(STDIN_FILENO);
+	else
+		bfd = open(argv[4], O_RDONLY);
+	if (bfd == -1) {
+		fprintf(stderr, "Cannot open the bundle %s: %s\n", argv[4], strerror(errno));
+		exit(1);
+	}
+	stream = lseek(bfd, 0, SEEK_CUR) == (off_t)-1;
+	if (!bundleread(bfd, stream, &b)) {
+		close(bfd);
+		exit(1);
+	}
+
+	fd = devopen(argv[2], O_RDWR);
+	if (fd == -1) {
+		perror("Cannot open the requested device/image file");
+		bundlefree(&b);
+		close(bfd);
+		exit(1);
+	}
+	erase = erasesize(fd);
+	if (erase % 512 != 0 || ERASE_MAX < erase)
+		erase = 0;
+
+	if (
+		!read_ptable(fd, p)
+		|| !f7_read_header(fd, p, entry, header)
+		|| !f7_retrieve_meta(header, &meta)
+	) {
+		bundlefree(&b);
+		close(bfd);
+		close(fd);
+		exit(1);
+	}
+
+	// Everything is checked before anything is written.
+	memset(set, 0, sizeof(set));
+	for (int i = 0; i < b.n; ++i) {
+		BundleEntry const *e = &b.e[i];
+
+		do {
+			if (meta.count <= e->slot)
+				fprintf(stderr, "There is only %d slots.\n", meta.count);
+			else if (f7_active(&meta, e->slot))
+				fprintf(stderr, "The slot #%d was already active.\n", e->slot);
+			else if (meta.size * meta.sector < e->length)
+				fprintf(stderr, "The payload of the slot #%d exceeds the slot capacity.\n", e->slot);
+			else
+				break;
+
+			bundlefree(&b);
+			close(bfd);
+			close(fd);
+			exit(1);
+		} while (0);
+		set[e->slot / 64] |= (uvlong)0x1 << e->slot % 64;
+	}
+
+	// The slots in between too (a single lock).
+	first = f7_slotoffset(p, entry, &meta, b.e[0].slot);
+	last = f7_slotoffset(p, entry, &meta, b.e[b.n - 1].slot) + meta.size * meta.sector;
+	lock = devlock(fd, first, last - first, F_WRLCK, 0, "slots");
+	ok = 0 <= lock && f7_reread(fd, p, entry, &meta);
+	for (int i = 0; ok && i < b.n; ++i)
+		if (f7_active(&meta, b.e[i].slot)) {
+			fprintf(stderr, "The slot #%d was already active.\n", b.e[i].slot);
+			ok = 0;
+		}
+	if (!ok) {
+		devunlock(lock);
+		bundlefree(&b);
+		close(bfd);
+		close(fd);
+		exit(1);
+	}
+
+	pos = b.index;
+	awrites = 0;
+	uwrites = 0;
+	for (int i = 0; ok && i < b.n; ++i) {
+		BundleEntry const *e = &b.e[i];
+		off_t offset = f7_slotoffset(p, entry, &meta, e->slot);
+		char idx[PATH_MAX];
+		int indexed;
+		Merkle m;
+		Copy c;
+
+		if (stream && !(ok = skipto(bfd, &pos, e->offset)))
+			break;
+
+		// Any previous index is stale from now on.
+		indexed = merklepath(fd, argv[2], p, entry, e->slot, idx, sizeof(idx));
+		if (indexed)
+			merkledrop(idx);
+		merkleinit(&m, offset);
+
+		PROBE4(slot_start, entry, e->slot, offset, e->length);
+		PROBECLOCK(slot_end, t);
+
+		copyinit(&c, fd, bfd, "payload");
+		c.dstoff = offset;
+		c.srcoff = e->offset;
+		c.size = e->length;
+		c.stream = stream;
+		c.prefix = stream;
+		c.erase = erase;
+		c.observe = feed;
+		c.arg = &m;
+		ok = copydata(&c);
+		pos += c.copied;
+		awrites += c.aligned;
+		uwrites += c.unaligned;
+
+		do {
+			if (!ok)
+				;
+			else if (c.copied + c.cloned != e->length)
+				fprintf(stderr, "The bundle is truncated.\n");
+			else if (!merklefinish(&m))
+				;
+			else if (merkleroot(&m) != e->hash)
+				fprintf(stderr, "The payload of the slot #%d does not match its hash.\n", e->slot);
+			else
+				break;
+
+			ok = 0;
+		} while (0);
+
+		if (ok) {
+			PROBE4(slot_end, entry, e->slot, e->length, PROBENS(t));
+			// The index is not essential (it only warns).
+			if (indexed)
+				merklesave(&m, idx);
+			printf(
+				"Slot #%d = %jd bytes%s\n"
+				, e->slot
+				, (intmax_t)e->length
+				, (e->flags & BUNDLE_LZ4) != 0? " (stored compressed)": ""
+			);
+		}
+		merklefree(&m);
+	}
+
+	if (ok) {
+		if (0 < erase) {
+			printf("Erase block = %jd bytes\n", (intmax_t)erase);
+			printf("Writes = %lld aligned, %lld unaligned\n", awrites, uwrites);
+		}
+		iostats();
+		ok = f7_commitset(fd, p, entry, &meta, set);
+	}
+
+	devunlock(lock);
+	bundlefree(&b);
+	close(bfd);
+	close(fd);
+	if (!ok)
+		exit(1);
+}
+
+static int
+cmpentry(void const *a, void const *b)
+{
+	int x = ((BundleEntry const *)a)->slot;
+	int y = ((BundleEntry const *)b)->slot;
+
+	return x < y? -1: y < x? 1: 0;
+}
+
+// A stream is read in order (offset is where it should be).
+static ssize_t
+readat(int fd, int stream, uchar *buf, size_t len, off_t offset)
+{
+	if (stream)
+		return readfull(fd, buf, len);
+	return preadfull(fd, buf, len, offset);
+}
+
+static ssize_t
+readimage(void *arg, uchar *buf, size_t len)
+{
+	Image *im = (Image *)arg;
+	ssize_t n;
+
+	while ((n = read(im->fd, buf, len)) == -1 && errno == EINTR)
+		;
+	if (n == -1)
+		fprintf(stderr, "Could not read the payload %s: %s\n", im->file, strerror(errno));
+	return n;
+}
+
+static void
+feed(void *arg, uchar const *buf, size_t len)
+{
+	merklefeed((Merkle *)arg, buf, len);
+}
+
+// The padding of a streamed bundle is read and dropped.
+static int
+skipto(int fd, off_t *pos, off_t offset)
+{
+	static uchar buf[B_SKIP];
+
+	while (*pos < offset) {
+		size_t count = offset - *pos < B_SKIP? offset - *pos: B_SKIP;
+		ssize_t n = readfull(fd, buf, count);
+
+		if (n != (ssize_t)count) {
+			if (n < 0)
+				perror("Could not read the bundle");
+			else
+				fprintf(stderr, "The bundle is truncated.\n");
+			return 0;
+		}
+		*pos += n;
+	}
+	return 1;
+}
@@ -0,0 +1,28 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// Bundles: the payloads of many slots in a single file (mkbundle),
+// loaded with a single open, header parse and commit (load-bundle).
+
+#define BUNDLE_LZ4 0x1 // Stored compressed (as load --store-compressed).
+
+typedef struct {
+	int slot;
+	int flags;
+	off_t offset; // Of the payload, in the bundle.
+	off_t length;
+	uvlong hash; // The root of the hash index of the payload.
+} BundleEntry;
+
+// The entries are in ascending slot (and offset) order.
+typedef struct {
+	int n;
+	off_t align;
+	off_t index; // Length of the index (where the payloads may start).
+	BundleEntry *e;
+} Bundle;
+
+// It reads the index (from the beginning of a stream), or complains.
+int bundleread(int fd, int stream, Bundle *b);
+void bundlefree(Bundle *b);
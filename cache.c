@@ -0,0 +1,115 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "ptable.h"
+#include "hash.h"
+#include "merkle.h"
+#include "cache.h"
+
+#define CACHE_DIR "f7disk"
+
+static int cachedir(char *dir, size_t len);
+
+int
+cachepath(int fd, char *path, size_t len)
+{
+	struct stat st;
+	char dir[PATH_MAX];
+	int n;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !cachedir(dir, sizeof(dir)))
+		return 0;
+
+	n = snprintf(
+		path
+		, len
+		, "%s/%jx-%jx-%jd-%lld.f7idx"
+		, dir
+		, (uintmax_t)st.st_dev
+		, (uintmax_t)st.st_ino
+		, (intmax_t)st.st_size
+		, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec
+	);
+	return 0 < n && (size_t)n < len;
+}
+
+// The entries are stored as the index of a slot at offset 0.
+int
+cacheload(char const *path, Merkle *m, off_t offset)
+{
+	if (!merkleload(m, path, 0)) {
+		merkleinit(m, offset);
+		return 0;
+	}
+
+	m->offset = offset;
+	m->stamp = time(nil);
+	return 1;
+}
+
+void
+cachesave(char const *path, Merkle const *m)
+{
+	Merkle entry = *m;
+	char const *name;
+	char dir[PATH_MAX];
+	size_t prefix;
+	DIR *d;
+	struct dirent *de;
+
+	entry.offset = 0;
+	if (!merklesave(&entry, path))
+		return;
+
+	// "<dev>-<inode>-" is the file, whatever its version.
+	name = strrchr(path, '/') + 1;
+	prefix = strchr(strchr(name, '-') + 1, '-') + 1 - name;
+	snprintf(dir, sizeof(dir), "%.*s", (int)(name - path - 1), path);
+	if ((d = opendir(dir)) == nil)
+		return;
+	while ((de = readdir(d)) != nil)
+		if (strncmp(de->d_name, name, prefix) == 0 && strcmp(de->d_name, name) != 0)
+			unlinkat(dirfd(d), de->d_name, 0);
+	closedir(d);
+}
+
+// It is created if needed (but not its parents, other than ~/.cache).
+static int
+cachedir(char *dir, size_t len)
+{
+	char const *env;
+	int n;
+
+	if ((env = getenv("F7DISK_CACHE")) != nil) {
+		if (*env == '\0')
+			return 0;
+		n = snprintf(dir, len, "%s", env);
+	} else if ((env = getenv("XDG_CACHE_HOME")) != nil && *env != '\0') {
+		n = snprintf(dir, len, "%s/" CACHE_DIR, env);
+	} else if ((env = getenv("HOME")) != nil && *env != '\0') {
+		n = snprintf(dir, len, "%s/.cache", env);
+		if (0 < n && (size_t)n < len)
+			mkdir(dir, 0755);
+		n = snprintf(dir, len, "%s/.cache/" CACHE_DIR, env);
+	} else {
+		return 0;
+	}
+
+	if (n <= 0 || len <= (size_t)n)
+		return 0;
+	return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
@@ -0,0 +1,15 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// The hash cache of the payloads: the hash index of every payload file
+// loaded, as "<dev>-<inode>-<size>-<mtime ns>.f7idx" in $F7DISK_CACHE
+// ($XDG_CACHE_HOME/f7disk or ~/.cache/f7disk; empty to disable it),
+// so that an unchanged payload is not hashed (or read) again.
+
+// The entry of the payload as it is now (0 if it cannot be cached).
+int cachepath(int fd, char *path, size_t len);
+// As merkleload, for the slot at 'offset'.
+int cacheload(char const *path, Merkle *m, off_t offset);
+// It replaces the entries of older versions of the file.
+void cachesave(char const *path, Merkle const *m);
@@ -0,0 +1,489 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "ptable.h"
+#include "hash.h"
+#include "merkle.h"
+#include "copy.h"
+#include "iolimit.h"
+#include "lz4.h"
+#include "compress.h"
+
+// The descriptor (little endian):
+//	0	"F7LZ"
+//	4	version (1), block shift, reserved (2 bytes)
+//	8	raw length
+//	16	number of blocks
+//	24	offset of the block index
+//	32	stored length
+//	40	XXH64 of the block index
+//	48	XXH64 of the above
+// The blocks start at Z_HEADER, back to back; every index entry is
+// the stored length (Z_RAW if it is not compressed), the raw length
+// and the XXH64 of the raw data.
+
+#define Z_MAGIC "F7LZ"
+#define Z_DESC 56
+#define Z_HEADER 4096 // The blocks start aligned.
+#define Z_SHIFT 20 // 1 MiB blocks.
+#define Z_ENTRY 16
+#define Z_RAW 0x80000000U
+#define Z_BATCH 16 // Blocks per round (and threads, at most).
+// The beginning of the payload is written at the end, with the descriptor
+// (this much, so that the first block of the hash index is also complete).
+#define Z_FIRST ((off_t)1 << MERKLE_SHIFT)
+
+typedef struct {
+	int decompress;
+	int nthreads;
+	int n;
+	int block;
+	uchar *raw[Z_BATCH];
+	int rawlen[Z_BATCH];
+	uchar *cmp[Z_BATCH];
+	int cmplen[Z_BATCH];
+	int israw[Z_BATCH];
+	uvlong hash[Z_BATCH];
+	int bad[Z_BATCH];
+	int *tables[Z_BATCH];
+	// The allocations.
+	uchar *rawbuf;
+	uchar *cmpbuf;
+	int *tablebuf;
+} Zbatch;
+
+typedef struct {
+	Zbatch *b;
+	int t;
+} Zjob;
+
+typedef struct {
+	int fd;
+	off_t offset;
+	off_t limit;
+	off_t pos;
+	uchar *head;
+	Merkle *m;
+} Zout;
+
+static int batchinit(Zbatch *b, int decompress, int shift);
+static void batchfree(Zbatch *b);
+static void runbatch(Zbatch *b);
+static void *work(void *arg);
+static ssize_t fill(ssize_t (*read)(void *arg, uchar *buf, size_t len), void *arg, uchar *buf, size_t len);
+static int put(Zout *o, uchar const *buf, size_t len);
+
+int
+zprobe(int fd, off_t offset, Zhead *h)
+{
+	uchar desc[Z_DESC];
+
+	if (preadfull(fd, desc, Z_DESC, offset) != Z_DESC)
+		return 0;
+
+	if (
+		memcmp(desc, Z_MAGIC, 4) != 0
+		|| desc[4] != 0x01
+		|| getle(&desc[48], 8) != xxh64(desc, 48, 0)
+	)
+		return 0;
+
+	h->shift = desc[5];
+	h->raw = getle(&desc[8], 8);
+	h->nblocks = getle(&desc[16], 8);
+	h->index = getle(&desc[24], 8);
+	h->stored = getle(&desc[32], 8);
+	h->indexhash = getle(&desc[40], 8);
+
+	return
+		12 <= h->shift && h->shift <= 24
+		&& Z_HEADER <= h->index && h->index <= h->stored
+		&& h->nblocks == (h->stored - h->index) / Z_ENTRY
+		&& (h->stored - h->index) % Z_ENTRY == 0
+	;
+}
+
+off_t
+zstore(
+	int fd
+	, off_t offset
+	, off_t limit
+	, ssize_t (*read)(void *arg, uchar *buf, size_t len)
+	, void *arg
+	, Merkle *m
+	, off_t *raw
+)
+{
+	static uchar const zeros[Z_HEADER];
+	Zbatch b;
+	Zout o;
+	uchar *index, *desc;
+	vlong nblocks, cap;
+	off_t first;
+	int eof;
+
+	if (!batchinit(&b, 0, Z_SHIFT))
+		return -1;
+
+	o.fd = fd;
+	o.offset = offset;
+	o.limit = limit;
+	o.pos = 0;
+	o.m = m;
+	if ((o.head = (uchar *)calloc(1, Z_FIRST)) == nil) {
+		fprintf(stderr, "Could not allocate the compression buffers.\n");
+		batchfree(&b);
+		return -1;
+	}
+
+	index = nil;
+	cap = 0;
+	nblocks = 0;
+	*raw = 0;
+	eof = 0;
+
+	// Its place (it is written at the end).
+	if (!put(&o, zeros, Z_HEADER))
+		goto error;
+
+	while (!eof) {
+		for (b.n = 0; b.n < Z_BATCH && !eof;) {
+			ssize_t n = fill(read, arg, b.raw[b.n], b.block);
+
+			if (n < 0)
+				goto error;
+			if (n < b.block)
+				eof = 1;
+			if (n == 0)
+				break;
+			b.rawlen[b.n++] = n;
+		}
+		if (b.n == 0)
+			break;
+
+		runbatch(&b);
+
+		// In order, as the index.
+		for (int i = 0; i < b.n; ++i) {
+			uchar *e;
+
+			if (cap <= nblocks) {
+				uchar *grown;
+
+				cap = cap == 0? 256: 2 * cap;
+				if ((grown = (uchar *)realloc(index, cap * Z_ENTRY)) == nil) {
+					fprintf(stderr, "Could not allocate the block index.\n");
+					goto error;
+				}
+				index = grown;
+			}
+
+			e = &index[nblocks++ * Z_ENTRY];
+			putle(&e[0], b.israw[i]? (uint)b.rawlen[i] | Z_RAW: (uint)b.cmplen[i], 4);
+			putle(&e[4], b.rawlen[i], 4);
+			putle(&e[8], b.hash[i], 8);
+
+			if (
+				b.israw[i]
+				? !put(&o, b.raw[i], b.rawlen[i])
+				: !put(&o, b.cmp[i], b.cmplen[i])
+			)
+				goto error;
+			*raw += b.rawlen[i];
+		}
+	}
+
+	desc = o.head;
+	putle(&desc[24], o.pos, 8);
+	if (!put(&o, index, nblocks * Z_ENTRY))
+		goto error;
+
+	memcpy(desc, Z_MAGIC, 4);
+	desc[4] = 0x01;
+	desc[5] = Z_SHIFT;
+	putle(&desc[8], *raw, 8);
+	putle(&desc[16], nblocks, 8);
+	putle(&desc[32], o.pos, 8);
+	putle(&desc[40], xxh64(index, nblocks * Z_ENTRY, 0), 8);
+	putle(&desc[48], xxh64(desc, 48, 0), 8);
+
+	first = o.pos < Z_FIRST? o.pos: Z_FIRST;
+	if (pwritefull(fd, o.head, first, offset) != first) {
+		perror("Could not write the compressed payload");
+		goto error;
+	}
+	throttle(first);
+	if (m != nil)
+		merklefirst(m, o.head, first);
+
+	free(index);
+	free(o.head);
+	batchfree(&b);
+	return o.pos;
+
+error:
+	free(index);
+	free(o.head);
+	batchfree(&b);
+	return -1;
+}
+
+int
+zextract(int fd, off_t offset, Zhead const *h, int out)
+{
+	Zbatch b;
+	uchar *index;
+	size_t len;
+	ssize_t n;
+	off_t pos, raw;
+
+	len = h->nblocks * Z_ENTRY;
+	if ((index = (uchar *)malloc(len == 0? 1: len)) == nil) {
+		fprintf(stderr, "Could not allocate the block index.\n");
+		return 0;
+	}
+
+	n = preadfull(fd, index, len, offset + h->index);
+	do {
+		if (n < 0)
+			perror("Could not read the block index");
+		else if ((size_t)n != len || xxh64(index, len, 0) != h->indexhash)
+			fprintf(stderr, "The block index of the slot is corrupt.\n");
+		else if (!batchinit(&b, 1, h->shift))
+			;
+		else
+			break;
+
+		free(index);
+		return 0;
+	} while (0);
+
+	pos = Z_HEADER;
+	raw = 0;
+	for (vlong i = 0; i < h->nblocks; i += b.n) {
+		off_t stored = 0;
+
+		b.n = h->nblocks - i < Z_BATCH? h->nblocks - i: Z_BATCH;
+		for (int j = 0; j < b.n; ++j) {
+			uchar const *e = &index[(i + j) * Z_ENTRY];
+			uint size = getle(&e[0], 4);
+
+			b.israw[j] = (size & Z_RAW) != 0;
+			b.cmplen[j] = size & ~Z_RAW;
+			b.rawlen[j] = getle(&e[4], 4);
+			b.hash[j] = getle(&e[8], 8);
+			b.cmp[j] = &b.cmpbuf[stored];
+			stored += b.cmplen[j];
+
+			if (
+				b.block < b.rawlen[j]
+				|| lz4bound(b.block) < b.cmplen[j]
+				|| (b.israw[j] && b.cmplen[j] != b.rawlen[j])
+			) {
+				fprintf(stderr, "The block index of the slot is corrupt.\n");
+				goto error;
+			}
+		}
+
+		if (h->index < pos + stored) {
+			fprintf(stderr, "The block index of the slot is corrupt.\n");
+			goto error;
+		}
+
+		n = preadfull(fd, b.cmpbuf, stored, offset + pos);
+		if (n != stored) {
+			if (n < 0)
+				perror("Could not read the slot");
+			else
+				fprintf(stderr, "Could not read the whole slot.\n");
+			goto error;
+		}
+		throttle(stored);
+
+		runbatch(&b);
+
+		for (int j = 0; j < b.n; ++j) {
+			if (b.bad[j]) {
+				fprintf(stderr, "The block #%lld of the slot is corrupt.\n", i + j);
+				goto error;
+			}
+			if (0 <= out && writefull(out, b.raw[j], b.rawlen[j]) != b.rawlen[j]) {
+				perror("Could not write the data");
+				goto error;
+			}
+			raw += b.rawlen[j];
+		}
+		pos += stored;
+	}
+
+	if (raw != h->raw) {
+		fprintf(stderr, "The compressed slot is shorter than expected.\n");
+		goto error;
+	}
+
+	free(index);
+	batchfree(&b);
+	return 1;
+
+error:
+	free(index);
+	batchfree(&b);
+	return 0;
+}
+
+static int
+batchinit(Zbatch *b, int decompress, int shift)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t block = (size_t)1 << shift;
+	size_t bound = lz4bound(block);
+
+	memset(b, 0, sizeof(*b));
+	b->decompress = decompress;
+	b->block = block;
+	b->nthreads = cpus < 1? 1: Z_BATCH < cpus? Z_BATCH: cpus;
+
+	// When decompressing, the stored blocks are read at once (back to back).
+	if (
+		(b->rawbuf = (uchar *)malloc(Z_BATCH * block)) == nil
+		|| (b->cmpbuf = (uchar *)malloc(Z_BATCH * bound)) == nil
+		|| (!decompress && (b->tablebuf = (int *)malloc(b->nthreads * LZ4_TABLE * sizeof(int))) == nil)
+	) {
+		fprintf(stderr, "Could not allocate the compression buffers.\n");
+		batchfree(b);
+		return 0;
+	}
+
+	for (int i = 0; i < Z_BATCH; ++i) {
+		b->raw[i] = &b->rawbuf[i * block];
+		b->cmp[i] = &b->cmpbuf[i * bound];
+	}
+	for (int t = 0; !decompress && t < b->nthreads; ++t)
+		b->tables[t] = &b->tablebuf[t * LZ4_TABLE];
+	return 1;
+}
+
+static void
+batchfree(Zbatch *b)
+{
+	free(b->rawbuf);
+	free(b->cmpbuf);
+	free(b->tablebuf);
+}
+
+// Every thread takes one of each nthreads blocks
+// (those that could not be started are done here).
+static void
+runbatch(Zbatch *b)
+{
+	pthread_t thread[Z_BATCH];
+	Zjob job[Z_BATCH];
+	int nthreads = b->n < b->nthreads? b->n: b->nthreads;
+	int started;
+
+	for (int t = 0; t < nthreads; ++t) {
+		job[t].b = b;
+		job[t].t = t;
+	}
+
+	for (started = 1; started < nthreads; ++started)
+		if (pthread_create(&thread[started], nil, work, &job[started]) != 0)
+			break;
+
+	work(&job[0]);
+	for (int t = started; t < nthreads; ++t)
+		work(&job[t]);
+	for (int t = 1; t < started; ++t)
+		pthread_join(thread[t], nil);
+}
+
+static void *
+work(void *arg)
+{
+	Zjob *job = (Zjob *)arg;
+	Zbatch *b = job->b;
+	int step = b->n < b->nthreads? b->n: b->nthreads;
+
+	for (int i = job->t; i < b->n; i += step) {
+		if (!b->decompress) {
+			b->hash[i] = xxh64(b->raw[i], b->rawlen[i], 0);
+			b->cmplen[i] = lz4compress(
+				b->raw[i]
+				, b->rawlen[i]
+				, b->cmp[i]
+				, lz4bound(b->block)
+				, b->tables[job->t]
+			);
+			// Not worth it (or it did not fit).
+			b->israw[i] = b->cmplen[i] == 0 || b->rawlen[i] <= b->cmplen[i];
+			continue;
+		}
+
+		if (b->israw[i]) {
+			memcpy(b->raw[i], b->cmp[i], b->rawlen[i]);
+			b->bad[i] = 0;
+		} else {
+			b->bad[i] = lz4decompress(b->cmp[i], b->cmplen[i], b->raw[i], b->block) != b->rawlen[i];
+		}
+		b->bad[i] = b->bad[i] || xxh64(b->raw[i], b->rawlen[i], 0) != b->hash[i];
+	}
+	return nil;
+}
+
+// As readfull, but through 'read'.
+static ssize_t
+fill(ssize_t (*read)(void *arg, uchar *buf, size_t len), void *arg, uchar *buf, size_t len)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = read(arg, &buf[done], len - done);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+	}
+	return done;
+}
+
+static int
+put(Zout *o, uchar const *buf, size_t len)
+{
+	if (o->limit - o->pos < (off_t)len) {
+		fprintf(stderr, "The compressed payload exceeds the slot capacity.\n");
+		return 0;
+	}
+
+	if (o->m != nil)
+		merklefeed(o->m, buf, len);
+
+	if (o->pos < Z_FIRST) {
+		size_t n = Z_FIRST - o->pos < (off_t)len? (size_t)(Z_FIRST - o->pos): len;
+
+		memcpy(&o->head[o->pos], buf, n);
+		o->pos += n;
+		buf += n;
+		len -= n;
+	}
+
+	if (0 < len) {
+		if (pwritefull(o->fd, buf, len, o->offset + o->pos) != (ssize_t)len) {
+			perror("Could not write the compressed payload");
+			return 0;
+		}
+		throttle(len);
+		o->pos += len;
+	}
+	return 1;
+}
@@ -0,0 +1,35 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// Compressed slots: the payload starts with a descriptor ("F7LZ"),
+// followed by the data in LZ4 blocks and, at the end, the block index
+// (so that the blocks can be decompressed in parallel).
+// The hash index of the slot covers what is stored, as for any other.
+
+typedef struct {
+	int shift; // Blocks of 2^shift bytes of data.
+	off_t raw; // Length of the data.
+	vlong nblocks;
+	off_t index; // Offset of the block index (from the slot).
+	off_t stored; // Length of the whole payload.
+	uvlong indexhash;
+} Zhead;
+
+// It returns 1 if the slot at 'offset' is compressed.
+int zprobe(int fd, off_t offset, Zhead *h);
+// Compresses what 'read' gives (as read, 0 at the end) into the slot,
+// up to 'limit' bytes. It returns the stored length (and the length
+// of the data in 'raw'), or -1 after a message.
+off_t zstore(
+	int fd
+	, off_t offset
+	, off_t limit
+	, ssize_t (*read)(void *arg, uchar *buf, size_t len)
+	, void *arg
+	, Merkle *m
+	, off_t *raw
+);
+// Decompresses the slot into 'out' (or just checks it, if out is -1).
+// It returns 0 after a message.
+int zextract(int fd, off_t offset, Zhead const *h, int out);
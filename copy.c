@@ -0,0 +1,778 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "copy.h"
+#include "backend.h"
+#include "iolimit.h"
+#include "probe.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define ZERO_SIMD
+#endif
+
+#define CHUNK_DEFAULT (1024 * 1024)
+#define CHUNK_MAX (16 * 1024 * 1024)
+#define SPLICE_MAX (1024 * 1024)
+#define VERIFY_MAX (1024 * 1024)
+#define ZERO_BLOCK 4096 // Aligned to the destination offsets.
+// Every candidate chunk size is measured over this many bytes
+// (the whole tuning takes the first 160 MiB).
+#define TRIAL_BYTES (32LL * 1024 * 1024)
+
+static size_t const trials[] = {
+	64 * 1024,
+	256 * 1024,
+	1024 * 1024,
+	4 * 1024 * 1024,
+	16 * 1024 * 1024,
+};
+#define NTRIALS ((int)(sizeof(trials) / sizeof(trials[0])))
+
+typedef struct {
+	int trial;
+	off_t bytes;
+	struct timespec since;
+	double best;
+	size_t bestchunk;
+} Tuner;
+
+static off_t splicedata(Copy *c);
+static int clonerange(Copy *c, off_t *head, off_t *mid);
+static int copyrange(Copy *c, off_t from, off_t to);
+static int observerange(Copy *c, off_t from, off_t to);
+static int verify(
+	Copy *c
+	, off_t base
+	, uchar const *ring
+	, off_t ringsize
+	, off_t skew
+	, off_t *verified
+	, off_t upto
+	, uchar *scratch
+);
+static int writechunk(Copy *c, uchar const *buf, size_t n, off_t offset, int *zeroing);
+static int writeout(Copy *c, uchar const *buf, size_t n, off_t offset);
+static int zerorange(Copy *c, off_t offset, off_t len, int *zeroing);
+static int zeroscalar(uchar const *buf, size_t len);
+#ifdef ZERO_SIMD
+static int zerosse2(uchar const *buf, size_t len);
+static int zeroavx2(uchar const *buf, size_t len);
+#endif
+static void tune(Tuner *t, Copy *c, off_t n);
+static double elapsed(struct timespec const *since);
+
+void
+copyinit(Copy *c, int dst, int src, char const *what)
+{
+	memset(c, 0, sizeof(*c));
+	c->what = what;
+	c->dst = dst;
+	c->src = src;
+	c->vfd = -1;
+}
+
+// Copies c->size bytes from c->src (at c->srcoff) to c->dst (at c->dstoff).
+// Partial transfers are resumed, and the chunk size is adapted
+// to the throughput measured at the beginning.
+int
+copydata(Copy *c)
+{
+	off_t head, mid;
+
+	c->copied = 0;
+	c->cloned = 0;
+	c->zeroed = 0;
+	c->aligned = 0;
+	c->unaligned = 0;
+
+	// Pipes can be moved without copying them to user space
+	// (but the verification and the observer need the data,
+	// splice does not keep to the erase blocks, and it skips the backends).
+	if (
+		c->stream
+		&& c->vfd < 0
+		&& c->observe == nil
+		&& !c->sparse
+		&& c->erase == 0
+		&& backend(c->dst) == nil
+	) {
+		off_t moved = splicedata(c);
+
+		if (moved == -1)
+			return 0;
+		if (0 <= moved) {
+			c->copied = moved;
+			return 1;
+		}
+	}
+
+	head = c->size;
+	mid = 0;
+	if (c->reflink && !c->stream && !clonerange(c, &head, &mid))
+		return 0;
+
+	if (
+		!copyrange(c, 0, head)
+		|| !observerange(c, head, head + mid)
+		|| !copyrange(c, head + mid, c->size)
+	) {
+		if (0 < c->copied + c->cloned && !c->stream)
+			fprintf(
+				stderr
+				, "WARNING: %jd/%jd bytes were actually copied.\n"
+				, (intmax_t)(c->copied + c->cloned)
+				, (intmax_t)c->size
+			);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Shares the extents of the block-aligned middle of the range (FICLONERANGE),
+// leaving 'head' bytes before it and the rest after it to be copied.
+// Nothing is shared unless the source and the destination are equally
+// misaligned, both are regular files, and the filesystem supports it.
+static int
+clonerange(Copy *c, off_t *head, off_t *mid)
+{
+	struct stat statbuf;
+	struct file_clone_range range;
+	off_t bs, h, m;
+
+	if (fstat(c->dst, &statbuf) < 0) {
+		perror("Could not use stat over the file");
+		return 0;
+	}
+
+	bs = statbuf.st_blksize;
+	if (!S_ISREG(statbuf.st_mode) || c->srcoff % bs != c->dstoff % bs)
+		return 1;
+
+	h = (bs - c->dstoff % bs) % bs;
+	if (c->size <= h)
+		return 1;
+	m = (c->size - h) / bs * bs;
+	if (m == 0)
+		return 1;
+
+	range.src_fd = c->src;
+	range.src_offset = c->srcoff + h;
+	range.src_length = m;
+	range.dest_offset = c->dstoff + h;
+
+	if (ioctl(c->dst, FICLONERANGE, &range) < 0) {
+		switch (errno) {
+		case EOPNOTSUPP:
+		case ENOTTY:
+		case EXDEV:
+		case EINVAL:
+			// Not supported (or different filesystems),
+			// so everything is just copied.
+			return 1;
+		default:
+			fprintf(stderr, "Could not clone the %s: %s\n", c->what, strerror(errno));
+			return 0;
+		}
+	}
+
+	*head = h;
+	*mid = m;
+	c->cloned = m;
+	return 1;
+}
+
+// Copies the range [from, to) of the data (or until EOF when streaming).
+static int
+copyrange(Copy *c, off_t from, off_t to)
+{
+	uchar *ring, *scratch;
+	off_t ringsize, skew;
+	off_t done, verified;
+	Tuner tuner;
+	ssize_t n;
+	struct stat statbuf;
+	int zeroing;
+
+	if (to <= from)
+		return 1;
+
+	// 1 for holes (files), 2 for BLKZEROOUT (devices), 0 to write the zeros.
+	zeroing = 0;
+	if (c->sparse && fstat(c->dst, &statbuf) == 0)
+		zeroing = S_ISREG(statbuf.st_mode)? 1: S_ISBLK(statbuf.st_mode)? 2: 0;
+
+	// When verifying, the chunks are kept in a ring until they are checked.
+	// With erase blocks, the ring is made of them, and the data is placed
+	// as it goes in the destination (so that no write wraps around).
+	ringsize = CHUNK_MAX;
+	skew = 0;
+	if (0 < c->erase) {
+		ringsize = (CHUNK_MAX + c->erase - 1) / c->erase * c->erase;
+		skew = (c->dstoff + from) % c->erase;
+	}
+	if (c->wait != nil)
+		ringsize += 0 < c->erase? (c->behind + c->erase - 1) / c->erase * c->erase: c->behind;
+	if (0 <= c->vfd)
+		ringsize += 0 < c->erase? (c->lag + c->erase - 1) / c->erase * c->erase: c->lag;
+	else if (!c->stream && to - from + skew < ringsize)
+		ringsize = (to - from + skew + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+
+	ring = nil;
+	scratch = nil;
+	if (
+		posix_memalign((void **)&ring, DIO_ALIGN, ringsize) != 0
+		|| (
+			0 <= c->vfd
+			&& posix_memalign((void **)&scratch, DIO_ALIGN, VERIFY_MAX + 2 * DIO_ALIGN) != 0
+		)
+	) {
+		fprintf(stderr, "Could not allocate the copy buffer.\n");
+		free(ring);
+		return 0;
+	}
+
+	memset(&tuner, 0, sizeof(tuner));
+	clock_gettime(CLOCK_MONOTONIC, &tuner.since);
+	if (0 < c->erase) {
+		// The size is given.
+		c->chunk = c->erase;
+		tuner.trial = NTRIALS;
+	} else if (c->stream || NTRIALS * TRIAL_BYTES <= to - from) {
+		c->chunk = trials[0];
+	} else {
+		// Not worth tuning small copies.
+		c->chunk = CHUNK_DEFAULT;
+		tuner.trial = NTRIALS;
+	}
+
+	done = 0;
+	verified = 0;
+	while (done < to - from) {
+		off_t pos = (done + skew) % ringsize;
+		size_t count = c->chunk;
+
+		// Up to the next boundary (a whole erase block, but for the first).
+		if (0 < c->erase)
+			count = c->erase - (c->dstoff + from + done) % c->erase;
+		if (to - from - done < (off_t)count)
+			count = to - from - done;
+		if (ringsize - pos < (off_t)count)
+			count = ringsize - pos;
+
+		// What was there must be done with.
+		if (c->wait != nil && ringsize - (off_t)count < done)
+			c->wait(c->arg, ringsize - count);
+
+		PROBE2(read_start, c->srcoff + from + done, count);
+		PROBECLOCK(read_done, rt);
+		if (c->stream)
+			n = readfull(c->src, &ring[pos], count);
+		else
+			n = preadfull(c->src, &ring[pos], count, c->srcoff + from + done);
+		PROBE3(read_done, c->srcoff + from + done, n, PROBENS(rt));
+
+		if (n < 0) {
+			fprintf(stderr, "Could not read the %s: %s\n", c->what, strerror(errno));
+			goto error;
+		} else if (n == 0 && c->stream) {
+			break;
+		} else if ((size_t)n < count && !c->stream) {
+			fprintf(stderr, "The %s is shorter than expected.\n", c->what);
+			goto error;
+		}
+
+		PROBE2(write_start, c->dstoff + from + done, n);
+		PROBECLOCK(write_done, wt);
+		if (!writechunk(c, &ring[pos], n, c->dstoff + from + done, &zeroing)) {
+			fprintf(stderr, "Could not copy the %s: %s\n", c->what, strerror(errno));
+			goto error;
+		}
+		PROBE3(write_done, c->dstoff + from + done, n, PROBENS(wt));
+		done += n;
+		c->copied += n;
+		throttle(n);
+
+		if (c->observe != nil)
+			c->observe(c->arg, &ring[pos], n);
+
+		tune(&tuner, c, n);
+
+		// The oldest chunks are about to be reused.
+		if (
+			0 <= c->vfd
+			&& !verify(c, from, ring, ringsize, skew, &verified, done - c->lag, scratch)
+		)
+			goto error;
+
+		// The end of the stream.
+		if ((size_t)n < count && c->stream)
+			break;
+	}
+
+	if (
+		0 <= c->vfd
+		&& !verify(c, from, ring, ringsize, skew, &verified, done, scratch)
+	)
+		goto error;
+
+	if (c->stream && !c->prefix && done == to - from && (n = read(c->src, ring, 1)) != 0) {
+		if (n < 0)
+			fprintf(stderr, "Could not read the %s: %s\n", c->what, strerror(errno));
+		else
+			fprintf(
+				stderr
+				, "The %s exceeds the capacity (%jd bytes).\n"
+				, c->what
+				, (intmax_t)c->size
+			);
+		goto error;
+	}
+
+	if (c->wait != nil)
+		c->wait(c->arg, 0);
+	free(scratch);
+	free(ring);
+	return 1;
+
+error:
+	if (c->wait != nil)
+		c->wait(c->arg, 0);
+	free(scratch);
+	free(ring);
+	return 0;
+}
+
+// Feeds the observer with a range that was not copied (but cloned).
+static int
+observerange(Copy *c, off_t from, off_t to)
+{
+	uchar *buf;
+	off_t pos;
+
+	if (c->observe == nil || to <= from)
+		return 1;
+
+	if ((buf = (uchar *)malloc(CHUNK_DEFAULT)) == nil) {
+		fprintf(stderr, "Could not allocate the copy buffer.\n");
+		return 0;
+	}
+
+	for (pos = from; pos < to;) {
+		size_t count = to - pos < CHUNK_DEFAULT? to - pos: CHUNK_DEFAULT;
+
+		if (preadfull(c->src, buf, count, c->srcoff + pos) != (ssize_t)count) {
+			fprintf(stderr, "Could not read the %s.\n", c->what);
+			free(buf);
+			return 0;
+		}
+
+		throttle(count);
+		if (c->wait != nil)
+			c->wait(c->arg, 0);
+		c->observe(c->arg, buf, count);
+		pos += count;
+	}
+
+	if (c->wait != nil)
+		c->wait(c->arg, 0);
+	free(buf);
+	return 1;
+}
+
+// Moves up to c->size bytes from a pipe.
+// It returns how many bytes were moved, -1 on error,
+// or -2 if splice is not possible at all (so nothing was consumed).
+static off_t
+splicedata(Copy *c)
+{
+	ssize_t n;
+	off_t offset;
+	uchar probe;
+
+	offset = c->dstoff;
+	while (offset - c->dstoff < c->size) {
+		size_t count = c->size - (offset - c->dstoff);
+
+		if (SPLICE_MAX < count)
+			count = SPLICE_MAX;
+
+		n = splice(c->src, nil, c->dst, &offset, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n == 0)
+			return offset - c->dstoff;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && offset == c->dstoff)
+				return -2;
+
+			fprintf(stderr, "Could not copy the %s: %s\n", c->what, strerror(errno));
+			return -1;
+		}
+		throttle(n);
+	}
+
+	if (c->prefix)
+		return offset - c->dstoff;
+	while ((n = read(c->src, &probe, 1)) < 0 && errno == EINTR)
+		;
+	if (n != 0) {
+		if (n < 0)
+			fprintf(stderr, "Could not read the %s: %s\n", c->what, strerror(errno));
+		else
+			fprintf(
+				stderr
+				, "The %s exceeds the capacity (%jd bytes).\n"
+				, c->what
+				, (intmax_t)c->size
+			);
+		return -1;
+	}
+
+	return c->size;
+}
+
+// Reads back everything from 'verified' to 'upto' (relative to 'base',
+// the start of the range) and compares it with the ring (where the range
+// starts at 'skew'), advancing 'verified'.
+// The reads are widened to DIO_ALIGN boundaries, as required by direct I/O.
+static int
+verify(
+	Copy *c
+	, off_t base
+	, uchar const *ring
+	, off_t ringsize
+	, off_t skew
+	, off_t *verified
+	, off_t upto
+	, uchar *scratch
+)
+{
+	while (*verified < upto) {
+		off_t pos, len, from, to;
+		ssize_t n;
+
+		pos = *verified;
+		len = upto - pos;
+		if (VERIFY_MAX < len)
+			len = VERIFY_MAX;
+		if (ringsize - (pos + skew) % ringsize < len)
+			len = ringsize - (pos + skew) % ringsize;
+
+		from = (c->dstoff + base + pos) / DIO_ALIGN * DIO_ALIGN;
+		to = c->dstoff + base + pos + len;
+		to = (to + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+
+		PROBECLOCK(verify_done, t);
+		n = preadfull(c->vfd, scratch, to - from, from);
+		throttle(to - from);
+		PROBE3(verify_done, from, n, PROBENS(t));
+		do {
+			if (n < 0)
+				fprintf(stderr, "Could not read back the %s: %s\n", c->what, strerror(errno));
+			else if (n < c->dstoff + base + pos + len - from)
+				fprintf(stderr, "Could not read back the %s (%zd bytes read).\n", c->what, n);
+			else if (memcmp(&scratch[c->dstoff + base + pos - from], &ring[(pos + skew) % ringsize], len) != 0)
+				fprintf(
+					stderr
+					, "Verification failed (the data at byte %jd of the %s differs).\n"
+					, (intmax_t)(base + pos)
+					, c->what
+				);
+			else
+				break;
+
+			return 0;
+		} while (0);
+
+		*verified += len;
+	}
+
+	return 1;
+}
+
+// The runs of whole zero blocks are zeroed without writing them
+// (when zeroing, until it turns out not to be supported).
+static int
+writechunk(Copy *c, uchar const *buf, size_t n, off_t offset, int *zeroing)
+{
+	size_t pos, start, end;
+	int zero;
+
+	if (*zeroing == 0)
+		return writeout(c, buf, n, offset);
+
+	for (pos = 0; pos < n;) {
+		// The first block may be partial (up to a boundary).
+		start = pos;
+		end = pos + (ZERO_BLOCK - (offset + pos) % ZERO_BLOCK);
+		if (n < end)
+			end = n;
+		zero = end - pos == ZERO_BLOCK && iszero(&buf[pos], ZERO_BLOCK);
+
+		for (pos = end; pos < n; pos = end) {
+			end = n - pos < ZERO_BLOCK? n: pos + ZERO_BLOCK;
+			if ((end - pos == ZERO_BLOCK && iszero(&buf[pos], ZERO_BLOCK)) != zero)
+				break;
+		}
+
+		if (zero && zerorange(c, offset + start, pos - start, zeroing)) {
+			c->zeroed += pos - start;
+			continue;
+		}
+		if (!writeout(c, &buf[start], pos - start, offset + start))
+			return 0;
+	}
+	return 1;
+}
+
+// The writes are counted against the erase blocks.
+static int
+writeout(Copy *c, uchar const *buf, size_t n, off_t offset)
+{
+	if (0 < c->erase) {
+		if (offset % c->erase == 0 && n % c->erase == 0)
+			c->aligned += 1;
+		else
+			c->unaligned += 1;
+	}
+	return pwritefull(c->dst, buf, n, offset) == (ssize_t)n;
+}
+
+// It returns 0 if the range must be written instead
+// (then, it stops trying).
+static int
+zerorange(Copy *c, off_t offset, off_t len, int *zeroing)
+{
+	uint64_t range[2];
+	int ok;
+
+	if (*zeroing == 1 || backend(c->dst) != nil) {
+		ok = bdiscard(c->dst, offset, len);
+	} else {
+		range[0] = offset;
+		range[1] = len;
+		ok = ioctl(c->dst, BLKZEROOUT, range) == 0;
+	}
+
+	if (!ok)
+		*zeroing = 0;
+	return ok;
+}
+
+int
+iszero(uchar const *buf, size_t len)
+{
+	static int (*kernel)(uchar const *buf, size_t len);
+
+	if (kernel == nil) {
+		kernel = zeroscalar;
+#ifdef ZERO_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			kernel = zeroavx2;
+		else if (__builtin_cpu_supports("sse2"))
+			kernel = zerosse2;
+#endif
+	}
+	return kernel(buf, len);
+}
+
+static int
+zeroscalar(uchar const *buf, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uvlong w;
+
+		memcpy(&w, &buf[i], 8);
+		if (w != 0)
+			return 0;
+	}
+	for (; i < len; ++i)
+		if (buf[i] != 0)
+			return 0;
+	return 1;
+}
+
+#ifdef ZERO_SIMD
+// 128 bytes at a time (data is seldom zero, so it gives up early).
+__attribute__((target("sse2")))
+static int
+zerosse2(uchar const *buf, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m128i acc = _mm_loadu_si128((__m128i const *)&buf[i]);
+
+		for (int j = 16; j < 128; j += 16)
+			acc = _mm_or_si128(acc, _mm_loadu_si128((__m128i const *)&buf[i + j]));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+			return 0;
+	}
+	return zeroscalar(&buf[i], len - i);
+}
+
+__attribute__((target("avx2")))
+static int
+zeroavx2(uchar const *buf, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m256i acc = _mm256_loadu_si256((__m256i const *)&buf[i]);
+
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((__m256i const *)&buf[i + 32]));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((__m256i const *)&buf[i + 64]));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((__m256i const *)&buf[i + 96]));
+		if (!_mm256_testz_si256(acc, acc))
+			return 0;
+	}
+	return zeroscalar(&buf[i], len - i);
+}
+#endif
+
+// Tries every candidate chunk size for TRIAL_BYTES, and then
+// sticks to the fastest one.
+static void
+tune(Tuner *t, Copy *c, off_t n)
+{
+	double secs, rate;
+
+	if (NTRIALS <= t->trial)
+		return;
+
+	t->bytes += n;
+	if (t->bytes < TRIAL_BYTES)
+		return;
+
+	secs = elapsed(&t->since);
+	rate = 0 < secs? t->bytes / secs: 0;
+	if (t->bestchunk == 0 || t->best < rate) {
+		t->best = rate;
+		t->bestchunk = c->chunk;
+	}
+
+	++t->trial;
+	c->chunk = t->trial < NTRIALS? trials[t->trial]: t->bestchunk;
+	t->bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t->since);
+}
+
+static double
+elapsed(struct timespec const *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+// Reads until 'count' bytes are read or EOF is reached.
+ssize_t
+readfull(int fd, uchar *buf, size_t count)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < count; done += n) {
+		n = read(fd, &buf[done], count - done);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0)
+			return -1;
+		else if (n == 0)
+			break;
+	}
+
+	return done;
+}
+
+ssize_t
+preadfull(int fd, uchar *buf, size_t count, off_t offset)
+{
+	Backend *b = backend(fd);
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < count; done += n) {
+		if (b != nil)
+			n = b->pread(b, &buf[done], count - done, offset + done);
+		else
+			n = pread(fd, &buf[done], count - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0)
+			return -1;
+		else if (n == 0)
+			break;
+	}
+
+	return done;
+}
+
+// A short count is only returned along with errno.
+ssize_t
+writefull(int fd, uchar const *buf, size_t count)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < count; done += n) {
+		n = write(fd, &buf[done], count - done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+		} else if (n < 0) {
+			break;
+		} else if (n == 0) {
+			errno = ENOSPC;
+			break;
+		}
+	}
+
+	return done;
+}
+
+// A short count is only returned along with errno.
+ssize_t
+pwritefull(int fd, uchar const *buf, size_t count, off_t offset)
+{
+	Backend *b = backend(fd);
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < count; done += n) {
+		if (b != nil)
+			n = b->pwrite(b, &buf[done], count - done, offset + done);
+		else
+			n = pwrite(fd, &buf[done], count - done, offset + done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+		} else if (n < 0) {
+			break;
+		} else if (n == 0) {
+			errno = ENOSPC;
+			break;
+		}
+	}
+
+	return done;
+}
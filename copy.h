@@ -0,0 +1,60 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// Copy engine shared by the commands that move data around.
+
+#define DIO_ALIGN 4096 // Enough for 512B and 4Kn logical sectors.
+#define ERASE_MAX (64 * 1024 * 1024)
+
+typedef struct {
+	char const *what; // For the messages ("payload"...).
+	int dst;
+	int src;
+	off_t dstoff;
+	off_t srcoff; // Ignored when streaming.
+	// The exact size, or the limit when streaming
+	// (the stream is not consumed beyond it).
+	off_t size;
+	int stream;
+	// The stream goes on: only its first 'size' bytes are taken
+	// (its end is not checked).
+	int prefix;
+	// Share the aligned extents instead of copying them, if possible.
+	int reflink;
+	// Zero blocks become holes (or BLKZEROOUT), if possible.
+	int sparse;
+	// If set, the writes are split and coalesced on these boundaries
+	// (of the destination): the first one up to a boundary, and then
+	// one write per erase block.
+	off_t erase;
+	// If valid, everything is read back through it (and compared)
+	// once the writer is 'lag' bytes ahead.
+	int vfd;
+	off_t lag;
+	// If set, it is given all the data, in order.
+	void (*observe)(void *arg, uchar const *buf, size_t len);
+	void *arg;
+	// If set, the observer may still be using the last 'behind' bytes
+	// it was given (on a thread of its own): before they are reused,
+	// it waits until no more than 'keep' bytes are left.
+	void (*wait)(void *arg, size_t keep);
+	off_t behind;
+
+	// Results.
+	off_t copied;
+	off_t cloned;
+	off_t zeroed; // Included in 'copied'.
+	vlong aligned; // Writes of whole erase blocks.
+	vlong unaligned;
+	size_t chunk; // The chunk size it settled on.
+} Copy;
+
+void copyinit(Copy *c, int dst, int src, char const *what);
+int copydata(Copy *c);
+// Whether the buffer is all zeros (SIMD when available).
+int iszero(uchar const *buf, size_t len);
+ssize_t readfull(int fd, uchar *buf, size_t count);
+ssize_t preadfull(int fd, uchar *buf, size_t count, off_t offset);
+ssize_t writefull(int fd, uchar const *buf, size_t count);
+ssize_t pwritefull(int fd, uchar const *buf, size_t count, off_t offset);
@@ -0,0 +1,224 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "ptable.h"
+#include "hash.h"
+#include "merkle.h"
+#include "digest.h"
+
+static void *work(void *arg);
+static int sumpath(char const *idx, char *path, size_t len);
+
+int
+digestkinds(char const *list)
+{
+	int kinds = 0;
+
+	while (*list != '\0') {
+		size_t n = strcspn(list, ",");
+
+		if (n == 6 && strncmp(list, "crc32c", n) == 0)
+			kinds |= DIGEST_CRC32C;
+		else if (n == 5 && strncmp(list, "xxh64", n) == 0)
+			kinds |= DIGEST_XXH64;
+		else if (n == 6 && strncmp(list, "sha256", n) == 0)
+			kinds |= DIGEST_SHA256;
+		else
+			return 0;
+
+		list += n;
+		if (*list == ',' && *++list == '\0')
+			return 0;
+	}
+	return kinds;
+}
+
+int
+digeststart(Digest *d, int kinds, Merkle *m)
+{
+	memset(d, 0, sizeof(*d));
+	d->kinds = kinds;
+	d->m = m;
+	d->crc = crc32c(0, nil, 0);
+	xxh64init(&d->xxh, 0);
+	sha256init(&d->sha);
+
+	pthread_mutex_init(&d->lock, nil);
+	pthread_cond_init(&d->cond, nil);
+	if (pthread_create(&d->thread, nil, work, d) != 0) {
+		fprintf(stderr, "Could not start the hashing thread.\n");
+		pthread_cond_destroy(&d->cond);
+		pthread_mutex_destroy(&d->lock);
+		return 0;
+	}
+	return 1;
+}
+
+// The buffer is hashed later: it must not change until digestwait.
+void
+digestfeed(void *arg, uchar const *buf, size_t len)
+{
+	Digest *d = (Digest *)arg;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->n == DIGEST_QUEUE)
+		pthread_cond_wait(&d->cond, &d->lock);
+	d->q[(d->head + d->n) % DIGEST_QUEUE].buf = buf;
+	d->q[(d->head + d->n) % DIGEST_QUEUE].len = len;
+	d->n += 1;
+	d->pending += len;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Until no more than 'keep' bytes given are left to hash.
+void
+digestwait(void *arg, size_t keep)
+{
+	Digest *d = (Digest *)arg;
+
+	pthread_mutex_lock(&d->lock);
+	while (keep < d->pending)
+		pthread_cond_wait(&d->cond, &d->lock);
+	pthread_mutex_unlock(&d->lock);
+}
+
+void
+digestend(Digest *d)
+{
+	pthread_mutex_lock(&d->lock);
+	d->stop = 1;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+
+	pthread_join(d->thread, nil);
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->lock);
+	sha256final(&d->sha, d->sha256);
+}
+
+void
+digestprint(Digest const *d, FILE *f)
+{
+	if ((d->kinds & DIGEST_CRC32C) != 0)
+		fprintf(f, "CRC32C = %08x\n", d->crc);
+	if ((d->kinds & DIGEST_XXH64) != 0)
+		fprintf(f, "XXH64 = %016llx\n", xxh64final(&d->xxh));
+	if ((d->kinds & DIGEST_SHA256) != 0) {
+		fprintf(f, "SHA-256 = ");
+		for (int i = 0; i < 32; ++i)
+			fprintf(f, "%02x", d->sha256[i]);
+		fprintf(f, "\n");
+	}
+}
+
+// As printed, and the length first. It is replaced atomically.
+int
+digestsave(Digest const *d, char const *idx)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *f;
+	int ok;
+
+	if (!sumpath(idx, path, sizeof(path)) || (size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return 0;
+
+	if ((f = fopen(tmp, "w")) == nil) {
+		fprintf(stderr, "WARNING: Could not record the digests (%s): %s\n", path, strerror(errno));
+		return 0;
+	}
+	fprintf(f, "Length = %jd\n", (intmax_t)d->length);
+	digestprint(d, f);
+	ok = fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp, path) == 0;
+
+	if (!ok) {
+		fprintf(stderr, "WARNING: Could not record the digests (%s): %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+	return ok;
+}
+
+void
+digestmove(char const *from, char const *to)
+{
+	char a[PATH_MAX], b[PATH_MAX];
+
+	if (sumpath(from, a, sizeof(a)) && sumpath(to, b, sizeof(b)) && rename(a, b) < 0 && errno != ENOENT)
+		fprintf(stderr, "WARNING: Could not move the digests (%s): %s\n", a, strerror(errno));
+}
+
+void
+digestdrop(char const *idx)
+{
+	char path[PATH_MAX];
+
+	if (sumpath(idx, path, sizeof(path)) && unlink(path) < 0 && errno != ENOENT)
+		fprintf(stderr, "WARNING: Could not remove the digests (%s): %s\n", path, strerror(errno));
+}
+
+static void *
+work(void *arg)
+{
+	Digest *d = (Digest *)arg;
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		uchar const *buf;
+		size_t len;
+
+		while (d->n == 0 && !d->stop)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if (d->n == 0)
+			break;
+
+		// It stays queued (and pending) until it is hashed.
+		buf = d->q[d->head].buf;
+		len = d->q[d->head].len;
+		pthread_mutex_unlock(&d->lock);
+
+		if ((d->kinds & DIGEST_CRC32C) != 0)
+			d->crc = crc32c(d->crc, buf, len);
+		if ((d->kinds & DIGEST_XXH64) != 0)
+			xxh64update(&d->xxh, buf, len);
+		if ((d->kinds & DIGEST_SHA256) != 0)
+			sha256update(&d->sha, buf, len);
+		if (d->m != nil)
+			merklefeed(d->m, buf, len);
+		d->length += len;
+
+		pthread_mutex_lock(&d->lock);
+		d->head = (d->head + 1) % DIGEST_QUEUE;
+		d->n -= 1;
+		d->pending -= len;
+		pthread_cond_broadcast(&d->cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return nil;
+}
+
+// "<index minus .f7idx>.f7sum".
+static int
+sumpath(char const *idx, char *path, size_t len)
+{
+	size_t n = strlen(idx);
+	int r;
+
+	if (n < 6 || strcmp(&idx[n - 6], ".f7idx") != 0)
+		return 0;
+	r = snprintf(path, len, "%.*s.f7sum", (int)n - 6, idx);
+	return 0 < r && (size_t)r < len;
+}
@@ -0,0 +1,49 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// Digests of what is written (CRC32C, XXH64, SHA-256), and the hash
+// index of the slot, computed on a helper thread from the buffers of the
+// copy engine while they are still in the cache (see Copy.wait).
+// They can be recorded next to the hash index, as "<slot>.f7sum".
+
+#define DIGEST_CRC32C 0x1
+#define DIGEST_XXH64 0x2
+#define DIGEST_SHA256 0x4
+#define DIGEST_QUEUE 256 // Buffers given, and not hashed yet.
+#define DIGEST_BEHIND (32 * 1024 * 1024) // Bytes (more ring for the copy).
+
+typedef struct {
+	int kinds;
+	Merkle *m; // Fed too, if set.
+	off_t length;
+	uint crc;
+	Xxh64 xxh;
+	Sha256 sha;
+	uchar sha256[32]; // Once it ends.
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct {
+		uchar const *buf;
+		size_t len;
+	} q[DIGEST_QUEUE];
+	int head;
+	int n;
+	size_t pending; // Bytes.
+	int stop;
+} Digest;
+
+// "crc32c,xxh64,sha256" (any of them). It returns 0 if it is wrong.
+int digestkinds(char const *list);
+int digeststart(Digest *d, int kinds, Merkle *m);
+// As Copy.observe and Copy.wait (arg is the Digest).
+void digestfeed(void *arg, uchar const *buf, size_t len);
+void digestwait(void *arg, size_t keep);
+void digestend(Digest *d);
+void digestprint(Digest const *d, FILE *f);
+// Next to the hash index 'idx' (and dropped with it).
+int digestsave(Digest const *d, char const *idx);
+void digestmove(char const *from, char const *to);
+void digestdrop(char const *idx);
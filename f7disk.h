@@ -11,6 +11,17 @@ void tablebrief(int argc, char **argv);
 void f7_clear(int argc, char **argv);
 void f7_load(int argc, char **argv);
 void f7_brief(int argc, char **argv);
+void f7_query(int argc, char **argv);
+void f7_verify(int argc, char **argv);
+void f7_dump(int argc, char **argv);
 void f7_override(int argc, char **argv);
+void f7_relayout(int argc, char **argv);
+void f7_repack(int argc, char **argv);
 void f7_reset(int argc, char **argv);
 void f7_cpboot(int argc, char **argv);
+void f7_mkimage(int argc, char **argv);
+void f7_sync(int argc, char **argv);
+void f7_mkbundle(int argc, char **argv);
+void f7_loadbundle(int argc, char **argv);
+void f7_serve(int argc, char **argv);
+void f7_call(int argc, char **argv);
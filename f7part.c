@@ -6,6 +6,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +17,17 @@
 #include "u.h"
 #include "f7disk.h"
 #include "ptable.h"
+#include "f7part.h"
+#include "copy.h"
+#include "backend.h"
+#include "hash.h"
+#include "merkle.h"
+#include "compress.h"
+#include "journal.h"
+#include "cache.h"
+#include "digest.h"
+#include "iolimit.h"
+#include "probe.h"
 
 typedef enum {
 	UNKNOWN = 0x0,
@@ -22,38 +36,63 @@ typedef enum {
 	FIRST = 0x4,
 	SIZE = 0x8,
 	EVERY = 0x10,
+	REFLINK = 0x20,
+	VERIFY = 0x40,
+	VERIFYLAG = 0x80,
+	EXPECTED = 0x100,
+	VERSION = 0x200,
+	IONICE = 0x400,
+	MAXRATE = 0x800,
+	SPARSE = 0x1000,
+	COMPRESS = 0x2000,
+	ERASE = 0x4000,
+	RESUME = 0x8000,
+	TRUST = 0x10000,
+	DIGEST = 0x20000,
+	RECORD = 0x40000,
 } Options;
 
-typedef struct {
-	int count;
-	uint bitmap;
-	vlong first;
-	vlong size;
-	vlong every;
-} MetaF7;
+#define VERIFY_LAG (8LL * 1024 * 1024)
+#define PAD_MAX (64 * 1024)
+#define JOURNAL_EVERY (64LL * 1024 * 1024)
 
-#define LBA_MAX (4LL * 1024 * 1024 * 1024 - 1) // (a.k.a. 2^32 - 1).
-#define DIST_MAX (32LL * 1024 * 2 - 1) // (a.k.a. 2^16 - 1).
+// A payload input of load.
+typedef struct {
+	char *file;
+	off_t align; // In bytes (1 if none).
+	int fd;
+	int stream;
+	off_t size;
+} Input;
 
-static int f7_read_header(
-	int fd
-	, PartEntry const *p
-	, int entry
-	, uchar *header
-);
-static int f7_retrieve_meta(uchar *header, MetaF7 *meta);
-// Do not change multiple bits at the same time
-// (the reset command is an exception).
-static int f7_write_bitmap(
-	int fd
-	, PartEntry const *p
-	, int entry
-	, uint bitmap
-);
-static vlong atolba(char *str);
-static long atol2(char *str);
-static void shortensectors(vlong sectors, vlong *n, int *unit);
-static char const *strunit(int unit);
+// The inputs as a single stream (for the compressed slots).
+typedef struct {
+	Input *in;
+	int n;
+	int cur;
+	int started;
+	off_t pos;
+	off_t pad; // Before the current input.
+} Reader;
+
+// The observer of a resumable load.
+typedef struct {
+	Merkle *m;
+	Journal *j;
+	char const *path;
+	int fd;
+	off_t next; // When to record it again.
+} Progress;
+
+static int f7_expected(off_t size, vlong expected);
+static int openinputs(Input *in, int n);
+static void closeinputs(Input *in, int n);
+static ssize_t readinputs(void *arg, uchar *buf, size_t len);
+static int padslot(int fd, off_t offset, off_t len, Digest *d);
+static void f7_progress(void *arg, uchar const *buf, size_t len);
+static void f7_format(int argc, char **argv, int relayout);
+static int writeheader(int fd, PartEntry const *p, int entry, MetaF7 const *meta);
+static int retrieve_meta1(uchar *header, MetaF7 *meta);
 
 void
 f7_clear(int argc, char **argv)
@@ -62,9 +101,10 @@ f7_clear(int argc, char **argv)
 	int entry;
 	int slot;
 	PartEntry p[4];
-	uchar header[24];
+	uchar header[F7_HEADER_MAX];
 	MetaF7 meta;
-	uint bitmap;
+	char idx[PATH_MAX];
+	int lock;
 
 	if (argc != 5) {
 		usage();
@@ -75,13 +115,13 @@ f7_clear(int argc, char **argv)
 	slot = atol2(argv[4]);
 	if (
 		entry < 0 || 3 < entry
-		|| slot < 0 || 15 < slot
+		|| slot < 0 || F7_SLOTS_MAX <= slot
 	) {
 		usage();
 		exit(1);
 	}
 
-	fd = open(argv[2], O_RDWR);
+	fd = devopen(argv[2], O_RDWR);
 	if (fd == -1) {
 		perror("Cannot open the requested device/image file");
 		exit(1);
@@ -96,23 +136,30 @@ f7_clear(int argc, char **argv)
 		exit(1);
 	}
 
-	bitmap = 0x1;
-	for (int i = 0; i < slot; ++i)
-		bitmap = bitmap << 1;
-	bitmap = ~bitmap & meta.bitmap & 0xFFFF;
-
 	if (meta.count <= slot) {
 		fprintf(stderr, "There is only %d slot/s.\n", meta.count);
 		close(fd);
 		exit(1);
 	}
 
-	if (bitmap == meta.bitmap) {
+	// Not while it is being copied or verified.
+	lock = devlock(fd, f7_slotoffset(p, entry, &meta, slot), meta.size * meta.sector, F_WRLCK, 0, "slot");
+	if (lock < 0) {
+		close(fd);
+		exit(1);
+	}
+
+	if (!f7_active(&meta, slot)) {
 		fprintf(stderr, "The slot #%d was already cleared.\n", slot);
-	} else if (!f7_write_bitmap(fd, p, entry, bitmap)) {
+	} else if (!f7_commit(fd, p, entry, &meta, slot, 0)) {
+		devunlock(lock);
 		close(fd);
 		exit(1);
 	}
+	devunlock(lock);
+
+	if (merklepath(fd, argv[2], p, entry, slot, idx, sizeof(idx)))
+		merkledrop(idx);
 
 	close(fd);
 }
@@ -124,15 +171,27 @@ f7_load(int argc, char **argv)
 	// Also, it assumes that the max off_t value fits in the size_t type.
 
 	off_t size, reqsectors;
-	int fd[2];
+	int fd;
 	int entry;
 	int slot;
 	PartEntry p[4];
-	uchar header[24];
+	uchar header[F7_HEADER_MAX];
 	MetaF7 meta;
-	uint bitmap;
+	vlong capacity;
+	int lock;
+	Input *in;
+	int nin;
+	char jnl[PATH_MAX];
 
-	if (argc != 6) {
+	int options = 0;
+	int vfd = -1;
+	off_t lag = VERIFY_LAG;
+	vlong expected = 0;
+	off_t erase = 0;
+	int kinds = 0;
+	int stream;
+
+	if (argc < 6) {
 		usage();
 		exit(1);
 	}
@@ -141,140 +200,791 @@ f7_load(int argc, char **argv)
 	slot = atol2(argv[4]);
 	if (
 		entry < 0 || 3 < entry
-		|| slot < 0 || 15 < slot
+		|| slot < 0 || F7_SLOTS_MAX <= slot
 	) {
 		usage();
 		exit(1);
 	}
 
-	fd[0] = open(argv[2], O_RDWR);
-	if (fd[0] == -1) {
-		perror("Cannot open the requested device/image file");
+	// The inputs go before the options.
+	for (nin = 0; 5 + nin < argc && strncmp(argv[5 + nin], "--", 2) != 0; ++nin)
+		;
+	if (nin == 0) {
+		usage();
+		exit(1);
+	}
+
+	for (int i = 5 + nin; i < argc; i += 1) {
+		int o;
+
+		if (strcmp(argv[i], "--reflink") == 0) {
+			o = REFLINK;
+		} else if (strcmp(argv[i], "--verify") == 0) {
+			o = VERIFY;
+		} else if (strcmp(argv[i], "--sparse") == 0) {
+			o = SPARSE;
+		} else if (strcmp(argv[i], "--store-compressed") == 0) {
+			o = COMPRESS;
+		} else if (strcmp(argv[i], "--resume") == 0) {
+			o = RESUME;
+		} else if (strcmp(argv[i], "--trust-journal") == 0) {
+			o = TRUST;
+		} else if (strcmp(argv[i], "--record-digests") == 0) {
+			o = RECORD;
+		} else if (argc <= i + 1) {
+			o = UNKNOWN;
+		} else if (strcmp(argv[i], "--verify-lag") == 0) {
+			o = VERIFYLAG;
+			lag = atolba(argv[i + 1]) * 512;
+		} else if (strcmp(argv[i], "--expected-size") == 0) {
+			o = EXPECTED;
+			expected = atolba(argv[i + 1]);
+		} else if (strcmp(argv[i], "--erase-block") == 0) {
+			erase = atolba(argv[i + 1]) * 512;
+			o = erase <= ERASE_MAX? ERASE: UNKNOWN;
+		} else if (strcmp(argv[i], "--digest") == 0) {
+			o = (kinds = digestkinds(argv[i + 1])) != 0? DIGEST: UNKNOWN;
+		} else if (strcmp(argv[i], "--ionice") == 0) {
+			o = (options & IONICE) == 0 && setionice(argv[i + 1])? IONICE: UNKNOWN;
+		} else if (strcmp(argv[i], "--max-rate") == 0) {
+			o = (options & MAXRATE) == 0 && setmaxrate(argv[i + 1])? MAXRATE: UNKNOWN;
+		} else {
+			o = UNKNOWN;
+		}
+
+		if (
+			o == UNKNOWN
+			|| (options & o) != 0
+		) {
+			usage();
+			exit(1);
+		}
+		if (
+			o != REFLINK
+			&& o != VERIFY
+			&& o != SPARSE
+			&& o != COMPRESS
+			&& o != RESUME
+			&& o != TRUST
+			&& o != RECORD
+		)
+			i += 1;
+
+		options |= o;
+	}
+
+	// What is stored is not the image.
+	if ((options & COMPRESS) != 0 && (options & (REFLINK | SPARSE | VERIFY | ERASE | RESUME | DIGEST)) != 0) {
+		usage();
+		exit(1);
+	}
+	if ((options & TRUST) != 0 && (options & RESUME) == 0) {
+		usage();
+		exit(1);
+	}
+	// The digests are of the whole payload (a resumed load skips a part).
+	if ((options & DIGEST) != 0 && (options & RESUME) != 0) {
+		usage();
 		exit(1);
 	}
-	fd[1] = open(argv[5], O_RDONLY);
-	if (fd[1] == -1) {
+	if ((options & RECORD) != 0 && (options & DIGEST) == 0) {
+		usage();
+		exit(1);
+	}
+
+	if ((in = (Input *)calloc(nin, sizeof(Input))) == nil) {
+		fprintf(stderr, "Could not allocate the input list.\n");
+		exit(1);
+	}
+	for (int i = 0; i < nin; ++i) {
+		in[i].fd = -1;
+		in[i].file = argv[5 + i];
+		if ((in[i].align = f7_inputalign(argv[5 + i])) == 0) {
+			free(in);
+			usage();
+			exit(1);
+		}
+	}
+
+	fd = devopen(argv[2], O_RDWR);
+	if (fd == -1) {
 		perror("Cannot open the requested device/image file");
-		close(fd[0]);
+		free(in);
 		exit(1);
 	}
+	if (!openinputs(in, nin)) {
+		closeinputs(in, nin);
+		close(fd);
+		exit(1);
+	}
+	if ((options & RESUME) != 0 && (nin != 1 || in[0].stream)) {
+		fprintf(stderr, "Only a single payload file can be resumed.\n");
+		closeinputs(in, nin);
+		close(fd);
+		exit(1);
+	}
+	if ((options & ERASE) == 0) {
+		erase = erasesize(fd);
+		if (erase % 512 != 0 || ERASE_MAX < erase)
+			erase = 0;
+	}
 
 	if (
-		!read_ptable(fd[0], p)
-		|| !f7_read_header(fd[0], p, entry, header)
+		!read_ptable(fd, p)
+		|| !f7_read_header(fd, p, entry, header)
 		|| !f7_retrieve_meta(header, &meta)
 	) {
-		close(fd[1]);
-		close(fd[0]);
+		closeinputs(in, nin);
+		close(fd);
 		exit(1);
 	}
 
-	bitmap = 0x1;
-	for (int i = 0; i < slot; ++i)
-		bitmap = bitmap << 1;
-	bitmap = (bitmap | meta.bitmap) & 0xFFFF;
-
 	do {
 		if (meta.count <= slot)
 			fprintf(stderr, "There is only %d slots.\n", meta.count);
-		else if (bitmap == meta.bitmap)
+		else if (f7_active(&meta, slot))
 			fprintf(stderr, "The slot #%d was already active.\n", slot);
-		else if ((size = lseek(fd[1], 0, SEEK_END)) == (off_t)-1)
-			perror("Could not retrieve the payload file size");
-		else if ((off_t)-1 == lseek(fd[1], 0, SEEK_SET))
-			perror("Could not seek the payload file offset");
 		else
 			break;
 
-		close(fd[1]);
-		close(fd[0]);
+		closeinputs(in, nin);
+		close(fd);
 		exit(1);
 	} while (0);
 
-	reqsectors = size / 512 + (size % 512 != 0? 1: 0);
-	if (meta.size < reqsectors) {
+	// Back to back (but for the alignment), as they will be written.
+	// Pipes, FIFOs and the like: the size is only known at the end.
+	size = 0;
+	stream = 0;
+	for (int i = 0; i < nin; ++i) {
+		size = (size + in[i].align - 1) / in[i].align * in[i].align;
+		if (in[i].stream)
+			stream = 1;
+		else
+			size += in[i].size;
+	}
+
+	capacity = meta.size * (meta.sector / 512);
+	if (stream) {
+		// What is known so far (the rest is checked as it comes).
+		reqsectors = size / 512 + (size % 512 != 0? 1: 0);
+		if ((options & EXPECTED) != 0 && reqsectors < expected)
+			reqsectors = expected;
+	} else {
+		reqsectors = size / 512 + (size % 512 != 0? 1: 0);
+
+		if ((options & EXPECTED) != 0 && !f7_expected(size, expected)) {
+			closeinputs(in, nin);
+			close(fd);
+			exit(1);
+		}
+	}
+
+	// The compressed length is only known at the end.
+	if ((options & COMPRESS) == 0 && capacity < reqsectors) {
 		fprintf(
 			stderr
 			, "The number of sectors to load exceeds the slot capacity (%jd > %lld).\n"
 			, reqsectors
-			, meta.size
+			, capacity
 		);
 
-		close(fd[1]);
-		close(fd[0]);
+		closeinputs(in, nin);
+		close(fd);
 		exit(1);
 	}
 
 	{
-		ssize_t n;
-		size_t count;
-		off_t rem;
-		struct stat statbuf;
-		uchar *buf;
+		off_t offset;
+		off_t pos, raw, copied, cloned, zeroed, resumed;
+		vlong awrites, uwrites;
+		Copy c;
+		char idx[PATH_MAX];
+		int indexed;
+		Merkle m;
+		Journal journal;
+		Progress progress;
+		char cpath[PATH_MAX], now[PATH_MAX];
+		int cacheable, cached;
+		Digest digest;
+		int hashing;
+		int ok;
+
+		offset = f7_slotoffset(p, entry, &meta, slot);
+
+		// Another process could be loading it (or have just loaded it).
+		lock = devlock(fd, offset, meta.size * meta.sector, F_WRLCK, 0, "slot");
+		if (lock < 0 || !f7_reread(fd, p, entry, &meta) || f7_active(&meta, slot)) {
+			if (f7_active(&meta, slot))
+				fprintf(stderr, "The slot #%d was already active.\n", slot);
+			devunlock(lock);
+			closeinputs(in, nin);
+			close(fd);
+			exit(1);
+		}
+
+		PROBE4(slot_start, entry, slot, offset, size);
+		PROBECLOCK(slot_end, t);
 
+		// Any previous index is stale from now on.
+		// The journal is kept next to it (just in case).
+		indexed = merklepath(fd, argv[2], p, entry, slot, idx, sizeof(idx));
+		if (indexed) {
+			merkledrop(idx);
+			snprintf(jnl, sizeof(jnl), "%.*s.f7jnl", (int)strlen(idx) - 6, idx);
+		}
+		merkleinit(&m, offset);
+
+		if ((options & RECORD) != 0 && !indexed) {
+			fprintf(stderr, "There is no place for the digests (see F7DISK_INDEX).\n");
+			devunlock(lock);
+			closeinputs(in, nin);
+			close(fd);
+			exit(1);
+		}
+
+		resumed = 0;
 		do {
-			if (fstat(fd[0], &statbuf) < 0)
-				perror("Could not use stat over the file");
-			else if ((off_t)-1 == lseek(fd[0], (p[entry].start + meta.first + slot * meta.every) * 512, SEEK_SET))
-				perror("Could not seek the file offset");
-			else if ((buf = (uchar *)malloc(statbuf.st_blksize)) == nil)
-				fprintf(stderr, "Could not allocate the copy buffer.\n");
+			if ((options & RESUME) == 0) {
+				if (indexed)
+					journaldrop(jnl);
+				break;
+			}
+
+			if (!indexed)
+				fprintf(stderr, "There is no place for the journal (see F7DISK_INDEX).\n");
+			else if (!journalident(in[0].fd, &journal))
+				fprintf(stderr, "Could not read the payload %s: %s\n", in[0].file, strerror(errno));
 			else
 				break;
 
-			close(fd[1]);
-			close(fd[0]);
+			devunlock(lock);
+			closeinputs(in, nin);
+			close(fd);
 			exit(1);
 		} while (0);
 
-		rem = size;
-		while (0 < rem) {
-			if (statbuf.st_blksize < rem)
-				count = statbuf.st_blksize;
-			else
-				count = rem;
+		// What is there is only trusted if the payload is the same
+		// (and the blocks read back agree, unless told otherwise).
+		if ((options & RESUME) != 0) {
+			Journal saved;
+			vlong bad;
+
+			journal.offset = offset;
+			if (journalload(&saved, &m, jnl, offset)) {
+				if (
+					saved.size != journal.size
+					|| saved.mtime != journal.mtime
+					|| saved.head != journal.head
+					|| saved.tail != journal.tail
+				)
+					fprintf(stderr, "The journal is of another payload (starting over).\n");
+				else if ((options & TRUST) == 0 && 0 <= (bad = journalcheck(fd, offset, &m)))
+					fprintf(stderr, "The block #%lld differs from the journal (starting over).\n", bad);
+				else
+					resumed = saved.done;
+			}
+			if (resumed == 0) {
+				merklefree(&m);
+				merkleinit(&m, offset);
+			}
+
+			progress.m = &m;
+			progress.j = &journal;
+			progress.path = jnl;
+			progress.fd = fd;
+			progress.next = resumed + JOURNAL_EVERY;
+		}
 
-			n = read(fd[1], buf, count);
-			if ((size_t)n == count) {
-				n = write(fd[0], buf, count);
-				if (0 < n)
-					rem -= n;
+		// A single payload file: its hash index may be known already
+		// (then it is neither hashed nor, where it is cloned, read).
+		cacheable =
+			indexed
+			&& nin == 1
+			&& !in[0].stream
+			&& (options & (COMPRESS | RESUME)) == 0
+			&& cachepath(in[0].fd, cpath, sizeof(cpath));
+		cached = cacheable && cacheload(cpath, &m, offset);
+
+		if ((options & VERIFY) != 0) {
+			// Bypassing the page cache, the media is actually read back
+			// (a backend, through its descriptor).
+			if (backend(fd) != nil)
+				vfd = dup(fd);
+			else
+				vfd = open(argv[2], O_RDONLY | O_DIRECT);
+			if (vfd == -1 && errno == EINVAL) {
+				fprintf(stderr, "WARNING: Direct I/O is not supported (verifying through the cache).\n");
+				vfd = open(argv[2], O_RDONLY);
 			}
+			if (vfd == -1) {
+				perror("Cannot open the requested device/image file");
+				devunlock(lock);
+				closeinputs(in, nin);
+				close(fd);
+				exit(1);
+			}
+		}
 
-			do {
-				if (n < 0)
-					perror("Could not copy the payload");
-				else if ((size_t)n < count)
-					fprintf(stderr, "Could not copy the payload.\n");
-				else
+		// The digests and the hash index are computed on a thread of their
+		// own, from the buffers of the copy (but for a resumed load,
+		// whose journal needs the index as it is written).
+		hashing =
+			(options & (RESUME | COMPRESS)) == 0
+			&& ((options & DIGEST) != 0 || (indexed && !cached));
+		if (hashing && !digeststart(&digest, kinds, indexed && !cached? &m: nil)) {
+			merklefree(&m);
+			if (0 <= vfd)
+				close(vfd);
+			devunlock(lock);
+			closeinputs(in, nin);
+			close(fd);
+			exit(1);
+		}
+
+		pos = 0;
+		copied = 0;
+		cloned = 0;
+		zeroed = 0;
+		awrites = 0;
+		uwrites = 0;
+		ok = 1;
+		if ((options & COMPRESS) != 0) {
+			// The inputs (and their padding) are a single stream to compress.
+			Reader r = {in, nin, 0, 0, 0, 0};
+
+			pos = zstore(fd, offset, meta.size * meta.sector, readinputs, &r, indexed? &m: nil, &raw);
+			ok = 0 <= pos;
+		} else {
+			// Each input is a copy of its own (with its own zero-copy paths),
+			// straight into its place in the slot.
+			for (int i = 0; ok && i < nin; ++i) {
+				off_t aligned = (pos + in[i].align - 1) / in[i].align * in[i].align;
+				// Only a single input is resumed.
+				off_t skip = i == 0? resumed: 0;
+
+				// After a stream, it is known only now.
+				if (meta.size * meta.sector < aligned + (in[i].stream? 0: in[i].size)) {
+					fprintf(stderr, "The payload exceeds the slot capacity.\n");
+					ok = 0;
 					break;
+				}
+
+				if (aligned != pos) {
+					if (!(ok = padslot(fd, offset + pos, aligned - pos, hashing? &digest: nil)))
+						break;
+					copied += aligned - pos;
+					pos = aligned;
+				}
+
+				copyinit(&c, fd, in[i].fd, "payload");
+				c.dstoff = offset + pos + skip;
+				c.srcoff = skip;
+				c.size = in[i].stream? meta.size * meta.sector - pos: in[i].size - skip;
+				c.stream = in[i].stream;
+				c.reflink = (options & REFLINK) != 0;
+				c.sparse = (options & SPARSE) != 0;
+				c.erase = erase;
+				c.vfd = vfd;
+				c.lag = lag;
+				if ((options & RESUME) != 0) {
+					c.observe = f7_progress;
+					c.arg = &progress;
+				} else if (hashing) {
+					c.observe = digestfeed;
+					c.wait = digestwait;
+					c.arg = &digest;
+					c.behind = DIGEST_BEHIND;
+				}
+
+				ok = copydata(&c);
+				copied += c.copied;
+				cloned += c.cloned;
+				zeroed += c.zeroed;
+				awrites += c.aligned;
+				uwrites += c.unaligned;
+				pos += skip + c.copied + c.cloned;
+			}
+			raw = pos;
+		}
+		if (hashing)
+			digestend(&digest);
 
-				if (rem < size)
-					fprintf(
-						stderr
-						, "WARNING: %jd/%jd bytes were actually copied.\n"
-						, rem
-						, size
-					);
-
-				free(buf);
-				close(fd[1]);
-				close(fd[0]);
-				exit(1);
-			} while(0);
+		if (
+			!ok
+			|| (
+				stream
+				&& (options & EXPECTED) != 0
+				&& !f7_expected(raw, expected)
+			)
+		) {
+			merklefree(&m);
+			if (0 <= vfd)
+				close(vfd);
+			devunlock(lock);
+			closeinputs(in, nin);
+			close(fd);
+			exit(1);
 		}
 
-		free(buf);
+		PROBE4(slot_end, entry, slot, pos, PROBENS(t));
+
+		// A cached index is only right for what was there before.
+		if (cacheable && (!cachepath(in[0].fd, now, sizeof(now)) || strcmp(now, cpath) != 0)) {
+			fprintf(stderr, "WARNING: The payload has changed while it was loaded.\n");
+			indexed = indexed && !cached;
+			cacheable = 0;
+		}
+
+		// The index is not essential (it only warns).
+		if (indexed && merklefinish(&m)) {
+			merklesave(&m, idx);
+			if (cacheable && !cached)
+				cachesave(cpath, &m);
+		}
+		merklefree(&m);
+		if ((options & RECORD) != 0)
+			digestsave(&digest, idx);
+
+		if ((options & REFLINK) != 0) {
+			printf("Cloned = %jd bytes\n", (intmax_t)cloned);
+			printf("Copied = %jd bytes\n", (intmax_t)copied);
+		}
+		if ((options & SPARSE) != 0)
+			printf("Zeroed = %jd bytes\n", (intmax_t)zeroed);
+		if (0 < erase && (options & COMPRESS) == 0) {
+			printf("Erase block = %jd bytes\n", (intmax_t)erase);
+			printf("Writes = %lld aligned, %lld unaligned\n", awrites, uwrites);
+		}
+		if ((options & RESUME) != 0)
+			printf("Resumed = %jd bytes\n", (intmax_t)resumed);
+		if (cached)
+			printf("Hash index = cached\n");
+		if ((options & DIGEST) != 0)
+			digestprint(&digest, stdout);
+		if ((options & COMPRESS) != 0)
+			printf("Stored = %jd bytes (%jd raw)\n", (intmax_t)pos, (intmax_t)raw);
+		iostats();
+
+		if (0 <= vfd)
+			close(vfd);
 	}
 
-	if (!f7_write_bitmap(fd[0], p, entry, bitmap)) {
-		close(fd[1]);
-		close(fd[0]);
+	if (!f7_commit(fd, p, entry, &meta, slot, 1)) {
+		devunlock(lock);
+		closeinputs(in, nin);
+		close(fd);
 		exit(1);
 	}
+	devunlock(lock);
+
+	if ((options & RESUME) != 0)
+		journaldrop(jnl);
 
-	close(fd[1]);
-	close(fd[0]);
+	closeinputs(in, nin);
+	close(fd);
+}
+
+void
+f7_verify(int argc, char **argv)
+{
+	int fd;
+	int entry;
+	int slot;
+	PartEntry p[4];
+	uchar header[F7_HEADER_MAX];
+	MetaF7 meta;
+	char idx[PATH_MAX];
+	off_t offset;
+	Merkle saved, actual;
+	uchar *buf;
+	int lock;
+	Zhead z;
+	int compressed;
+
+	if (argc < 5) {
+		usage();
+		exit(1);
+	}
+	ioargs(argc, argv, 5);
+
+	entry = atol2(argv[3]);
+	slot = atol2(argv[4]);
+	if (
+		entry < 0 || 3 < entry
+		|| slot < 0 || F7_SLOTS_MAX <= slot
+	) {
+		usage();
+		exit(1);
+	}
+
+	fd = devopen(argv[2], O_RDONLY);
+	if (fd == -1) {
+		perror("Cannot open the requested device/image file");
+		exit(1);
+	}
+
+	if (
+		!read_ptable(fd, p)
+		|| !f7_read_header(fd, p, entry, header)
+		|| !f7_retrieve_meta(header, &meta)
+	) {
+		close(fd);
+		exit(1);
+	}
+
+	offset = f7_slotoffset(p, entry, &meta, slot);
+	do {
+		if (meta.count <= slot)
+			fprintf(stderr, "There is only %d slot/s.\n", meta.count);
+		else if (!f7_active(&meta, slot))
+			fprintf(stderr, "The slot #%d is not active.\n", slot);
+		else if ((compressed = zprobe(fd, offset, &z)))
+			break;
+		else if (
+			!merklepath(fd, argv[2], p, entry, slot, idx, sizeof(idx))
+			|| !merkleload(&saved, idx, offset)
+		)
+			fprintf(stderr, "There is no hash index for the slot #%d.\n", slot);
+		else if ((buf = (uchar *)malloc(1 << MERKLE_SHIFT)) == nil)
+			fprintf(stderr, "Could not allocate the read buffer.\n");
+		else
+			break;
+
+		close(fd);
+		exit(1);
+	} while (0);
+
+	// Not while it is being cleared or loaded.
+	lock = devlock(fd, offset, meta.size * meta.sector, F_RDLCK, 0, "slot");
+	if (lock < 0) {
+		if (!compressed) {
+			merklefree(&saved);
+			free(buf);
+		}
+		close(fd);
+		exit(1);
+	}
+
+	// Its blocks have their own hashes (the index is not needed).
+	if (compressed) {
+		int ok;
+
+		PROBE4(slot_start, entry, slot, offset, z.stored);
+		PROBECLOCK(slot_end, zt);
+		ok = zextract(fd, offset, &z, -1);
+		devunlock(lock);
+		close(fd);
+		PROBE4(slot_end, entry, slot, z.stored, PROBENS(zt));
+		if (!ok)
+			exit(1);
+
+		printf(
+			"Slot #%d = %lld bytes OK (%lld compressed)\n"
+			, slot
+			, (vlong)z.raw
+			, (vlong)z.stored
+		);
+		iostats();
+		return;
+	}
+
+	PROBE4(slot_start, entry, slot, offset, saved.length);
+	PROBECLOCK(slot_end, t);
+	merkleinit(&actual, offset);
+	for (off_t pos = 0; pos < saved.length;) {
+		size_t count = (off_t)1 << MERKLE_SHIFT;
+		ssize_t n;
+
+		if (saved.length - pos < (off_t)count)
+			count = saved.length - pos;
+
+		n = preadfull(fd, buf, count, offset + pos);
+		throttle(count);
+		if (n != (ssize_t)count) {
+			if (n < 0)
+				perror("Could not read the slot");
+			else
+				fprintf(stderr, "Could not read the whole slot.\n");
+			free(buf);
+			devunlock(lock);
+			close(fd);
+			exit(1);
+		}
+
+		merklefeed(&actual, buf, count);
+		pos += count;
+	}
+	free(buf);
+	devunlock(lock);
+	close(fd);
+	PROBE4(slot_end, entry, slot, saved.length, PROBENS(t));
+
+	if (!merklefinish(&actual))
+		exit(1);
+
+	if (merkleroot(&actual) != merkleroot(&saved)) {
+		uchar *leaves;
+		vlong n;
+
+		if ((leaves = (uchar *)malloc(saved.nleaves)) == nil) {
+			fprintf(stderr, "Could not allocate the block list.\n");
+			exit(1);
+		}
+
+		n = merklediff(&saved, &actual, leaves);
+		for (vlong i = 0; i < saved.nleaves; ++i)
+			if (leaves[i])
+				printf(
+					"Block #%lld differs (at byte %lld).\n"
+					, i
+					, i << saved.shift
+				);
+		printf("%lld/%lld block/s differ.\n", n, saved.nleaves);
+
+		free(leaves);
+		exit(1);
+	}
+
+	printf("Slot #%d = %lld bytes OK\n", slot, (vlong)saved.length);
+	iostats();
+	merklefree(&actual);
+	merklefree(&saved);
+}
+
+// The messages go to stderr (the data can go to stdout).
+void
+f7_dump(int argc, char **argv)
+{
+	int fd, out;
+	int entry;
+	int slot;
+	PartEntry p[4];
+	uchar header[F7_HEADER_MAX];
+	MetaF7 meta;
+	off_t offset, length;
+	int lock;
+	Zhead z;
+	int compressed;
+	int ok;
+
+	if (argc < 6) {
+		usage();
+		exit(1);
+	}
+	ioargs(argc, argv, 6);
+
+	entry = atol2(argv[3]);
+	slot = atol2(argv[4]);
+	if (
+		entry < 0 || 3 < entry
+		|| slot < 0 || F7_SLOTS_MAX <= slot
+	) {
+		usage();
+		exit(1);
+	}
+
+	fd = devopen(argv[2], O_RDONLY);
+	if (fd == -1) {
+		perror("Cannot open the requested device/image file");
+		exit(1);
+	}
+
+	if (
+		!read_ptable(fd, p)
+		|| !f7_read_header(fd, p, entry, header)
+		|| !f7_retrieve_meta(header, &meta)
+	) {
+		close(fd);
+		exit(1);
+	}
+
+	do {
+		if (meta.count <= slot)
+			fprintf(stderr, "There is only %d slot/s.\n", meta.count);
+		else if (!f7_active(&meta, slot))
+			fprintf(stderr, "The slot #%d is not active.\n", slot);
+		else
+			break;
+
+		close(fd);
+		exit(1);
+	} while (0);
+
+	if (strcmp(argv[5], "-") == 0)
+		out = dup(STDOUT_FILENO);
+	else
+		out = open(argv[5], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out == -1) {
+		fprintf(stderr, "Cannot open the output %s: %s\n", argv[5], strerror(errno));
+		close(fd);
+		exit(1);
+	}
+
+	offset = f7_slotoffset(p, entry, &meta, slot);
+	lock = devlock(fd, offset, meta.size * meta.sector, F_RDLCK, 0, "slot");
+	if (lock < 0) {
+		close(out);
+		close(fd);
+		exit(1);
+	}
+
+	PROBECLOCK(slot_end, t);
+	compressed = zprobe(fd, offset, &z);
+	if (compressed) {
+		PROBE4(slot_start, entry, slot, offset, z.stored);
+		ok = zextract(fd, offset, &z, out);
+		length = z.raw;
+	} else {
+		uchar *buf;
+
+		// Without an index, the whole slot.
+		length = f7_payload(fd, argv[2], p, entry, &meta, slot);
+		PROBE4(slot_start, entry, slot, offset, length);
+		if ((buf = (uchar *)malloc(1 << MERKLE_SHIFT)) == nil) {
+			fprintf(stderr, "Could not allocate the read buffer.\n");
+			ok = 0;
+		} else {
+			ok = 1;
+		}
+
+		for (off_t pos = 0; ok && pos < length;) {
+			size_t count = (off_t)1 << MERKLE_SHIFT;
+			ssize_t n;
+
+			if (length - pos < (off_t)count)
+				count = length - pos;
+
+			n = preadfull(fd, buf, count, offset + pos);
+			throttle(count);
+			if (n != (ssize_t)count) {
+				if (n < 0)
+					perror("Could not read the slot");
+				else
+					fprintf(stderr, "Could not read the whole slot.\n");
+				ok = 0;
+			} else if (writefull(out, buf, count) != (ssize_t)count) {
+				perror("Could not write the data");
+				ok = 0;
+			}
+			pos += count;
+		}
+		free(buf);
+	}
+	devunlock(lock);
+	close(fd);
+	PROBE4(slot_end, entry, slot, length, PROBENS(t));
+
+	if (close(out) != 0 && ok) {
+		perror("Could not write the data");
+		ok = 0;
+	}
+	if (!ok)
+		exit(1);
+
+	fprintf(stderr, "Slot #%d = %lld bytes\n", slot, (vlong)length);
+	if (strcmp(argv[5], "-") != 0)
+		iostats();
 }
 
 void
@@ -283,7 +993,7 @@ f7_brief(int argc, char **argv)
 	int fd;
 	int entry;
 	PartEntry p[4];
-	uchar header[24];
+	uchar header[F7_HEADER_MAX];
 	MetaF7 meta;
 
 	if (argc != 4) {
@@ -297,7 +1007,7 @@ f7_brief(int argc, char **argv)
 		exit(1);
 	}
 
-	fd = open(argv[2], O_RDONLY);
+	fd = devopen(argv[2], O_RDONLY);
 	if (fd == -1) {
 		perror("Cannot open the requested device/image file");
 		exit(1);
@@ -316,60 +1026,173 @@ f7_brief(int argc, char **argv)
 		exit(1);
 
 	{
-		int i;
 		vlong v;
 		int unit;
-		int active;
-
-		active = 0;
-		for (i = 0; i < meta.count; ++i)
-			if (meta.bitmap >> i & 0x1)
-				++active;
-		for (; i < 16; ++i)
-			if (meta.bitmap >> i & 0x1)
+		int bits;
+		int scale;
+
+		// The bits stored on disk, beyond the slot count.
+		bits = meta.version == 0x00? 16: (meta.count + 7) / 8 * 8;
+		for (int i = meta.count; i < bits; ++i)
+			if (f7_active(&meta, i))
 				fprintf(stderr, "WARNING: Slot bit #%d set, but should be unused.\n", i);
 
-		printf("Active slots = %d/%d\n", active, meta.count);
-		printf("Bitmap = %04X\n", meta.bitmap);
-		shortensectors(meta.first, &v, &unit);
+		if (meta.version != 0x00) {
+			printf("Version = %d\n", meta.version);
+			printf("Sector = %d bytes\n", meta.sector);
+		}
+		printf("Active slots = %d/%d\n", f7_popcount(&meta), meta.count);
+		printf("Bitmap = ");
+		for (int i = (bits + 3) / 4 - 1; 0 <= i; --i)
+			printf("%X", (uint)(meta.bitmap[i / 16] >> i % 16 * 4 & 0xF));
+		printf("\n");
+
+		// The units are the same for any sector size.
+		scale = meta.sector / 512;
+		shortensectors(meta.first * scale, &v, &unit);
 		printf("First = +%lld%s\n", v, strunit(unit));
-		shortensectors(meta.size, &v, &unit);
+		shortensectors(meta.size * scale, &v, &unit);
 		printf("Size = %lld%s\n", v, strunit(unit));
-		shortensectors(meta.every, &v, &unit);
+		shortensectors(meta.every * scale, &v, &unit);
 		printf("Every = %lld%s\n", v, strunit(unit));
 	}
 }
 
 void
 f7_override(int argc, char **argv)
+{
+	f7_format(argc, argv, 0);
+}
+
+void
+f7_relayout(int argc, char **argv)
+{
+	f7_format(argc, argv, 1);
+}
+
+// Both commands compute the layout the same way,
+// but relayout keeps the active slots (moving their data).
+static void
+f7_format(int argc, char **argv, int relayout)
 {
 	int fd;
 	int entry;
 	PartEntry p[4];
-	vlong partsize;
-
-	int options = 0;
-	int count;
-	vlong first;
-	vlong size;
-	vlong every;
+	MetaF7 old, layout;
+	MovePlan plan;
+	SlotMove *moves = plan.moves;
+	int nmoves = 0;
+	int lock;
+	F7Format f;
+	int scale;
 
 	if (argc < 4) {
 		usage();
 		exit(1);
 	}
+	if (relayout && 5 <= argc && strcmp(argv[4], "--resume") == 0) {
+		f7_resumemoves(argc, argv);
+		return;
+	}
 
 	entry = atol2(argv[3]);
-	if (entry < 0 || 3 < entry) {
+	if (entry < 0 || 3 < entry || !f7_formatargs(argc, argv, 4, relayout, &f)) {
 		usage();
 		exit(1);
 	}
 
-	for (int i = 4; i < argc; i += 1) {
+	fd = devopen(argv[2], O_RDWR);
+	if (fd == -1) {
+		perror("Cannot open the requested device/image file");
+		exit(1);
+	}
+
+	if (!read_ptable(fd, p) || !f7_layout(p, entry, lbasize(fd), &f, &layout)) {
+		close(fd);
+		exit(1);
+	}
+	scale = layout.sector / 512;
+
+	if (relayout) {
+		uchar header[F7_HEADER_MAX];
+
+		if (
+			!f7_read_header(fd, p, entry, header)
+			|| !f7_retrieve_meta(header, &old)
+			|| !f7_planmoves(fd, argv[2], p, entry, &old, &layout, moves, &nmoves)
+		) {
+			close(fd);
+			exit(1);
+		}
+
+		for (int i = 0; i < nmoves; ++i)
+			f7_mark(&layout, moves[i].to, 1);
+	}
+
+	if (f.dryrun) {
+		vlong v;
+		int unit;
+
+		printf("Version = %d\n", layout.version);
+		printf("Slots = %d\n", layout.count);
+		shortensectors(layout.first * scale, &v, &unit);
+		printf("First = +%lld%s\n", v, strunit(unit));
+		shortensectors(layout.size * scale, &v, &unit);
+		printf("Size = %lld%s\n", v, strunit(unit));
+		shortensectors(layout.every * scale, &v, &unit);
+		printf("Every = %lld%s\n", v, strunit(unit));
+		for (int i = 0; i < nmoves; ++i)
+			if (moves[i].src != moves[i].dst)
+				printf("Slot #%d: to be moved (%jd bytes)\n", moves[i].from, (intmax_t)moves[i].length);
+
+		close(fd);
+		exit(0);
+	}
+
+	if ((lock = f7_lockall(fd, p, entry, layout.sector, relayout? &old: nil)) < 0) {
+		close(fd);
+		exit(1);
+	}
+
+	// Only the data is moved first: the old header stays valid
+	// until the new one replaces it (see f7_moveslots).
+	if (relayout) {
+		plan.old = old;
+		plan.new = layout;
+		plan.n = nmoves;
+		plan.next = 0;
+		plan.done = 0;
+		plan.backup = nil;
+		plan.backlen = 0;
+		if (f7_applyplan(fd, argv[2], p, entry, &plan) < 0) {
+			devunlock(lock);
+			close(fd);
+			exit(1);
+		}
+		iostats();
+	} else if (!f7_write_header(fd, p, entry, &layout)) {
+		devunlock(lock);
+		close(fd);
+		exit(1);
+	}
+
+	devunlock(lock);
+	close(fd);
+}
+
+// The options of override from argv[i] on (and those of relayout).
+// It returns 0 if they cannot be parsed (or --slots is missing).
+int
+f7_formatargs(int argc, char **argv, int i, int relayout, F7Format *f)
+{
+	memset(f, 0, sizeof(*f));
+
+	for (; i < argc; i += 1) {
 		int o;
 
 		if (strcmp(argv[i], "--dry-run") == 0) {
 			o = DRYRUN;
+			f->dryrun = 1;
 		} else if (argc <= i + 1) {
 			o = UNKNOWN;
 		} else if (strcmp(argv[i], "--slots") == 0) {
@@ -377,55 +1200,74 @@ f7_override(int argc, char **argv)
 			o = SLOTS;
 
 			lcount = atol2(argv[i + 1]);
-			if (lcount < 1 || 16 < lcount) {
-				usage();
-				exit(1);
-			}
-			count = lcount;
+			if (lcount < 1 || F7_SLOTS_MAX < lcount)
+				return 0;
+			f->count = lcount;
+		} else if (strcmp(argv[i], "--ionice") == 0) {
+			o = relayout && (f->options & IONICE) == 0 && setionice(argv[i + 1])? IONICE: UNKNOWN;
+		} else if (strcmp(argv[i], "--max-rate") == 0) {
+			o = relayout && (f->options & MAXRATE) == 0 && setmaxrate(argv[i + 1])? MAXRATE: UNKNOWN;
+		} else if (strcmp(argv[i], "--version") == 0) {
+			o = VERSION;
+			f->version = atol2(argv[i + 1]);
+			if (f->version < 0x00 || 0x01 < f->version)
+				return 0;
 		} else if (strcmp(argv[i], "--first") == 0) {
 			o = FIRST;
-			first = atolba(argv[i + 1]);
+			f->first = atolba(argv[i + 1]);
 		} else if (strcmp(argv[i], "--size") == 0) {
 			o = SIZE;
-			size = atolba(argv[i + 1]);
+			f->size = atolba(argv[i + 1]);
 		} else if (strcmp(argv[i], "--every") == 0) {
 			o = EVERY;
-			every = atolba(argv[i + 1]);
+			f->every = atolba(argv[i + 1]);
 		} else {
 			o = UNKNOWN;
 		}
 
 		if (
 			o == UNKNOWN
-			|| (options & o) != 0
-		) {
-			usage();
-			exit(1);
-		}
+			|| (f->options & o) != 0
+		)
+			return 0;
 		if (o != DRYRUN)
 			i += 1;
 
-		options |= o;
+		f->options |= o;
 	}
 
-	if ((options & FIRST) == 0) {
-		first = 1;
-	}
-	if ((options & SLOTS) == 0) {
-		usage();
-		exit(1);
-	}
-
-	fd = open(argv[2], O_RDWR);
-	if (fd == -1) {
-		perror("Cannot open the requested device/image file");
-		exit(1);
-	}
+	return (f->options & SLOTS) != 0;
+}
 
-	if (!read_ptable(fd, p)) {
-		close(fd);
-		exit(1);
+// The layout of the partition (with an empty bitmap),
+// or 0 after a message if it does not fit.
+int
+f7_layout(PartEntry const *p, int entry, int sector, F7Format const *f, MetaF7 *layout)
+{
+	vlong partsize;
+	int count = f->count;
+	vlong first = f->first;
+	vlong size = f->size;
+	vlong every = f->every;
+	int version = f->version;
+	int scale;
+	int fits;
+
+	// The arguments are 512-byte sectors; the header uses the device ones.
+	scale = sector / 512;
+	if (
+		((f->options & FIRST) != 0 && first % scale != 0)
+		|| ((f->options & SIZE) != 0 && size % scale != 0)
+		|| ((f->options & EVERY) != 0 && every % scale != 0)
+	) {
+		fprintf(stderr, "The addresses must be multiples of the sector size (%d bytes).\n", sector);
+		return 0;
 	}
+	first = (f->options & FIRST) != 0? first / scale: 1;
+	if ((f->options & SIZE) != 0)
+		size /= scale;
+	if ((f->options & EVERY) != 0)
+		every /= scale;
 
 	do {
 		if (p[entry].type == 0x00) {
@@ -454,8 +1296,7 @@ f7_override(int argc, char **argv)
 			break;
 		}
 
-		close(fd);
-		exit(1);
+		return 0;
 	} while (0);
 
 	partsize = p[entry].size;
@@ -474,68 +1315,154 @@ f7_override(int argc, char **argv)
 			break;
 		}
 
-		close(fd);
-		exit(1);
+		return 0;
 	} while(0);
 	partsize -= first;
 
-	if ((options & (SIZE | EVERY)) == EVERY) {
+	if ((f->options & (SIZE | EVERY)) == EVERY) {
 		size = every;
-	} else if ((options & (SIZE | EVERY)) != (SIZE | EVERY)) {
-		if ((options & SIZE) == 0)
+	} else if ((f->options & (SIZE | EVERY)) != (SIZE | EVERY)) {
+		if ((f->options & SIZE) == 0)
 			size = partsize / count;
 		every = size;
 	}
 
+	// Version 0x00 is kept while the layout fits in it.
+	fits = sector == 512 && count <= 16 && every - size <= DIST_MAX;
+	if ((f->options & VERSION) == 0)
+		version = fits? 0x00: 0x01;
+
+	do {
+		if (every < size)
+			fprintf(
+				stderr
+				, "'Every' cannot be less than 'size'.\n"
+			);
+		else if (version == 0x00 && !fits)
+			fprintf(
+				stderr
+				, "Version 0 headers are limited to 16 slots, 512-byte sectors"
+				" and 'every' greater than 'size' by less than 32 MiB.\n"
+			);
+		else if (partsize < (count - 1) * every + size)
+			fprintf(
+				stderr
+				, "The partition is too small for %d slot/s.\n"
+				, count
+			);
+		else
+			break;
+
+		return 0;
+	} while (0);
+
+	memset(layout, 0, sizeof(*layout));
+	layout->version = version;
+	layout->sector = sector;
+	layout->count = count;
+	layout->first = first;
+	layout->size = size;
+	layout->every = every;
+	return 1;
+}
+
+// The whole partition but its header (where the layout changes),
+// checking that the bitmap (if any) has not changed in the meantime.
+int
+f7_lockall(int fd, PartEntry const *p, int entry, int sector, MetaF7 const *meta)
+{
+	MetaF7 now;
+	int lock;
+
+	lock = devlock(
+		fd
+		, (p[entry].start + 1) * sector
+		, (p[entry].size - 1) * sector
+		, F_WRLCK
+		, 0
+		, "F7h partition"
+	);
+	if (lock < 0 || meta == nil)
+		return lock;
+
+	now = *meta;
+	if (!f7_reread(fd, p, entry, &now)) {
+		devunlock(lock);
+		return -1;
+	}
+	if (memcmp(now.bitmap, meta->bitmap, sizeof(now.bitmap)) != 0) {
+		fprintf(stderr, "The slot bitmap has changed (try again).\n");
+		devunlock(lock);
+		return -1;
+	}
+	return lock;
+}
+
+// The partition type is changed, too.
+// The bitmap is included (the whole sector in version 0x01).
+int
+f7_write_header(int fd, PartEntry const *p, int entry, MetaF7 const *meta)
+{
+	int lock;
+	int ok;
+
+	lock = devlock(fd, p[entry].start * meta->sector, meta->sector, F_WRLCK, 1, "F7h header");
+	if (lock < 0)
+		return 0;
+
+	ok = writeheader(fd, p, entry, meta);
+	devunlock(lock);
+	return ok;
+}
+
+static int
+writeheader(int fd, PartEntry const *p, int entry, MetaF7 const *meta)
+{
+	// This code assumes that LBA_MAX fits in the off_t type.
+
+	uchar header[F7_HEADER_MAX];
+	ssize_t n;
+	uchar const type = 0xF7;
+	int len;
+
+	len = f7_buildheader(meta, header);
+
+	n = pwritefull(fd, &type, 1, 446 + 0x10 * entry + 4);
 	do {
-		if (every < size)
-			fprintf(
-				stderr
-				, "'Every' cannot be less than 'size'.\n"
-			);
-		else if (size < LBA_MAX - DIST_MAX && size + DIST_MAX < every)
-			fprintf(
-				stderr
-				, "'Every' cannot be greater than 'size' by 32 MiB or more.\n"
-			);
-		else if (partsize < (count - 1) * every + size)
-			fprintf(
-				stderr
-				, "The partition is too small for %d slot/s.\n"
-				, count
-			);
+		if (n < 0)
+			perror("Could not change the partition type");
+		else if (n != 1)
+			fprintf(stderr, "Error changing the partition type.\n");
 		else
 			break;
 
-		close(fd);
-		exit(1);
-	} while (0);
-
-	if ((options & DRYRUN) != 0) {
-		vlong v;
-		int unit;
-
-		printf("Slots = %d\n", count);
-		shortensectors(first, &v, &unit);
-		printf("First = +%lld%s\n", v, strunit(unit));
-		shortensectors(size, &v, &unit);
-		printf("Size = %lld%s\n", v, strunit(unit));
-		shortensectors(every, &v, &unit);
-		printf("Every = %lld%s\n", v, strunit(unit));
+		return 0;
+	} while(0);
 
-		close(fd);
-		exit(0);
-	}
+	n = pwritefull(fd, header, len, p[entry].start * meta->sector);
+	do {
+		if (n < 0)
+			perror("Could not write the F7h header");
+		else if (n != len)
+			fprintf(stderr, "Error writing the F7h header (%zd bytes written).\n", n);
+		else
+			break;
 
-	{
-		// This code assumes that LBA_MAX fits in the off_t type.
+		return 0;
+	} while(0);
+	return 1;
+}
 
-		int i;
-		uchar header[24];
-		vlong padding = every - size;
-		ssize_t n;
-		uchar const type = 0xF7;
+// The header as written (only the version 0x01 fills the sector).
+// It returns its length.
+int
+f7_buildheader(MetaF7 const *meta, uchar *header)
+{
+	int i;
+	vlong padding = meta->every - meta->size;
+	int len;
 
+	if (meta->version == 0x00) {
 		i = 0;
 		header[i++] = 0xF7; // Type
 		header[i++] = 0x00; // Version
@@ -546,69 +1473,41 @@ f7_override(int argc, char **argv)
 		header[i++] = 'M';
 		header[i++] = 'G';
 
-		for (int j = 0; j < 4; ++j) {
-			header[i++] = (uchar)(first & 0xFF);
-			first = first >> 8;
-		}
+		for (int j = 0; j < 4; ++j)
+			header[i++] = (uchar)(meta->first >> j * 8 & 0xFF);
 
-		for (int j = 0; j < 4; ++j) {
-			header[i++] = (uchar)(size & 0xFF);
-			size = size >> 8;
-		}
+		for (int j = 0; j < 4; ++j)
+			header[i++] = (uchar)(meta->size >> j * 8 & 0xFF);
 
 		header[i++] = (uchar)(padding & 0xFF);
 		header[i++] = (uchar)(padding >> 8 & 0xFF);
 
 		header[i++] = 0; // reserved.
-		header[i++] = (uchar)(count - 1); // high nibble reserved.
+		header[i++] = (uchar)(meta->count - 1); // high nibble reserved.
 
 		header[i++] = 0; // reserved.
 		header[i++] = 0; // reserved.
 
 		// Slots usage bitmap.
-		header[i++] = 0;
-		header[i++] = 0;
-
-		if ((off_t)-1 == lseek(fd, 446 + 0x10 * entry + 4, SEEK_SET)) {
-			perror("Could not seek the file offset.");
-			close(fd);
-			exit(1);
-		}
-
-		n = write(fd, &type, 1);
-		do {
-			if (n < 0)
-				perror("Could not change the partition type");
-			else if (n != 1)
-				fprintf(stderr, "Error changing the partition type.\n");
-			else
-				break;
-
-			close(fd);
-			exit(1);
-		} while(0);
-
-		if ((off_t)-1 == lseek(fd, p[entry].start * 512, SEEK_SET)) {
-			perror("Could not seek the file offset.");
-			close(fd);
-			exit(1);
-		}
-
-		n = write(fd, header, 24);
-		do {
-			if (n < 0)
-				perror("Could not write the F7h header");
-			else if (n != 24)
-				fprintf(stderr, "Error writing the F7h header (%zd bytes written).\n", n);
-			else
-				break;
-
-			close(fd);
-			exit(1);
-		} while(0);
+		header[i++] = meta->bitmap[0] & 0xFF;
+		header[i++] = meta->bitmap[0] >> 8 & 0xFF;
+		len = i;
+	} else {
+		// The whole sector (see retrieve_meta1).
+		memset(header, 0, meta->sector);
+		header[0] = 0xF7; // Type
+		header[1] = 0x01; // Version
+		memcpy(&header[2], "SYSIMG", 6);
+		putle(&header[8], meta->sector, 2);
+		putle(&header[10], meta->count, 2);
+		putle(&header[16], meta->first, 8);
+		putle(&header[24], meta->size, 8);
+		putle(&header[32], padding, 8);
+		for (int j = 0; j < (meta->count + 7) / 8; ++j)
+			header[F7_HEADER_V1 + j] = meta->bitmap[j / 8] >> j % 8 * 8 & 0xFF;
+		len = meta->sector;
 	}
-
-	close(fd);
+	return len;
 }
 
 void
@@ -617,8 +1516,9 @@ f7_reset(int argc, char **argv)
 	int fd;
 	int entry;
 	PartEntry p[4];
-	uchar header[24];
+	uchar header[F7_HEADER_MAX];
 	MetaF7 meta;
+	char idx[PATH_MAX];
 
 	if (argc != 4) {
 		usage();
@@ -631,33 +1531,45 @@ f7_reset(int argc, char **argv)
 		exit(1);
 	}
 
-	fd = open(argv[2], O_RDWR);
+	fd = devopen(argv[2], O_RDWR);
 	if (fd == -1) {
 		perror("Cannot open the requested device/image file");
 		exit(1);
 	}
 
-	// The header and its meta struct are ignored.
-	// They are retrieved only to be sure it is possible.
+	// The header and its meta struct are retrieved
+	// to be sure it is possible (and to drop the slot indexes).
 	if (
 		!read_ptable(fd, p)
 		|| !f7_read_header(fd, p, entry, header)
 		|| !f7_retrieve_meta(header, &meta)
-		|| !f7_write_bitmap(fd, p, entry, 0x00)
 	) {
 		close(fd);
 		exit(1);
 	}
 
+	memset(meta.bitmap, 0, sizeof(meta.bitmap));
+	if (!f7_commit(fd, p, entry, &meta, -1, 0)) {
+		close(fd);
+		exit(1);
+	}
+
+	for (int slot = 0; slot < meta.count; ++slot)
+		if (merklepath(fd, argv[2], p, entry, slot, idx, sizeof(idx)))
+			merkledrop(idx);
+
 	close(fd);
 }
 
-static int
+int
 f7_read_header(int fd, PartEntry const *p, int entry, uchar *header)
 {
 	// This code assumes that LBA_MAX fits in the off_t type.
 
 	ssize_t n;
+	int sector;
+	int expected;
+	PROBECLOCK(header_read, t);
 
 	switch (p[entry].type) {
 	case 0xF7:
@@ -670,26 +1582,40 @@ f7_read_header(int fd, PartEntry const *p, int entry, uchar *header)
 		return 0;
 	}
 
-	if ((off_t)-1 == lseek(fd, p[entry].start * 512, SEEK_SET)) {
-		perror("Could not seek the file offset.");
-		return 0;
-	}
+	// The whole sector is read (it is written as a whole, too).
+	sector = lbasize(fd);
+	if (!devheader(fd, entry, header)) {
+		n = preadfull(fd, header, sector, p[entry].start * sector);
+		do {
+			if (n < 0)
+				perror("Could not read the F7h header");
+			else if (n != sector)
+				fprintf(stderr, "Error reading the F7h header (%zd bytes read).\n", n);
+			else
+				break;
 
-	n = read(fd, header, 24);
-	do {
-		if (n < 0)
-			perror("Could not read the F7h header");
-		else if (n != 24)
-			fprintf(stderr, "Error reading the F7h header (%zd bytes read).\n", n);
-		else
-			break;
+			return 0;
+		} while(0);
+	}
 
+	// Unknown headers are reported by f7_retrieve_meta.
+	expected = header[1] == 0x00? 512: (int)getle(&header[8], 2);
+	if (header[0] == 0xF7 && header[1] <= 0x01 && expected != sector) {
+		fprintf(
+			stderr
+			, "The F7h header expects %d-byte sectors, but the device has %d-byte sectors.\n"
+			, expected
+			, sector
+		);
 		return 0;
-	} while(0);
+	}
+
+	PROBE4(header_read, entry, p[entry].start * sector, header[1], PROBENS(t));
 	return 1;
 }
 
-static int f7_retrieve_meta(uchar *header, MetaF7 *meta)
+int
+f7_retrieve_meta(uchar *header, MetaF7 *meta)
 {
 	int i;
 	vlong padding;
@@ -710,7 +1636,7 @@ static int f7_retrieve_meta(uchar *header, MetaF7 *meta)
 			|| header[i++] != 'G'
 		)
 			fprintf(stderr, "Unknown subtype.\n");
-		else if (version != 0x00)
+		else if (version != 0x00 && version != 0x01)
 			fprintf(stderr, "Unknown version.\n");
 		else
 			break;
@@ -718,6 +1644,12 @@ static int f7_retrieve_meta(uchar *header, MetaF7 *meta)
 		return 0;
 	} while(0);
 
+	memset(meta->bitmap, 0, sizeof(meta->bitmap));
+	meta->version = version;
+	if (version == 0x01)
+		return retrieve_meta1(header, meta);
+
+	meta->sector = 512;
 	meta->first =
 		header[i]
 		| ((vlong)header[i + 1]) << 8
@@ -749,7 +1681,7 @@ static int f7_retrieve_meta(uchar *header, MetaF7 *meta)
 	i++; // reserved.
 
 	// Slots usage bitmap.
-	meta->bitmap =
+	meta->bitmap[0] =
 		header[i]
 		| ((uint)header[i + 1]) << 8
 	;
@@ -759,18 +1691,224 @@ static int f7_retrieve_meta(uchar *header, MetaF7 *meta)
 	return 1;
 }
 
+// Version 0x01 (little-endian, 40 bytes and the bitmap):
+//	0	F7h, 01h, "SYSIMG"
+//	8	Sector size, in bytes (2 bytes).
+//	10	Number of slots (2 bytes).
+//	12	Reserved (4 bytes).
+//	16	First, relative to the partition (8 bytes).
+//	24	Size (8 bytes).
+//	32	Padding (8 bytes).
+//	40	Slots usage bitmap (a bit per slot, rounded up to bytes).
+static int
+retrieve_meta1(uchar *header, MetaF7 *meta)
+{
+	vlong padding;
+
+	meta->sector = getle(&header[8], 2);
+	meta->count = getle(&header[10], 2);
+	meta->first = getle(&header[16], 8);
+	meta->size = getle(&header[24], 8);
+	padding = getle(&header[32], 8);
+
+	do {
+		if (
+			meta->sector < 512 || SECTOR_MAX < meta->sector
+			|| (meta->sector & (meta->sector - 1)) != 0
+		)
+			fprintf(stderr, "Unsupported sector size (%d bytes).\n", meta->sector);
+		else if (meta->count < 1 || F7_SLOTS_MAX < meta->count)
+			fprintf(stderr, "Unsupported number of slots (%d).\n", meta->count);
+		else if (
+			meta->first < 0 || LBA_MAX < meta->first
+			|| meta->size < 0 || LBA_MAX < meta->size
+			|| padding < 0 || LBA_MAX < padding
+		)
+			fprintf(stderr, "The F7h header bounds are impossible.\n");
+		else
+			break;
+
+		return 0;
+	} while (0);
+
+	for (int i = 0; i < (meta->count + 7) / 8; ++i)
+		meta->bitmap[i / 8] |= (uvlong)header[F7_HEADER_V1 + i] << i % 8 * 8;
+
+	meta->every = meta->size + padding;
+	return 1;
+}
+
+// "<image/->[@align=<sectors/units>]", cutting the name at the '@'.
+// It returns the alignment in bytes (1 if none), or 0 if it is wrong.
+off_t
+f7_inputalign(char *spec)
+{
+	char *at = strrchr(spec, '@');
+
+	if (at == nil || strncmp(at, "@align=", 7) != 0)
+		return 1;
+
+	*at = '\0';
+	if (at[7] == '\0')
+		return 0;
+	return atolba(&at[7]) * 512;
+}
+
+// The standard input can only be one of them
+// (the daemon passes the others as "-" too, see devinput).
+static int
+openinputs(Input *in, int n)
+{
+	int stdinput = 0;
+
+	for (int i = 0; i < n; ++i) {
+		if (strcmp(in[i].file, "-") == 0) {
+			if (devinputs() <= stdinput) {
+				fprintf(stderr, "The standard input can only be given once.\n");
+				return 0;
+			}
+			in[i].fd = devinput(stdinput++);
+		} else {
+			in[i].fd = open(in[i].file, O_RDONLY);
+		}
+		if (in[i].fd == -1) {
+			fprintf(stderr, "Cannot open the payload %s: %s\n", in[i].file, strerror(errno));
+			return 0;
+		}
+
+		do {
+			if ((in[i].size = lseek(in[i].fd, 0, SEEK_END)) == (off_t)-1 && errno != ESPIPE)
+				perror("Could not retrieve the payload file size");
+			else if (in[i].size != (off_t)-1 && (off_t)-1 == lseek(in[i].fd, 0, SEEK_SET))
+				perror("Could not seek the payload file offset");
+			else
+				break;
+
+			return 0;
+		} while (0);
+		in[i].stream = in[i].size == (off_t)-1;
+	}
+	return 1;
+}
+
+static void
+closeinputs(Input *in, int n)
+{
+	for (int i = 0; i < n; ++i)
+		if (0 <= in[i].fd)
+			close(in[i].fd);
+	free(in);
+}
+
+static ssize_t
+readinputs(void *arg, uchar *buf, size_t len)
+{
+	Reader *r = (Reader *)arg;
+
+	while (r->cur < r->n) {
+		Input *in = &r->in[r->cur];
+		ssize_t n;
+
+		if (!r->started) {
+			r->pad = (r->pos + in->align - 1) / in->align * in->align - r->pos;
+			r->started = 1;
+		}
+
+		if (0 < r->pad) {
+			n = r->pad < (off_t)len? (size_t)r->pad: len;
+			memset(buf, 0, n);
+			r->pad -= n;
+			r->pos += n;
+			return n;
+		}
+
+		n = read(in->fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			fprintf(stderr, "Could not read the payload %s: %s\n", in->file, strerror(errno));
+			return -1;
+		}
+		if (n == 0) {
+			r->cur += 1;
+			r->started = 0;
+			continue;
+		}
+		r->pos += n;
+		return n;
+	}
+	return 0;
+}
+
+// The padding between inputs is zeroed (it is part of the payload).
+static int
+padslot(int fd, off_t offset, off_t len, Digest *d)
+{
+	static uchar const zeros[PAD_MAX];
+
+	while (0 < len) {
+		size_t count = len < PAD_MAX? len: PAD_MAX;
+
+		if (pwritefull(fd, zeros, count, offset) < (ssize_t)count) {
+			fprintf(stderr, "Could not pad the payload: %s\n", strerror(errno));
+			return 0;
+		}
+		throttle(count);
+		if (d != nil)
+			digestfeed(d, zeros, count);
+		offset += count;
+		len -= count;
+	}
+	return 1;
+}
+
+// Every JOURNAL_EVERY bytes, what is written is made durable,
+// and then recorded (up to the last whole block of the index).
+static void
+f7_progress(void *arg, uchar const *buf, size_t len)
+{
+	Progress *p = (Progress *)arg;
+
+	merklefeed(p->m, buf, len);
+	if (p->m->length < p->next)
+		return;
+
+	if (fdatasync(p->fd) == 0 && bflush(p->fd))
+		journalsave(p->j, p->m, p->path);
+	p->next = p->m->length + JOURNAL_EVERY;
+}
+
 static int
+f7_expected(off_t size, vlong expected)
+{
+	vlong sectors = size / 512 + (size % 512 != 0? 1: 0);
+
+	if (sectors != expected) {
+		fprintf(
+			stderr
+			, "The payload size does not match the expected one (%lld != %lld sectors).\n"
+			, sectors
+			, expected
+		);
+		return 0;
+	}
+	return 1;
+}
+
+int
 f7_write_bitmap(
 	int fd
 	, PartEntry const *p
 	, int entry
-	, uint bitmap
+	, MetaF7 const *meta
 )
 {
 	// This code assumes that LBA_MAX fits in the off_t type.
 
 	ssize_t n;
-	uchar buf[2];
+	uchar buf[F7_HEADER_MAX];
+	off_t offset;
+	int len;
 
 	switch (p[entry].type) {
 	case 0xF7:
@@ -783,19 +1921,38 @@ f7_write_bitmap(
 		return 0;
 	}
 
-	buf[0] = bitmap & 0xFF;
-	buf[1] = bitmap >> 8 & 0xFF;
+	if (meta->version == 0x00) {
+		buf[0] = meta->bitmap[0] & 0xFF;
+		buf[1] = meta->bitmap[0] >> 8 & 0xFF;
+		offset = p[entry].start * 512 + (24 - 2);
+		len = 2;
+	} else {
+		// The sector is rewritten as a whole (a single atomic write).
+		offset = p[entry].start * meta->sector;
+		len = meta->sector;
+		n = preadfull(fd, buf, len, offset);
+		do {
+			if (n < 0)
+				perror("Could not read the F7h header");
+			else if (n != len)
+				fprintf(stderr, "Error reading the F7h header (%zd bytes read).\n", n);
+			else if (buf[0] != 0xF7 || buf[1] != meta->version)
+				fprintf(stderr, "The F7h header has changed.\n");
+			else
+				break;
+
+			return 0;
+		} while (0);
 
-	if ((off_t)-1 == lseek(fd, p[entry].start * 512 + (24 - 2), SEEK_SET)) {
-		perror("Could not seek the file offset.");
-		return 0;
+		for (int i = 0; i < (meta->count + 7) / 8; ++i)
+			buf[F7_HEADER_V1 + i] = meta->bitmap[i / 8] >> i % 8 * 8 & 0xFF;
 	}
 
-	n = write(fd, buf, 2);
+	n = pwritefull(fd, buf, len, offset);
 	do {
 		if (n < 0)
 			perror("Could not update the slot bitmap");
-		else if (n != 2)
+		else if (n != len)
 			fprintf(stderr, "Error updating the slot bitmap (%zd bytes written).\n", n);
 		else
 			break;
@@ -805,7 +1962,139 @@ f7_write_bitmap(
 	return 1;
 }
 
-static vlong
+// The bitmap is re-read under the header lock: other processes
+// may have changed other bits since it was read.
+int
+f7_commit(int fd, PartEntry const *p, int entry, MetaF7 *meta, int slot, int active)
+{
+	int lock;
+	int ok;
+	PROBECLOCK(bitmap_commit, t);
+
+	// The payload reaches the backend before it is marked as active.
+	if (!bflush(fd)) {
+		perror("Could not flush the device");
+		return 0;
+	}
+
+	lock = devlock(fd, p[entry].start * meta->sector, meta->sector, F_WRLCK, 1, "F7h header");
+	if (lock < 0)
+		return 0;
+
+	ok = slot < 0 || f7_reread(fd, p, entry, meta);
+	if (ok && 0 <= slot)
+		f7_mark(meta, slot, active);
+	ok = ok && f7_write_bitmap(fd, p, entry, meta);
+
+	devunlock(lock);
+	if (ok)
+		PROBE4(bitmap_commit, entry, slot, active, PROBENS(t));
+	return ok;
+}
+
+int
+f7_commitset(int fd, PartEntry const *p, int entry, MetaF7 *meta, uvlong const *set)
+{
+	int lock;
+	int ok;
+	PROBECLOCK(bitmap_commit, t);
+
+	if (!bflush(fd)) {
+		perror("Could not flush the device");
+		return 0;
+	}
+
+	lock = devlock(fd, p[entry].start * meta->sector, meta->sector, F_WRLCK, 1, "F7h header");
+	if (lock < 0)
+		return 0;
+
+	ok = f7_reread(fd, p, entry, meta);
+	for (int i = 0; ok && i < F7_SLOTS_MAX / 64; ++i)
+		meta->bitmap[i] |= set[i];
+	ok = ok && f7_write_bitmap(fd, p, entry, meta);
+
+	devunlock(lock);
+	if (ok)
+		PROBE4(bitmap_commit, entry, -1, 1, PROBENS(t));
+	return ok;
+}
+
+// Only the bitmap is taken (the layout must be the same).
+// The daemon cache is not used, since it could be stale.
+int
+f7_reread(int fd, PartEntry const *p, int entry, MetaF7 *meta)
+{
+	uchar header[F7_HEADER_MAX];
+	MetaF7 now;
+	ssize_t n;
+
+	n = preadfull(fd, header, meta->sector, p[entry].start * meta->sector);
+	if (n != meta->sector) {
+		if (n < 0)
+			perror("Could not read the F7h header");
+		else
+			fprintf(stderr, "Error reading the F7h header (%zd bytes read).\n", n);
+		return 0;
+	}
+
+	if (!f7_retrieve_meta(header, &now))
+		return 0;
+
+	if (
+		now.version != meta->version
+		|| now.count != meta->count
+		|| now.first != meta->first
+		|| now.size != meta->size
+		|| now.every != meta->every
+	) {
+		fprintf(stderr, "The F7h header has changed.\n");
+		return 0;
+	}
+
+	memcpy(meta->bitmap, now.bitmap, sizeof(meta->bitmap));
+	return 1;
+}
+
+int
+f7_active(MetaF7 const *meta, int slot)
+{
+	return meta->bitmap[slot / 64] >> slot % 64 & 0x1;
+}
+
+void
+f7_mark(MetaF7 *meta, int slot, int active)
+{
+	uvlong bit = (uvlong)0x1 << slot % 64;
+
+	if (active)
+		meta->bitmap[slot / 64] |= bit;
+	else
+		meta->bitmap[slot / 64] &= ~bit;
+}
+
+int
+f7_popcount(MetaF7 const *meta)
+{
+	int n = 0;
+
+	// Whole words, masking the bits beyond the slot count.
+	for (int i = 0; i < (meta->count + 63) / 64; ++i) {
+		uvlong word = meta->bitmap[i];
+
+		if (meta->count < (i + 1) * 64)
+			word &= ((uvlong)0x1 << meta->count % 64) - 1;
+		n += __builtin_popcountll(word);
+	}
+	return n;
+}
+
+off_t
+f7_slotoffset(PartEntry const *p, int entry, MetaF7 const *meta, int slot)
+{
+	return (p[entry].start + meta->first + slot * meta->every) * meta->sector;
+}
+
+vlong
 atolba(char *str)
 {
 	vlong max_unit;
@@ -876,7 +2165,7 @@ atolba(char *str)
 	return lba;
 }
 
-static long
+long
 atol2(char *str)
 {
 	long n;
@@ -898,7 +2187,7 @@ atol2(char *str)
 	return n;
 }
 
-static void
+void
 shortensectors(vlong sectors, vlong *n, int *unit)
 {
 	*n = sectors;
@@ -916,7 +2205,7 @@ shortensectors(vlong sectors, vlong *n, int *unit)
 		*n /= 1024;
 }
 
-static char const *
+char const *
 strunit(int unit)
 {
 	char const * str;
@@ -0,0 +1,132 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#define F7_SLOTS_MAX 1024 // Version 0x01 (version 0x00 is limited to 16).
+#define F7_HEADER_MAX SECTOR_MAX // The header never exceeds its sector.
+#define F7_HEADER_V1 40 // The bitmap offset (version 0x01).
+
+// Sizes and offsets are in sectors of the given size (in bytes).
+typedef struct {
+	int version;
+	int sector;
+	int count;
+	uvlong bitmap[F7_SLOTS_MAX / 64];
+	vlong first;
+	vlong size;
+	vlong every;
+} MetaF7;
+
+#define LBA_MAX (4LL * 1024 * 1024 * 1024 - 1) // (a.k.a. 2^32 - 1).
+#define DIST_MAX (32LL * 1024 * 2 - 1) // (a.k.a. 2^16 - 1).
+
+int f7_read_header(
+	int fd
+	, PartEntry const *p
+	, int entry
+	, uchar *header
+);
+int f7_retrieve_meta(uchar *header, MetaF7 *meta);
+int f7_write_header(int fd, PartEntry const *p, int entry, MetaF7 const *meta);
+int f7_buildheader(MetaF7 const *meta, uchar *header);
+int f7_lockall(int fd, PartEntry const *p, int entry, int sector, MetaF7 const *meta);
+
+// The options of override, as given (in 512-byte sectors).
+typedef struct {
+	int options;
+	int dryrun;
+	int count;
+	vlong first;
+	vlong size;
+	vlong every;
+	int version;
+} F7Format;
+
+int f7_formatargs(int argc, char **argv, int i, int relayout, F7Format *f);
+int f7_layout(PartEntry const *p, int entry, int sector, F7Format const *f, MetaF7 *layout);
+
+// Do not change multiple bits at the same time
+// (the reset command is an exception).
+// Use f7_commit, unless the header is already locked.
+int f7_write_bitmap(
+	int fd
+	, PartEntry const *p
+	, int entry
+	, MetaF7 const *meta
+);
+// Sets (or clears) a slot bit under the header lock, updating meta.
+// A negative slot writes the bitmap of meta as a whole.
+int f7_commit(int fd, PartEntry const *p, int entry, MetaF7 *meta, int slot, int active);
+// Sets the slot bits of 'set' at once, as f7_commit.
+int f7_commitset(int fd, PartEntry const *p, int entry, MetaF7 *meta, uvlong const *set);
+int f7_reread(int fd, PartEntry const *p, int entry, MetaF7 *meta);
+int f7_active(MetaF7 const *meta, int slot);
+void f7_mark(MetaF7 *meta, int slot, int active);
+int f7_popcount(MetaF7 const *meta);
+// Byte offset of a slot in the device/image file.
+off_t f7_slotoffset(PartEntry const *p, int entry, MetaF7 const *meta, int slot);
+// A slot moved to another layout (or slot number, see relayout.c).
+typedef struct {
+	int from;
+	int to;
+	off_t src;
+	off_t dst;
+	off_t length;
+} SlotMove;
+
+off_t f7_payload(
+	int fd
+	, char const *file
+	, PartEntry const *p
+	, int entry
+	, MetaF7 const *meta
+	, int slot
+);
+int f7_planmoves(
+	int fd
+	, char const *file
+	, PartEntry const *p
+	, int entry
+	, MetaF7 const *old
+	, MetaF7 const *new
+	, SlotMove *moves
+	, int *n
+);
+// The moves from one layout to another, and how far they are done
+// (as journaled, see journal.h).
+typedef struct {
+	MetaF7 old;
+	MetaF7 new; // The bitmap, with the slots moved.
+	SlotMove moves[F7_SLOTS_MAX];
+	int n;
+	int next; // Moves done (in the order they are done)...
+	off_t done; // ...and bytes of the next one.
+	uchar *backup; // The step being written over what it reads,
+	off_t backlen; // as read before (or nil).
+} MovePlan;
+
+// 'meta' is the header on disk (of the old layout). It returns how many
+// bytes were moved, or -1 on error. 'jnl' can be nil.
+vlong f7_moveslots(
+	int fd
+	, char const *file
+	, PartEntry const *p
+	, int entry
+	, MetaF7 *meta
+	, MovePlan *plan
+	, char const *jnl
+);
+// Moves the slots and writes the new header, journaled (if it can be),
+// with the partition locked. It returns as f7_moveslots.
+vlong f7_applyplan(int fd, char const *file, PartEntry const *p, int entry, MovePlan *plan);
+// relayout (or repack) <file> <0-3> --resume ...
+void f7_resumemoves(int argc, char **argv);
+
+// A payload of load: "<image/->[@align=<sectors/units>]" (cut at the '@').
+// It returns the alignment in bytes (1 if none), or 0 if it is wrong.
+off_t f7_inputalign(char *spec);
+
+vlong atolba(char *str);
+long atol2(char *str);
+void shortensectors(vlong sectors, vlong *n, int *unit);
+char const *strunit(int unit);
@@ -0,0 +1,316 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "u.h"
+#include "ptable.h"
+#include "hash.h"
+
+#if defined(__x86_64__)
+	#include <immintrin.h>
+	#define CRC_SIMD
+#endif
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+#define CRC32C_POLY 0x82F63B78 // Reversed.
+
+static uint crctable[8][256];
+
+static uint const k256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint crcscalar(uint crc, uchar const *buf, size_t len);
+#ifdef CRC_SIMD
+static uint crcsse42(uint crc, uchar const *buf, size_t len);
+#endif
+static void sha256block(uint *h, uchar const *p);
+
+static uvlong
+rotl(uvlong x, int r)
+{
+	return x << r | x >> (64 - r);
+}
+
+static uvlong
+round64(uvlong acc, uvlong input)
+{
+	acc += input * P2;
+	acc = rotl(acc, 31);
+	return acc * P1;
+}
+
+static uvlong
+merge64(uvlong acc, uvlong v)
+{
+	acc ^= round64(0, v);
+	return acc * P1 + P4;
+}
+
+void
+xxh64init(Xxh64 *s, uvlong seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->v[0] = seed + P1 + P2;
+	s->v[1] = seed + P2;
+	s->v[2] = seed;
+	s->v[3] = seed - P1;
+}
+
+void
+xxh64update(Xxh64 *s, uchar const *buf, size_t len)
+{
+	uchar const *end = buf + len;
+
+	s->total += len;
+
+	if (s->memsize + len < 32) {
+		memcpy(&s->mem[s->memsize], buf, len);
+		s->memsize += len;
+		return;
+	}
+
+	if (s->memsize != 0) {
+		size_t fill = 32 - s->memsize;
+
+		memcpy(&s->mem[s->memsize], buf, fill);
+		for (int i = 0; i < 4; ++i)
+			s->v[i] = round64(s->v[i], getle(&s->mem[8 * i], 8));
+		buf += fill;
+		s->memsize = 0;
+	}
+
+	for (; buf + 32 <= end; buf += 32)
+		for (int i = 0; i < 4; ++i)
+			s->v[i] = round64(s->v[i], getle(&buf[8 * i], 8));
+
+	if (buf < end) {
+		memcpy(s->mem, buf, end - buf);
+		s->memsize = end - buf;
+	}
+}
+
+uvlong
+xxh64final(Xxh64 const *s)
+{
+	uvlong h;
+	uchar const *p = s->mem;
+	uchar const *end = s->mem + s->memsize;
+
+	if (32 <= s->total) {
+		h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12) + rotl(s->v[3], 18);
+		for (int i = 0; i < 4; ++i)
+			h = merge64(h, s->v[i]);
+	} else {
+		// v[2] holds the seed.
+		h = s->v[2] + P5;
+	}
+
+	h += s->total;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= round64(0, getle(p, 8));
+		h = rotl(h, 27) * P1 + P4;
+	}
+	if (p + 4 <= end) {
+		h ^= getle(p, 4) * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		h ^= *p * P5;
+		h = rotl(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+uvlong
+xxh64(uchar const *buf, size_t len, uvlong seed)
+{
+	Xxh64 s;
+
+	xxh64init(&s, seed);
+	xxh64update(&s, buf, len);
+	return xxh64final(&s);
+}
+
+uint
+crc32c(uint crc, uchar const *buf, size_t len)
+{
+	static uint (*kernel)(uint crc, uchar const *buf, size_t len);
+
+	if (kernel == nil) {
+		// Slicing by 8: crctable[k][b] is b followed by k zero bytes.
+		for (int b = 0; b < 256; ++b) {
+			uint c = b;
+
+			for (int i = 0; i < 8; ++i)
+				c = c >> 1 ^ (c & 1? CRC32C_POLY: 0);
+			crctable[0][b] = c;
+		}
+		for (int b = 0; b < 256; ++b)
+			for (int k = 1; k < 8; ++k)
+				crctable[k][b] = crctable[k - 1][b] >> 8 ^ crctable[0][crctable[k - 1][b] & 0xFF];
+
+		kernel = crcscalar;
+#ifdef CRC_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.2"))
+			kernel = crcsse42;
+#endif
+	}
+	return ~kernel(~crc, buf, len);
+}
+
+static uint
+crcscalar(uint crc, uchar const *buf, size_t len)
+{
+	for (; 8 <= len; buf += 8, len -= 8) {
+		uint lo = crc ^ (uint)getle(buf, 4);
+		uint hi = getle(&buf[4], 4);
+
+		crc =
+			crctable[7][lo & 0xFF] ^ crctable[6][lo >> 8 & 0xFF]
+			^ crctable[5][lo >> 16 & 0xFF] ^ crctable[4][lo >> 24]
+			^ crctable[3][hi & 0xFF] ^ crctable[2][hi >> 8 & 0xFF]
+			^ crctable[1][hi >> 16 & 0xFF] ^ crctable[0][hi >> 24];
+	}
+	for (; 0 < len; ++buf, --len)
+		crc = crc >> 8 ^ crctable[0][(crc ^ *buf) & 0xFF];
+	return crc;
+}
+
+#ifdef CRC_SIMD
+__attribute__((target("sse4.2")))
+static uint
+crcsse42(uint crc, uchar const *buf, size_t len)
+{
+	uvlong c = crc;
+
+	for (; 8 <= len; buf += 8, len -= 8)
+		c = _mm_crc32_u64(c, getle(buf, 8));
+	for (; 0 < len; ++buf, --len)
+		c = _mm_crc32_u8(c, *buf);
+	return c;
+}
+#endif
+
+void
+sha256init(Sha256 *s)
+{
+	static uint const iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memset(s, 0, sizeof(*s));
+	memcpy(s->h, iv, sizeof(iv));
+}
+
+void
+sha256update(Sha256 *s, uchar const *buf, size_t len)
+{
+	s->total += len;
+
+	if (s->memsize != 0) {
+		size_t fill = 64 - s->memsize;
+
+		if (len < fill) {
+			memcpy(&s->mem[s->memsize], buf, len);
+			s->memsize += len;
+			return;
+		}
+		memcpy(&s->mem[s->memsize], buf, fill);
+		sha256block(s->h, s->mem);
+		buf += fill;
+		len -= fill;
+		s->memsize = 0;
+	}
+
+	for (; 64 <= len; buf += 64, len -= 64)
+		sha256block(s->h, buf);
+
+	memcpy(s->mem, buf, len);
+	s->memsize = len;
+}
+
+void
+sha256final(Sha256 const *s, uchar *digest)
+{
+	Sha256 t = *s;
+	uchar pad[72];
+	size_t n;
+
+	// 0x80, zeros up to 56 (mod 64), and the length in bits (big endian).
+	n = (t.memsize < 56? 56: 120) - t.memsize;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (int i = 0; i < 8; ++i)
+		pad[n + i] = (s->total * 8) >> (56 - 8 * i) & 0xFF;
+	sha256update(&t, pad, n + 8);
+
+	for (int i = 0; i < 8; ++i)
+		for (int j = 0; j < 4; ++j)
+			digest[4 * i + j] = t.h[i] >> (24 - 8 * j) & 0xFF;
+}
+
+static uint
+ror(uint x, int r)
+{
+	return x >> r | x << (32 - r);
+}
+
+static void
+sha256block(uint *h, uchar const *p)
+{
+	uint w[64];
+	uint a, b, c, d, e, f, g, k;
+
+	for (int i = 0; i < 16; ++i)
+		w[i] = (uint)p[4 * i] << 24 | (uint)p[4 * i + 1] << 16 | (uint)p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (int i = 16; i < 64; ++i) {
+		uint s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ w[i - 15] >> 3;
+		uint s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ w[i - 2] >> 10;
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = h[0], b = h[1], c = h[2], d = h[3];
+	e = h[4], f = h[5], g = h[6], k = h[7];
+	for (int i = 0; i < 64; ++i) {
+		uint t1 = k + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+		uint t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h[0] += a, h[1] += b, h[2] += c, h[3] += d;
+	h[4] += e, h[5] += f, h[6] += g, h[7] += k;
+}
@@ -0,0 +1,33 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// XXH64 (non-cryptographic, but fast enough to keep up with the disks),
+// CRC32C and SHA-256 (for the digests of what is written, see digest.c).
+
+typedef struct {
+	uvlong v[4];
+	uvlong total;
+	uchar mem[32];
+	uint memsize;
+} Xxh64;
+
+void xxh64init(Xxh64 *s, uvlong seed);
+void xxh64update(Xxh64 *s, uchar const *buf, size_t len);
+uvlong xxh64final(Xxh64 const *s);
+uvlong xxh64(uchar const *buf, size_t len, uvlong seed);
+
+// CRC32C (Castagnoli), with SSE4.2 when available.
+// It continues from crc (0 to start).
+uint crc32c(uint crc, uchar const *buf, size_t len);
+
+typedef struct {
+	uint h[8];
+	uvlong total;
+	uchar mem[64];
+	uint memsize;
+} Sha256;
+
+void sha256init(Sha256 *s);
+void sha256update(Sha256 *s, uchar const *buf, size_t len);
+void sha256final(Sha256 const *s, uchar *digest); // 32 bytes.
@@ -0,0 +1,153 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "f7disk.h"
+#include "iolimit.h"
+
+// As in linux/ioprio.h (not always installed).
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// The bucket holds this much time of transfer, at most.
+#define BURST 0.1 // s.
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static double rate; // B/s (0 for no limit).
+static double tokens; // B (negative while in debt).
+static struct timespec last;
+static double waited; // s.
+
+static double since(struct timespec const *t);
+
+int
+setionice(char const *class)
+{
+	static char const *const classes[] = {"rt", "be", "idle"};
+	size_t len;
+	int c, level;
+
+	len = strcspn(class, ":");
+	for (c = 0; c < 3; ++c)
+		if (strlen(classes[c]) == len && strncmp(class, classes[c], len) == 0)
+			break;
+	if (c == 3)
+		return 0;
+
+	// The idle class has no levels.
+	level = 4;
+	if (class[len] == ':') {
+		if (c == 2 || class[len + 1] < '0' || '7' < class[len + 1] || class[len + 2] != '\0')
+			return 0;
+		level = class[len + 1] - '0';
+	}
+	if (c == 2)
+		level = 0;
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (c + 1) << IOPRIO_CLASS_SHIFT | level) < 0) {
+		perror("Could not set the I/O priority");
+		exit(1);
+	}
+	return 1;
+}
+
+int
+setmaxrate(char const *str)
+{
+	char *endptr;
+	double mbs;
+
+	errno = 0;
+	mbs = strtod(str, &endptr);
+	if (errno != 0 || endptr == str || *endptr != '\0' || !(0 < mbs))
+		return 0;
+
+	rate = mbs * 1000 * 1000;
+	tokens = rate * BURST;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	return 1;
+}
+
+void
+ioargs(int argc, char **argv, int i)
+{
+	int ionice = 0, maxrate = 0;
+
+	for (; i < argc; i += 2) {
+		int ok;
+
+		if (argc <= i + 1)
+			ok = 0;
+		else if (strcmp(argv[i], "--ionice") == 0)
+			ok = !ionice++ && setionice(argv[i + 1]);
+		else if (strcmp(argv[i], "--max-rate") == 0)
+			ok = !maxrate++ && setmaxrate(argv[i + 1]);
+		else
+			ok = 0;
+
+		if (!ok) {
+			usage();
+			exit(1);
+		}
+	}
+}
+
+// A token bucket: the debt of every transfer is paid by sleeping
+// (so the chunk sizes of the copy engine do not matter).
+// The debt stays in the bucket, and each thread sleeps (unlocked)
+// until it is paid, so that the threads share the rate.
+void
+throttle(size_t n)
+{
+	double t;
+	struct timespec ts;
+
+	if (rate == 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	t = since(&last);
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	tokens += t * rate;
+	if (rate * BURST < tokens)
+		tokens = rate * BURST;
+	tokens -= n;
+
+	t = tokens < 0? -tokens / rate: 0;
+	waited += t;
+	pthread_mutex_unlock(&lock);
+
+	if (t == 0)
+		return;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+void
+iostats(void)
+{
+	if (rate != 0)
+		printf("Throttled = %.3f s\n", waited);
+}
+
+static double
+since(struct timespec const *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
@@ -0,0 +1,18 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// I/O priority and bandwidth limits, for flashing live systems.
+// The bandwidth is shared by every copy (and thread) of the process.
+
+// "--ionice <rt|be|idle>[:<0-7>]" and "--max-rate <MB/s>".
+// They return 0 if the value cannot be parsed.
+int setionice(char const *class);
+int setmaxrate(char const *rate);
+// For the commands taking no other option, from argv[i] on.
+void ioargs(int argc, char **argv, int i);
+
+// Waits until n bytes more are allowed.
+void throttle(size_t n);
+// Prints the time spent waiting (if there is a limit).
+void iostats(void);
@@ -0,0 +1,327 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "ptable.h"
+#include "hash.h"
+#include "merkle.h"
+#include "f7part.h"
+#include "copy.h"
+#include "iolimit.h"
+#include "journal.h"
+
+#define JOURNAL_HEADER 64
+#define JOURNAL_SAMPLES 8
+#define MOVE_HEADER 56
+#define MOVE_ENTRY 32
+
+static int hashblock(int fd, off_t offset, size_t len, uvlong *h);
+
+int
+journalident(int fd, Journal *j)
+{
+	struct stat statbuf;
+	size_t block = (size_t)1 << MERKLE_SHIFT;
+	size_t n;
+
+	if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode))
+		return 0;
+
+	j->size = statbuf.st_size;
+	j->mtime = (vlong)statbuf.st_mtim.tv_sec * 1000000000 + statbuf.st_mtim.tv_nsec;
+
+	n = j->size < (off_t)block? (size_t)j->size: block;
+	return
+		hashblock(fd, 0, n, &j->head)
+		&& hashblock(fd, j->size - n, n, &j->tail)
+	;
+}
+
+int
+journalsave(Journal const *j, Merkle const *m, char const *path)
+{
+	char tmp[PATH_MAX];
+	uchar *buf;
+	size_t size;
+	int fd, ok;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return 0;
+
+	size = JOURNAL_HEADER + 8 * m->nleaves;
+	if ((buf = (uchar *)calloc(1, size)) == nil) {
+		fprintf(stderr, "Could not allocate the journal.\n");
+		return 0;
+	}
+
+	memcpy(buf, "F7JOURNL", 8);
+	buf[8] = 0x00; // Version
+	buf[9] = m->shift;
+	putle(&buf[16], j->size, 8);
+	putle(&buf[24], j->mtime, 8);
+	putle(&buf[32], j->head, 8);
+	putle(&buf[40], j->tail, 8);
+	putle(&buf[48], j->offset, 8);
+	putle(&buf[56], m->nleaves, 8);
+	for (vlong i = 0; i < m->nleaves; ++i)
+		putle(&buf[JOURNAL_HEADER + 8 * i], m->nodes[i], 8);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ok =
+		fd != -1
+		&& pwritefull(fd, buf, size, 0) == (ssize_t)size
+		&& fdatasync(fd) == 0;
+	if (fd != -1)
+		close(fd);
+	ok = ok && rename(tmp, path) == 0;
+
+	if (!ok) {
+		fprintf(stderr, "WARNING: Could not save the journal (%s): %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(buf);
+	return ok;
+}
+
+int
+journalload(Journal *j, Merkle *m, char const *path, off_t offset)
+{
+	uchar header[JOURNAL_HEADER];
+	uchar *buf;
+	vlong n;
+	int fd, ok;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+
+	if (
+		preadfull(fd, header, JOURNAL_HEADER, 0) != JOURNAL_HEADER
+		|| memcmp(header, "F7JOURNL", 8) != 0
+		|| header[8] != 0x00
+		|| header[9] != m->shift
+		|| (off_t)getle(&header[48], 8) != offset
+	) {
+		close(fd);
+		return 0;
+	}
+
+	j->size = getle(&header[16], 8);
+	j->mtime = getle(&header[24], 8);
+	j->head = getle(&header[32], 8);
+	j->tail = getle(&header[40], 8);
+	j->offset = offset;
+	n = getle(&header[56], 8);
+	j->done = n << m->shift;
+
+	if (n < 0 || j->size < j->done || (buf = (uchar *)malloc(8 * n + 1)) == nil) {
+		close(fd);
+		return 0;
+	}
+
+	ok = preadfull(fd, buf, 8 * n, JOURNAL_HEADER) == 8 * n;
+	close(fd);
+
+	// In place, as merkleload.
+	for (vlong i = 0; ok && i < n; ++i)
+		((uvlong *)buf)[i] = getle(&buf[8 * i], 8);
+	ok = ok && merkleresume(m, (uvlong *)buf, n);
+
+	free(buf);
+	return ok;
+}
+
+vlong
+journalcheck(int fd, off_t offset, Merkle const *m)
+{
+	size_t block = (size_t)1 << m->shift;
+	vlong samples = m->nleaves < JOURNAL_SAMPLES? m->nleaves: JOURNAL_SAMPLES;
+
+	for (vlong s = 0; s < samples; ++s) {
+		// The first and the last are always among them.
+		vlong i = samples == 1? 0: s * (m->nleaves - 1) / (samples - 1);
+		uvlong h;
+
+		if (!hashblock(fd, offset + (i << m->shift), block, &h) || h != m->nodes[i])
+			return i;
+		throttle(block);
+	}
+	return -1;
+}
+
+void
+journaldrop(char const *path)
+{
+	if (unlink(path) < 0 && errno != ENOENT)
+		fprintf(stderr, "WARNING: Could not remove the journal (%s): %s\n", path, strerror(errno));
+}
+
+// That of the slot 0, without "0.f7idx".
+int
+movepath(int fd, char const *file, PartEntry const *p, int entry, char *path, size_t len)
+{
+	char idx[PATH_MAX];
+	size_t n;
+	int r;
+
+	if (!merklepath(fd, file, p, entry, 0, idx, sizeof(idx)) || (n = strlen(idx)) < 7)
+		return 0;
+	r = snprintf(path, len, "%.*sf7mov", (int)n - 7, idx);
+	return 0 < r && (size_t)r < len;
+}
+
+// The layouts are kept as their headers (whole sectors),
+// and the backup of the step being written, after the moves.
+int
+movesave(MovePlan const *plan, char const *path)
+{
+	char tmp[PATH_MAX];
+	uchar *buf, *e;
+	size_t size;
+	int fd, ok;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return 0;
+
+	size = MOVE_HEADER + 2 * F7_HEADER_MAX + MOVE_ENTRY * plan->n + plan->backlen;
+	if ((buf = (uchar *)calloc(1, size)) == nil) {
+		fprintf(stderr, "Could not allocate the journal.\n");
+		return 0;
+	}
+
+	memcpy(buf, "F7MOVJNL", 8);
+	buf[8] = 0x00; // Version
+	putle(&buf[16], plan->n, 8);
+	putle(&buf[24], plan->next, 8);
+	putle(&buf[32], plan->done, 8);
+	putle(&buf[48], plan->backlen, 8);
+	f7_buildheader(&plan->old, &buf[MOVE_HEADER]);
+	f7_buildheader(&plan->new, &buf[MOVE_HEADER + F7_HEADER_MAX]);
+	for (int i = 0; i < plan->n; ++i) {
+		e = &buf[MOVE_HEADER + 2 * F7_HEADER_MAX + MOVE_ENTRY * i];
+		putle(&e[0], plan->moves[i].from, 4);
+		putle(&e[4], plan->moves[i].to, 4);
+		putle(&e[8], plan->moves[i].src, 8);
+		putle(&e[16], plan->moves[i].dst, 8);
+		putle(&e[24], plan->moves[i].length, 8);
+	}
+	if (0 < plan->backlen)
+		memcpy(&buf[MOVE_HEADER + 2 * F7_HEADER_MAX + MOVE_ENTRY * plan->n], plan->backup, plan->backlen);
+	putle(&buf[40], xxh64(buf, size, 0), 8);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ok =
+		fd != -1
+		&& pwritefull(fd, buf, size, 0) == (ssize_t)size
+		&& fdatasync(fd) == 0;
+	if (fd != -1)
+		close(fd);
+	ok = ok && rename(tmp, path) == 0;
+
+	if (!ok) {
+		fprintf(stderr, "WARNING: Could not save the journal (%s): %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(buf);
+	return ok;
+}
+
+int
+moveload(MovePlan *plan, char const *path)
+{
+	uchar *buf, *e;
+	uvlong h;
+	off_t size;
+	int fd, ok;
+
+	plan->backup = nil;
+	plan->backlen = 0;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (
+		size < MOVE_HEADER + 2 * F7_HEADER_MAX
+		|| (buf = (uchar *)malloc(size)) == nil
+	) {
+		close(fd);
+		return 0;
+	}
+	ok = preadfull(fd, buf, size, 0) == size;
+	close(fd);
+
+	h = ok? getle(&buf[40], 8): 0;
+	if (ok)
+		memset(&buf[40], 0, 8);
+	ok =
+		ok
+		&& memcmp(buf, "F7MOVJNL", 8) == 0
+		&& buf[8] == 0x00
+		&& xxh64(buf, size, 0) == h
+	;
+	if (ok) {
+		plan->n = getle(&buf[16], 8);
+		plan->next = getle(&buf[24], 8);
+		plan->done = getle(&buf[32], 8);
+		plan->backlen = getle(&buf[48], 8);
+		ok =
+			plan->n <= F7_SLOTS_MAX
+			&& 0 <= plan->backlen
+			&& size == MOVE_HEADER + 2 * F7_HEADER_MAX + MOVE_ENTRY * (off_t)plan->n + plan->backlen
+			&& plan->next <= plan->n
+			&& 0 <= plan->done
+			&& f7_retrieve_meta(&buf[MOVE_HEADER], &plan->old)
+			&& f7_retrieve_meta(&buf[MOVE_HEADER + F7_HEADER_MAX], &plan->new)
+		;
+	}
+	for (int i = 0; ok && i < plan->n; ++i) {
+		e = &buf[MOVE_HEADER + 2 * F7_HEADER_MAX + MOVE_ENTRY * i];
+		plan->moves[i].from = getle(&e[0], 4);
+		plan->moves[i].to = getle(&e[4], 4);
+		plan->moves[i].src = getle(&e[8], 8);
+		plan->moves[i].dst = getle(&e[16], 8);
+		plan->moves[i].length = getle(&e[24], 8);
+		ok =
+			0 <= plan->moves[i].from && plan->moves[i].from < plan->old.count
+			&& 0 <= plan->moves[i].to && plan->moves[i].to < plan->new.count
+		;
+	}
+	if (ok && 0 < plan->backlen) {
+		if ((plan->backup = (uchar *)malloc(plan->backlen)) == nil)
+			ok = 0;
+		else
+			memcpy(plan->backup, &buf[MOVE_HEADER + 2 * F7_HEADER_MAX + MOVE_ENTRY * plan->n], plan->backlen);
+	}
+
+	free(buf);
+	return ok;
+}
+
+static int
+hashblock(int fd, off_t offset, size_t len, uvlong *h)
+{
+	uchar *buf;
+	int ok;
+
+	if ((buf = (uchar *)malloc(len + 1)) == nil)
+		return 0;
+
+	ok = preadfull(fd, buf, len, offset) == (ssize_t)len;
+	if (ok)
+		*h = xxh64(buf, len, 0);
+
+	free(buf);
+	return ok;
+}
@@ -0,0 +1,34 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// The journal of a resumable load: the identity of the payload, how much
+// of it is durably written, and the hash index so far (so that the part
+// already written does not have to be read again).
+
+typedef struct {
+	// The payload.
+	off_t size;
+	vlong mtime; // ns.
+	uvlong head; // XXH64 of the first block...
+	uvlong tail; // ...and of the last one.
+
+	off_t offset; // Of the slot.
+	off_t done; // Whole blocks of the index.
+} Journal;
+
+int journalident(int fd, Journal *j);
+int journalsave(Journal const *j, Merkle const *m, char const *path);
+// 'm' continues where the journal ends.
+int journalload(Journal *j, Merkle *m, char const *path, off_t offset);
+// Reads back some of the blocks written (a few, evenly spaced).
+// It returns the first that differs, or -1.
+vlong journalcheck(int fd, off_t offset, Merkle const *m);
+void journaldrop(char const *path);
+
+// The journal of a relayout (or repack), next to the hash indexes of the
+// partition, as "<...>.f7mov": both layouts, the moves, and how far they
+// are done (see relayout.c). It needs f7part.h.
+int movepath(int fd, char const *file, PartEntry const *p, int entry, char *path, size_t len);
+int movesave(MovePlan const *plan, char const *path);
+int moveload(MovePlan *plan, char const *path);
@@ -0,0 +1,193 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <string.h>
+
+#include "u.h"
+#include "lz4.h"
+
+// A block is a list of sequences: a token (literal length, match length),
+// the literals, the match offset (LE16) and the rest of the match length.
+// The last sequence has only literals.
+#define MINMATCH 4
+#define LASTLITERALS 5 // The last bytes are always literals...
+#define MFLIMIT 12 // ...and the last match starts before these.
+#define MAXOFFSET 65535
+
+static uint read32(uchar const *p);
+static uint hash(uint v);
+static uchar *putlen(uchar *op, uchar const *oend, int len);
+
+int
+lz4compress(uchar const *src, int len, uchar *dst, int cap, int *table)
+{
+	uchar *op = dst;
+	uchar *oend = dst + cap;
+	int ip, anchor;
+	int misses;
+
+	// 0 is empty: the positions are kept off by one.
+	memset(table, 0, LZ4_TABLE * sizeof(int));
+
+	ip = 0;
+	anchor = 0;
+	misses = 0;
+	while (ip < len - MFLIMIT) {
+		uint h = hash(read32(&src[ip]));
+		int ref = table[h] - 1;
+		int ml;
+		uchar *token;
+
+		table[h] = ip + 1;
+		if (ref < 0 || MAXOFFSET < ip - ref || read32(&src[ref]) != read32(&src[ip])) {
+			// Incompressible data is skipped faster and faster.
+			ip += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+
+		// Backwards, over the pending literals.
+		while (anchor < ip && 0 < ref && src[ip - 1] == src[ref - 1]) {
+			--ip;
+			--ref;
+		}
+
+		ml = MINMATCH;
+		while (ip + ml < len - LASTLITERALS && src[ref + ml] == src[ip + ml])
+			++ml;
+
+		token = op++;
+		if (oend <= token)
+			return 0;
+		*token = (ip - anchor < 15? ip - anchor: 15) << 4;
+		if (15 <= ip - anchor && (op = putlen(op, oend, ip - anchor - 15)) == nil)
+			return 0;
+		if (oend - op < ip - anchor + 2)
+			return 0;
+		memcpy(op, &src[anchor], ip - anchor);
+		op += ip - anchor;
+
+		op[0] = (ip - ref) & 0xFF;
+		op[1] = (ip - ref) >> 8;
+		op += 2;
+
+		*token |= ml - MINMATCH < 15? ml - MINMATCH: 15;
+		if (15 <= ml - MINMATCH && (op = putlen(op, oend, ml - MINMATCH - 15)) == nil)
+			return 0;
+
+		ip += ml;
+		anchor = ip;
+		// The end of the match is likely to be matched again.
+		if (ip < len - MFLIMIT)
+			table[hash(read32(&src[ip - 2]))] = ip - 2 + 1;
+	}
+
+	// The last literals.
+	if (oend <= op)
+		return 0;
+	*op = (len - anchor < 15? len - anchor: 15) << 4;
+	++op;
+	if (15 <= len - anchor && (op = putlen(op, oend, len - anchor - 15)) == nil)
+		return 0;
+	if (oend - op < len - anchor)
+		return 0;
+	memcpy(op, &src[anchor], len - anchor);
+	op += len - anchor;
+
+	return op - dst;
+}
+
+int
+lz4decompress(uchar const *src, int len, uchar *dst, int cap)
+{
+	uchar const *ip = src;
+	uchar const *iend = src + len;
+	uchar *op = dst;
+	uchar *oend = dst + cap;
+
+	while (ip < iend) {
+		int token = *ip++;
+		int ll = token >> 4;
+		int ml, offset;
+
+		if (ll == 15) {
+			int b;
+
+			do {
+				if (iend <= ip)
+					return -1;
+				b = *ip++;
+				ll += b;
+			} while (b == 255 && ll < cap);
+		}
+		if (iend - ip < ll || oend - op < ll)
+			return -1;
+		memcpy(op, ip, ll);
+		ip += ll;
+		op += ll;
+
+		// Only the last sequence ends after its literals.
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || op - dst < offset)
+			return -1;
+
+		ml = token & 15;
+		if (ml == 15) {
+			int b;
+
+			do {
+				if (iend <= ip)
+					return -1;
+				b = *ip++;
+				ml += b;
+			} while (b == 255 && ml < cap);
+		}
+		ml += MINMATCH;
+		if (oend - op < ml)
+			return -1;
+
+		// The match may overlap what it produces (runs).
+		if (ml <= offset) {
+			memcpy(op, op - offset, ml);
+			op += ml;
+		} else {
+			for (int i = 0; i < ml; ++i, ++op)
+				*op = op[-offset];
+		}
+	}
+
+	return op - dst;
+}
+
+static uint
+read32(uchar const *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+}
+
+static uint
+hash(uint v)
+{
+	return v * 2654435761U >> (32 - LZ4_HASHLOG);
+}
+
+static uchar *
+putlen(uchar *op, uchar const *oend, int len)
+{
+	for (; 255 <= len; len -= 255) {
+		if (oend <= op)
+			return nil;
+		*op++ = 255;
+	}
+	if (oend <= op)
+		return nil;
+	*op++ = len;
+	return op;
+}
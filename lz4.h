@@ -0,0 +1,19 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// LZ4 blocks (the raw block format, without frames), as produced
+// and accepted by LZ4_compress_default and LZ4_decompress_safe.
+
+#define LZ4_HASHLOG 14
+#define LZ4_TABLE (1 << LZ4_HASHLOG) // Entries of the match finder.
+
+// A buffer of this size always fits a compressed block.
+#define lz4bound(len) ((len) + (len) / 255 + 16)
+
+// It returns the compressed length, or 0 if it does not fit in cap.
+// The table is scratch space (so that each thread can have its own).
+int lz4compress(uchar const *src, int len, uchar *dst, int cap, int *table);
+// It returns the decompressed length, or -1 if the block is corrupt
+// (or does not fit in cap).
+int lz4decompress(uchar const *src, int len, uchar *dst, int cap);
@@ -8,11 +8,39 @@
 
 #include "u.h"
 #include "f7disk.h"
+#include "probe.h"
 
 void show_version();
 
 char const *name = "#?";
 
+#ifdef F7_PROBES
+// The semaphores of the probes (see probe.h), where the tracers look for them.
+#define SEMAPHORE(name) unsigned short f7disk_##name##_semaphore __attribute__((section(".probes")))
+SEMAPHORE(op_start);
+SEMAPHORE(op_end);
+SEMAPHORE(ptable_parse);
+SEMAPHORE(header_read);
+SEMAPHORE(slot_start);
+SEMAPHORE(slot_end);
+SEMAPHORE(read_start);
+SEMAPHORE(read_done);
+SEMAPHORE(write_start);
+SEMAPHORE(write_done);
+SEMAPHORE(verify_done);
+SEMAPHORE(bitmap_commit);
+
+static char const *command;
+static struct timespec started;
+
+// Every command ends with exit() or by returning from main().
+static void
+opend(void)
+{
+	PROBE2(op_end, command, probens(&started));
+}
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -30,6 +58,14 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
+#ifdef F7_PROBES
+	command = argv[1];
+	if (PROBED(op_end))
+		clock_gettime(CLOCK_MONOTONIC, &started);
+	atexit(opend);
+	PROBE1(op_start, command);
+#endif
+
 	if (argc == 2) {
 		if (strcmp(argv[1], "version") == 0) {
 			show_version();
@@ -47,12 +83,34 @@ main(int argc, char **argv)
 		tablebrief(argc, argv);
 	} else if (strcmp(argv[1], "brief") == 0) {
 		f7_brief(argc, argv);
+	} else if (strcmp(argv[1], "query") == 0) {
+		f7_query(argc, argv);
+	} else if (strcmp(argv[1], "verify") == 0) {
+		f7_verify(argc, argv);
+	} else if (strcmp(argv[1], "dump") == 0) {
+		f7_dump(argc, argv);
 	} else if (strcmp(argv[1], "reset") == 0) {
 		f7_reset(argc, argv);
 	} else if (strcmp(argv[1], "override") == 0) {
 		f7_override(argc, argv);
+	} else if (strcmp(argv[1], "relayout") == 0) {
+		f7_relayout(argc, argv);
+	} else if (strcmp(argv[1], "repack") == 0) {
+		f7_repack(argc, argv);
 	} else if (strcmp(argv[1], "cpboot") == 0) {
 		f7_cpboot(argc, argv);
+	} else if (strcmp(argv[1], "mkimage") == 0) {
+		f7_mkimage(argc, argv);
+	} else if (strcmp(argv[1], "sync") == 0) {
+		f7_sync(argc, argv);
+	} else if (strcmp(argv[1], "mkbundle") == 0) {
+		f7_mkbundle(argc, argv);
+	} else if (strcmp(argv[1], "load-bundle") == 0) {
+		f7_loadbundle(argc, argv);
+	} else if (strcmp(argv[1], "serve") == 0) {
+		f7_serve(argc, argv);
+	} else if (strcmp(argv[1], "call") == 0) {
+		f7_call(argc, argv);
 	} else {
 		usage();
 		exit(1);
@@ -66,25 +124,59 @@ usage()
 		stderr
 		, "Usage: %s <command>"
 		"\nUnits: KiB, MiB, GiB, TiB"
+		"\nBackends: any <file> can be ram:<file>, mmap:<file> or slow:<µs>[,<MB/s>]:<file> (for benchmarks)."
 		"\nInfo commands: help, version"
 		"\nSlot management:"
-		"\n\tclear <file> <0-3> <0-15> # Free an active slot."
-		"\n\tload <file> <0-3> <0-15> <image> # Write an image to a free slot."
+		"\n\tclear <file> <0-3> <slot> # Free an active slot."
+		"\n\tload <file> <0-3> <slot> <image/-> ... # Write an image to a free slot."
+		"\n\t\t[<image/->[@align=<sectors/units>] ...] # More images, back to back (and aligned)."
+		"\n\t\t[--expected-size <sectors/units>] # Checked early (for pipes)."
+		"\n\t\t[--reflink] # Share the aligned extents with the image (XFS, btrfs...)."
+		"\n\t\t[--sparse] # Zero blocks become holes (or BLKZEROOUT), without writing them."
+		"\n\t\t[--erase-block <sectors/units>] # Writes split and coalesced on these boundaries (optimal I/O size)."
+		"\n\t\t[--resume [--trust-journal]] # Continue an interrupted load (the same payload file)."
+		"\n\t\t[--store-compressed] # LZ4 blocks (read back by dump and verify)."
+		"\n\t\t[--digest <crc32c,xxh64,sha256> [--record-digests]] # Of the payload, as written (recorded next to its hash index)."
+		"\n\t\t[--verify] # Read back what is written (bypassing the cache)."
+		"\n\t\t[--verify-lag <sectors/units>] # Distance behind the writer (8 MiB)."
+		"\n\t\t[--ionice <rt|be|idle>[:<0-7>]] # I/O scheduling class (and level)."
+		"\n\t\t[--max-rate <MB/s>] # Bandwidth limit (the time throttled is shown)."
+		"\n\tload-bundle <file> <0-3> <bundle/-> [--ionice ...] [--max-rate ...] # Write the slots of a bundle (all of them, or none)."
+		"\n\tsync <golden> <target> [0-3] [--ionice ...] [--max-rate ...] # Copy the slots that differ from the golden image."
 		"\nFor reading:"
 		"\n\ttablebrief <file> # Show a brief of the partition table."
 		"\n\tbrief <file> <0-3> # Show a brief of the F7h partition."
+		"\n\tquery <file> <0-3> [--check] # The slots for a shell (eval), in two reads (o.f7query, for an initramfs)."
+		"\n\tverify <file> <0-3> <slot> [--ionice ...] [--max-rate ...] # Check a slot against its hash index."
+		"\n\tdump <file> <0-3> <slot> <output/-> [--ionice ...] [--max-rate ...] # Write out a slot (decompressed)."
 		"\nFor editing:"
 		"\n\treset <file> <0-3> # Free the slots of a F7h partition (soft-reset)."
 		"\n\toverride <file> <0-3> ... # Format a existing partition."
-		"\n\t\t--slots <1-16> # Number of image slots."
+		"\n\t\t--slots <1-1024> # Number of image slots (more than 16 need version 1)."
+		"\n\t\t[--version <0-1>] # F7h header version (the oldest that fits)."
 		"\n\t\t[--dry-run] # Does not commit any change."
 		"\n\t\t[--first <sector/units>] # (Relative to the partition.)"
 		"\n\t\t{"
 		"\n\t\t--size <sectors/units> # By default, as much as it can."
 		"\n\t\t--every <sectors/units> # It defaults to the slot size."
 		"\n\t\t}"
+		"\n\trelayout <file> <0-3> ... # As override (and --ionice, --max-rate), moving the active slots."
+		"\n\trepack <file> <0-3> [--dry-run] [--ionice ...] [--max-rate ...] # Pack the active slots first, without padding."
+		"\n\trelayout|repack <file> <0-3> --resume [--ionice ...] [--max-rate ...] # Continue an interrupted one (from its journal)."
 		"\nBootloader:"
-		"\n\tcpboot <file> <bootloader> # The signature and the ptable are skipped."
+		"\n\tcpboot <file> <bootloader/-> [--digest <crc32c,xxh64,sha256>] [--ionice ...] [--max-rate ...] # The signature and the ptable are skipped."
+		"\nImages:"
+		"\n\tmkimage <manifest/-> <output/-> [--ionice ...] [--max-rate ...] # Build a whole disk image in one pass."
+		"\n\t\tdisk <sectors/units> # One per line, # for comments."
+		"\n\t\t[sector <512/4096>]"
+		"\n\t\t[boot <bootloader>] # As cpboot."
+		"\n\t\t[part <0-3> <type (hex)> <start> <size> [active]] ..."
+		"\n\t\t[f7 <0-3> --slots <1-1024> ...] ... # As override."
+		"\n\t\t[slot <0-3> <slot> <image>] ..."
+		"\n\tmkbundle <bundle> <slot>=<image/-> ... [--store-compressed] [--ionice ...] [--max-rate ...] # The images of many slots, for load-bundle."
+		"\nDaemon:"
+		"\n\tserve <socket> [--no-numa] # Keep devices open for load, load-bundle, clear, reset, brief and cpboot."
+		"\n\tcall <socket> <command> ... # Run a command (or 'reload') through the daemon."
 		"\n"
 		, name
 	);
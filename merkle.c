@@ -0,0 +1,398 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "ptable.h"
+#include "hash.h"
+#include "merkle.h"
+#include "backend.h"
+#include "copy.h"
+#include "digest.h"
+
+#define INDEX_DIR "/var/lib/f7disk"
+#define INDEX_HEADER 48
+
+static int grow(Merkle *m, vlong n);
+static vlong diffnode(
+	Merkle const *a
+	, Merkle const *b
+	, int level
+	, vlong index
+	, vlong const *base
+	, vlong const *width
+	, uchar *leaves
+);
+
+void
+merkleinit(Merkle *m, off_t offset)
+{
+	memset(m, 0, sizeof(*m));
+	m->shift = MERKLE_SHIFT;
+	m->offset = offset;
+	m->stamp = time(nil);
+	xxh64init(&m->cur, 0);
+}
+
+// The data must be fed in order.
+void
+merklefeed(Merkle *m, uchar const *buf, size_t len)
+{
+	off_t block = (off_t)1 << m->shift;
+
+	while (0 < len && !m->err) {
+		size_t n = block - m->curlen;
+
+		if (len < n)
+			n = len;
+
+		xxh64update(&m->cur, buf, n);
+		m->curlen += n;
+		m->length += n;
+		buf += n;
+		len -= n;
+
+		if (m->curlen == block) {
+			if (!grow(m, m->nleaves + 1))
+				return;
+			m->nodes[m->nleaves++] = xxh64final(&m->cur);
+			xxh64init(&m->cur, 0);
+			m->curlen = 0;
+		}
+	}
+}
+
+// Replaces the first block, once it is known (before merklefinish):
+// what was fed in its place only had to be as long.
+void
+merklefirst(Merkle *m, uchar const *buf, size_t len)
+{
+	if (0 < m->nleaves) {
+		m->nodes[0] = xxh64(buf, len, 0);
+	} else {
+		xxh64init(&m->cur, 0);
+		xxh64update(&m->cur, buf, len);
+	}
+}
+
+// Continues after 'n' whole blocks (as if they had been fed).
+int
+merkleresume(Merkle *m, uvlong const *leaves, vlong n)
+{
+	if (!grow(m, n))
+		return 0;
+
+	memcpy(m->nodes, leaves, n * sizeof(uvlong));
+	m->nleaves = n;
+	m->length = n << m->shift;
+	m->curlen = 0;
+	xxh64init(&m->cur, 0);
+	return 1;
+}
+
+// Hashes the last (partial) block and builds the upper levels.
+// A node is the hash of its children; a lone child is hashed alone.
+int
+merklefinish(Merkle *m)
+{
+	vlong from, width;
+
+	if (!m->err && (0 < m->curlen || m->nleaves == 0)) {
+		if (grow(m, m->nleaves + 1))
+			m->nodes[m->nleaves++] = xxh64final(&m->cur);
+	}
+	m->nnodes = m->nleaves;
+
+	from = 0;
+	width = m->nleaves;
+	while (!m->err && 1 < width) {
+		vlong upper = (width + 1) / 2;
+
+		if (!grow(m, m->nnodes + upper))
+			break;
+
+		for (vlong i = 0; i < upper; ++i) {
+			uchar pair[16];
+			int n = 2 * i + 1 < width? 2: 1;
+
+			putle(&pair[0], m->nodes[from + 2 * i], 8);
+			if (n == 2)
+				putle(&pair[8], m->nodes[from + 2 * i + 1], 8);
+			m->nodes[m->nnodes + i] = xxh64(pair, 8 * n, 0);
+		}
+
+		from = m->nnodes;
+		m->nnodes += upper;
+		width = upper;
+	}
+
+	if (m->err) {
+		fprintf(stderr, "Could not allocate the hash index.\n");
+		return 0;
+	}
+	return 1;
+}
+
+void
+merklefree(Merkle *m)
+{
+	free(m->nodes);
+	m->nodes = nil;
+	m->cap = 0;
+}
+
+uvlong
+merkleroot(Merkle const *m)
+{
+	return m->nodes[m->nnodes - 1];
+}
+
+vlong
+merklediff(Merkle const *a, Merkle const *b, uchar *leaves)
+{
+	// The levels are at most 64, since there are less than 2^63 leaves.
+	vlong base[64], width[64];
+	int levels;
+
+	memset(leaves, 0, a->nleaves);
+
+	base[0] = 0;
+	width[0] = a->nleaves;
+	for (levels = 1; 1 < width[levels - 1]; ++levels) {
+		base[levels] = base[levels - 1] + width[levels - 1];
+		width[levels] = (width[levels - 1] + 1) / 2;
+	}
+
+	return diffnode(a, b, levels - 1, 0, base, width, leaves);
+}
+
+static vlong
+diffnode(
+	Merkle const *a
+	, Merkle const *b
+	, int level
+	, vlong index
+	, vlong const *base
+	, vlong const *width
+	, uchar *leaves
+)
+{
+	vlong n;
+
+	if (a->nodes[base[level] + index] == b->nodes[base[level] + index])
+		return 0;
+
+	if (level == 0) {
+		leaves[index] = 1;
+		return 1;
+	}
+
+	n = diffnode(a, b, level - 1, 2 * index, base, width, leaves);
+	if (2 * index + 1 < width[level - 1])
+		n += diffnode(a, b, level - 1, 2 * index + 1, base, width, leaves);
+	return n;
+}
+
+int
+merklepath(
+	int fd
+	, char const *file
+	, PartEntry const *p
+	, int entry
+	, int slot
+	, char *path
+	, size_t len
+)
+{
+	struct stat statbuf;
+	uchar sig[4];
+	char const *dir;
+	int n;
+
+	// Nothing is left of a RAM disk.
+	if ((file = bpath(file)) == nil || fstat(fd, &statbuf) < 0)
+		return 0;
+
+	if (S_ISREG(statbuf.st_mode)) {
+		n = snprintf(path, len, "%s.%d.%d.f7idx", file, entry, slot);
+	} else {
+		// The disk signature identifies the disk, whatever its name.
+		if (preadfull(fd, sig, 4, 0x1B8) != 4)
+			return 0;
+
+		if ((dir = getenv("F7DISK_INDEX")) == nil || *dir == '\0')
+			dir = INDEX_DIR;
+
+		// Block devices are only indexed if the directory is there.
+		if (stat(dir, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode))
+			return 0;
+
+		n = snprintf(
+			path
+			, len
+			, "%s/%02X%02X%02X%02X-%lld.%d.f7idx"
+			, dir
+			, sig[3], sig[2], sig[1], sig[0]
+			, p[entry].start
+			, slot
+		);
+	}
+
+	return 0 < n && (size_t)n < len;
+}
+
+// It is written aside and then renamed, so it is replaced atomically.
+int
+merklesave(Merkle const *m, char const *path)
+{
+	char tmp[PATH_MAX];
+	uchar header[INDEX_HEADER];
+	uchar *buf;
+	size_t size;
+	int fd, ok;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return 0;
+
+	size = INDEX_HEADER + 8 * m->nnodes;
+	if ((buf = (uchar *)malloc(size)) == nil) {
+		fprintf(stderr, "Could not allocate the hash index.\n");
+		return 0;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "F7MERKLE", 8);
+	header[8] = 0x00; // Version
+	header[9] = m->shift;
+	putle(&header[16], m->length, 8);
+	putle(&header[24], m->stamp, 8);
+	putle(&header[32], m->offset, 8);
+	putle(&header[40], m->nleaves, 8);
+	memcpy(buf, header, INDEX_HEADER);
+	for (vlong i = 0; i < m->nnodes; ++i)
+		putle(&buf[INDEX_HEADER + 8 * i], m->nodes[i], 8);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ok =
+		fd != -1
+		&& pwritefull(fd, buf, size, 0) == (ssize_t)size
+		&& fdatasync(fd) == 0;
+	if (fd != -1)
+		close(fd);
+	ok = ok && rename(tmp, path) == 0;
+
+	if (!ok) {
+		fprintf(stderr, "WARNING: Could not save the hash index (%s): %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(buf);
+	return ok;
+}
+
+int
+merkleload(Merkle *m, char const *path, off_t offset)
+{
+	uchar header[INDEX_HEADER];
+	uchar *buf;
+	int fd;
+	vlong width, expected;
+	size_t size;
+
+	merkleinit(m, offset);
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 0;
+
+	if (
+		preadfull(fd, header, INDEX_HEADER, 0) != INDEX_HEADER
+		|| memcmp(header, "F7MERKLE", 8) != 0
+		|| header[8] != 0x00
+		|| (off_t)getle(&header[32], 8) != offset
+	) {
+		close(fd);
+		return 0;
+	}
+
+	m->shift = header[9];
+	m->length = getle(&header[16], 8);
+	m->stamp = getle(&header[24], 8);
+	m->nleaves = getle(&header[40], 8);
+
+	// The shape follows from the number of leaves.
+	m->nnodes = m->nleaves;
+	for (width = m->nleaves; 1 < width; width = (width + 1) / 2)
+		m->nnodes += (width + 1) / 2;
+
+	expected = 1;
+	if (9 <= m->shift && m->shift <= 40 && 0 < m->length)
+		expected = (m->length + ((off_t)1 << m->shift) - 1) >> m->shift;
+
+	if (
+		m->shift < 9 || 40 < m->shift
+		|| m->nleaves != expected
+		|| !grow(m, m->nnodes)
+	) {
+		merklefree(m);
+		close(fd);
+		return 0;
+	}
+
+	size = 8 * m->nnodes;
+	buf = (uchar *)m->nodes;
+	if (preadfull(fd, buf, size, INDEX_HEADER) != (ssize_t)size) {
+		merklefree(m);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	// In place: every node is read before it is overwritten.
+	for (vlong i = 0; i < m->nnodes; ++i)
+		m->nodes[i] = getle(&buf[8 * i], 8);
+	return 1;
+}
+
+// The digests recorded with it go too.
+void
+merkledrop(char const *path)
+{
+	if (unlink(path) < 0 && errno != ENOENT)
+		fprintf(stderr, "WARNING: Could not remove the hash index (%s): %s\n", path, strerror(errno));
+	digestdrop(path);
+}
+
+static int
+grow(Merkle *m, vlong n)
+{
+	uvlong *nodes;
+	vlong cap;
+
+	if (n <= m->cap)
+		return 1;
+
+	cap = m->cap < 64? 64: m->cap;
+	while (cap < n)
+		cap *= 2;
+
+	if ((nodes = (uvlong *)realloc(m->nodes, cap * sizeof(uvlong))) == nil) {
+		m->err = 1;
+		return 0;
+	}
+
+	m->nodes = nodes;
+	m->cap = cap;
+	return 1;
+}
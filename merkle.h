@@ -0,0 +1,53 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// Per-slot Merkle trees of block hashes (XXH64), kept in sidecar files:
+// "<image>.<entry>.<slot>.f7idx" next to image files, and
+// "$F7DISK_INDEX/<disk signature>-<partition start>.<slot>.f7idx"
+// (or /var/lib/f7disk) for block devices.
+
+#define MERKLE_SHIFT 20 // 1 MiB blocks.
+
+typedef struct {
+	int shift;
+	off_t length; // Of the payload.
+	vlong stamp; // When it was loaded.
+	off_t offset; // Of the slot (the index is stale if it changes).
+	vlong nleaves;
+	vlong nnodes;
+	// Level by level, starting with the leaves and ending with the root.
+	uvlong *nodes;
+	vlong cap;
+
+	// Feeding state.
+	Xxh64 cur;
+	off_t curlen;
+	int err;
+} Merkle;
+
+void merkleinit(Merkle *m, off_t offset);
+void merklefeed(Merkle *m, uchar const *buf, size_t len);
+void merklefirst(Merkle *m, uchar const *buf, size_t len);
+int merkleresume(Merkle *m, uvlong const *leaves, vlong n);
+int merklefinish(Merkle *m);
+void merklefree(Merkle *m);
+uvlong merkleroot(Merkle const *m);
+// Marks the leaves that differ (the trees must have the same shape),
+// descending only into the subtrees that differ.
+// It returns how many leaves differ.
+vlong merklediff(Merkle const *a, Merkle const *b, uchar *leaves);
+
+int merklepath(
+	int fd
+	, char const *file
+	, PartEntry const *p
+	, int entry
+	, int slot
+	, char *path
+	, size_t len
+);
+int merklesave(Merkle const *m, char const *path);
+// It returns 0 if there is no (valid) index, without complaining.
+int merkleload(Merkle *m, char const *path, off_t offset);
+void merkledrop(char const *path);
@@ -0,0 +1,721 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "f7disk.h"
+#include "ptable.h"
+#include "f7part.h"
+#include "copy.h"
+#include "hash.h"
+#include "merkle.h"
+#include "iolimit.h"
+
+// A manifest is a list of lines (# for comments), with the sizes
+// and addresses in 512-byte sectors or units, as in the other commands:
+//
+//	disk <sectors/units>	# Size of the whole image (required).
+//	sector <512/4096>	# Logical sector size (512 by default).
+//	boot <bootloader>	# As cpboot (the signature and the ptable are skipped).
+//	part <0-3> <type (hex)> <start> <size> [active]
+//	f7 <0-3> --slots <1-1024> ...	# As override (the type becomes F7h).
+//	slot <0-3> <slot> <image>
+//
+// Everything is written in a single pass, in ascending offsets.
+// What is not written is left as a hole (zeros in a pipe).
+
+#define MANIFEST_ARGS 32
+#define IMAGE_CHUNK (4 * 1024 * 1024)
+
+typedef struct {
+	char *file;
+	int line;
+	int entry;
+	int slot;
+} ImageSlot;
+
+typedef struct {
+	vlong disk; // In 512-byte sectors (as given).
+	int sector;
+	char *boot;
+	PartEntry p[4]; // In 512-byte sectors (as given).
+	int f7[4];
+	F7Format format[4];
+	ImageSlot *slots;
+	int nslots;
+} Manifest;
+
+// Something to be written: either a buffer or a range of a file.
+typedef struct {
+	off_t offset;
+	off_t length;
+	uchar const *buf;
+	int fd;
+	off_t srcoff;
+	char const *what;
+	int entry;
+	int slot; // Or -1.
+	// If set, it is fed the data (and saved at the end).
+	Merkle *idx;
+	char *path;
+} Region;
+
+static int parsemanifest(char const *file, Manifest *m);
+static int planimage(char const *file, Manifest *m, PartEntry *p, MetaF7 *meta, off_t *disk);
+static int parseline(char const *file, int line, int argc, char **argv, Manifest *m);
+static int cmpregion(void const *a, void const *b);
+static int skip(int out, int seekable, off_t n, uchar const *zeros);
+static int emit(int out, Region const *r, uchar *buf);
+static void freemanifest(Manifest *m);
+
+void
+f7_mkimage(int argc, char **argv)
+{
+	Manifest m;
+	PartEntry p[4];
+	MetaF7 meta[4];
+	uchar mbr[512];
+	uchar headers[4][F7_HEADER_MAX];
+	Region *regions;
+	int nregions;
+	off_t disk;
+	off_t bootsize;
+	int bootfd;
+	int out, tostdout, seekable, readable;
+	struct stat statbuf;
+	uchar *buf, *zeros;
+	off_t pos, written, holes;
+	int ok;
+
+	if (argc < 4) {
+		usage();
+		exit(1);
+	}
+	ioargs(argc, argv, 4);
+
+	if (!parsemanifest(argv[2], &m))
+		exit(1);
+
+	if (!planimage(argv[2], &m, p, meta, &disk)) {
+		freemanifest(&m);
+		exit(1);
+	}
+
+	// The MBR: the bootloader code (if any) and the partition table.
+	memset(mbr, 0, sizeof(mbr));
+	bootfd = -1;
+	bootsize = 512;
+	if (m.boot != nil) {
+		ssize_t n;
+		vlong reqsectors;
+
+		if ((bootfd = open(m.boot, O_RDONLY)) == -1) {
+			perror("Cannot open the bootloader");
+			freemanifest(&m);
+			exit(1);
+		}
+
+		do {
+			if ((bootsize = lseek(bootfd, 0, SEEK_END)) == (off_t)-1)
+				perror("Could not retrieve the bootloader file size");
+			else if (bootsize < 512)
+				fprintf(stderr, "The bootloader has less than 512 bytes (cannot contain a MBR).\n");
+			else if ((n = preadfull(bootfd, mbr, 512, 0)) < 0)
+				perror("Could not read the bootloader");
+			else if (n < 512)
+				fprintf(stderr, "Could not read the MBR of the bootloader.\n");
+			else if (mbr[510] != 0x55 || mbr[511] != 0xAA)
+				fprintf(stderr, "MBR magic number not found in the bootloader.\n");
+			else
+				break;
+
+			close(bootfd);
+			freemanifest(&m);
+			exit(1);
+		} while (0);
+
+		// As cpboot: it must end before the first partition.
+		reqsectors = bootsize / m.sector + (bootsize % m.sector != 0? 1: 0);
+		for (int i = 0; i < 4; ++i)
+			if (p[i].type != 0x00 && p[i].type != 0xEE && p[i].start < reqsectors) {
+				fprintf(stderr, "Not enough free sectors (%lld < %lld).\n", p[i].start, reqsectors);
+				close(bootfd);
+				freemanifest(&m);
+				exit(1);
+			}
+		if (disk < bootsize) {
+			fprintf(stderr, "The bootloader is larger than the disk.\n");
+			close(bootfd);
+			freemanifest(&m);
+			exit(1);
+		}
+
+		memset(&mbr[0x1B8], 0, 0x1FE - 0x1B8);
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		uchar *e = &mbr[0x1BE + i * 0x10];
+
+		if (p[i].type == 0x00)
+			continue;
+
+		e[0] = p[i].boot;
+		// CHS addresses are not used (as beyond 8 GiB).
+		e[1] = 0xFE;
+		e[2] = 0xFF;
+		e[3] = 0xFF;
+		e[4] = p[i].type;
+		e[5] = 0xFE;
+		e[6] = 0xFF;
+		e[7] = 0xFF;
+		for (int j = 0; j < 4; ++j) {
+			e[8 + j] = (uchar)(p[i].start >> j * 8 & 0xFF);
+			e[12 + j] = (uchar)(p[i].size >> j * 8 & 0xFF);
+		}
+	}
+	mbr[510] = 0x55;
+	mbr[511] = 0xAA;
+
+	if ((regions = (Region *)calloc(2 + 4 + m.nslots, sizeof(Region))) == nil) {
+		fprintf(stderr, "Could not allocate the region list.\n");
+		if (0 <= bootfd)
+			close(bootfd);
+		freemanifest(&m);
+		exit(1);
+	}
+
+	nregions = 0;
+	regions[nregions++] = (Region){.offset = 0, .length = 512, .buf = mbr, .fd = -1, .slot = -1, .what = "MBR"};
+	if (512 < bootsize)
+		regions[nregions++] = (Region){
+			.offset = 512
+			, .length = bootsize - 512
+			, .fd = bootfd
+			, .srcoff = 512
+			, .slot = -1
+			, .what = "bootloader"
+		};
+
+	for (int i = 0; i < 4; ++i) {
+		if (!m.f7[i])
+			continue;
+
+		regions[nregions++] = (Region){
+			.offset = p[i].start * m.sector
+			, .length = f7_buildheader(&meta[i], headers[i])
+			, .buf = headers[i]
+			, .fd = -1
+			, .slot = -1
+			, .what = "F7h header"
+		};
+	}
+
+	ok = 1;
+	for (int i = 0; i < m.nslots; ++i) {
+		ImageSlot const *s = &m.slots[i];
+		Region *r = &regions[nregions];
+
+		r->offset = f7_slotoffset(p, s->entry, &meta[s->entry], s->slot);
+		r->entry = s->entry;
+		r->slot = s->slot;
+		r->what = "image";
+		if ((r->fd = open(s->file, O_RDONLY)) == -1) {
+			fprintf(stderr, "Cannot open the image %s: %s\n", s->file, strerror(errno));
+			ok = 0;
+			break;
+		}
+		++nregions;
+
+		if ((r->length = lseek(r->fd, 0, SEEK_END)) == (off_t)-1) {
+			perror("Could not retrieve the image file size");
+			ok = 0;
+			break;
+		} else if (meta[s->entry].size * m.sector < r->length) {
+			fprintf(stderr, "The image %s is larger than the slot.\n", s->file);
+			ok = 0;
+			break;
+		}
+	}
+
+	// In ascending offsets (they cannot overlap, but it is cheap to check).
+	qsort(regions, nregions, sizeof(Region), cmpregion);
+	for (int i = 1; ok && i < nregions; ++i)
+		if (regions[i].offset < regions[i - 1].offset + regions[i - 1].length) {
+			fprintf(stderr, "BUG: The %s overlaps the %s!\n", regions[i].what, regions[i - 1].what);
+			ok = 0;
+		}
+
+	out = -1;
+	tostdout = strcmp(argv[3], "-") == 0;
+	if (ok) {
+		if (tostdout)
+			out = dup(STDOUT_FILENO);
+		else
+			out = open(argv[3], O_WRONLY | O_CREAT, 0666);
+		if (out == -1) {
+			perror("Cannot open the output image file");
+			ok = 0;
+		}
+	}
+
+	// Only files (and devices) can skip the untouched regions.
+	seekable = 0;
+	do {
+		if (!ok)
+			break;
+		else if (fstat(out, &statbuf) < 0)
+			perror("Could not retrieve the output file status");
+		else if (S_ISREG(statbuf.st_mode) && (ftruncate(out, 0) < 0 || lseek(out, 0, SEEK_SET) == (off_t)-1))
+			perror("Could not truncate the output image file");
+		else if (S_ISBLK(statbuf.st_mode) && lseek(out, 0, SEEK_END) < disk)
+			fprintf(stderr, "The output device is smaller than the disk.\n");
+		else if (S_ISBLK(statbuf.st_mode) && lbasize(out) != m.sector)
+			fprintf(stderr, "The output device has %d-byte sectors (not %d).\n", lbasize(out), m.sector);
+		else if (S_ISBLK(statbuf.st_mode) && lseek(out, 0, SEEK_SET) == (off_t)-1)
+			perror("Could not seek the output device");
+		else
+			break;
+
+		ok = 0;
+	} while (0);
+	if (ok)
+		seekable = S_ISREG(statbuf.st_mode) || S_ISBLK(statbuf.st_mode);
+
+	// An image file of 4 KiB sectors is only read back as such through
+	// a F7h header (see lbasize): without one, it is not indexed.
+	readable = !tostdout;
+	if (m.sector != 512 && ok && S_ISREG(statbuf.st_mode)) {
+		readable = 0;
+		for (int i = 0; i < 4; ++i)
+			readable = readable || m.f7[i];
+		if (!readable)
+			fprintf(stderr, "WARNING: Without a F7h partition, f7disk reads the image with 512-byte sectors.\n");
+	}
+
+	// The payloads are indexed as load does (image files only).
+	for (int i = 0; ok && readable && i < nregions; ++i) {
+		char path[PATH_MAX];
+		Region *r = &regions[i];
+
+		if (r->slot < 0 || !merklepath(out, argv[3], p, r->entry, r->slot, path, sizeof(path)))
+			continue;
+
+		if ((r->idx = (Merkle *)malloc(sizeof(Merkle))) == nil || (r->path = strdup(path)) == nil) {
+			free(r->idx);
+			r->idx = nil;
+			continue;
+		}
+		merkleinit(r->idx, r->offset);
+	}
+
+	// The indexes of the slots left empty are stale.
+	for (int i = 0; ok && readable && i < 4; ++i) {
+		char path[PATH_MAX];
+
+		if (!m.f7[i])
+			continue;
+
+		for (int slot = 0; slot < meta[i].count; ++slot)
+			if (!f7_active(&meta[i], slot) && merklepath(out, argv[3], p, i, slot, path, sizeof(path)))
+				merkledrop(path);
+	}
+
+	buf = nil;
+	zeros = nil;
+	if (ok && ((buf = (uchar *)malloc(IMAGE_CHUNK)) == nil || (zeros = (uchar *)calloc(1, IMAGE_CHUNK)) == nil)) {
+		fprintf(stderr, "Could not allocate the copy buffer.\n");
+		ok = 0;
+	}
+
+	pos = 0;
+	written = 0;
+	holes = 0;
+	for (int i = 0; ok && i < nregions; ++i) {
+		Region const *r = &regions[i];
+
+		if (
+			!skip(out, seekable, r->offset - pos, zeros)
+			|| !emit(out, r, buf)
+		) {
+			ok = 0;
+			break;
+		}
+
+		holes += r->offset - pos;
+		written += r->length;
+		pos = r->offset + r->length;
+	}
+
+	// Up to the disk size.
+	if (ok) {
+		holes += disk - pos;
+		if (S_ISREG(statbuf.st_mode) && ftruncate(out, disk) < 0) {
+			perror("Could not extend the output image file");
+			ok = 0;
+		} else if (!seekable && !skip(out, 0, disk - pos, zeros)) {
+			ok = 0;
+		}
+	}
+
+	for (int i = 0; i < nregions; ++i) {
+		Region *r = &regions[i];
+
+		if (r->idx != nil) {
+			// The index is not essential (it only warns).
+			if (ok && merklefinish(r->idx))
+				merklesave(r->idx, r->path);
+			merklefree(r->idx);
+			free(r->idx);
+			free(r->path);
+		}
+		if (0 <= r->fd && r->fd != bootfd)
+			close(r->fd);
+	}
+	free(regions);
+	free(buf);
+	free(zeros);
+	if (0 <= bootfd)
+		close(bootfd);
+	if (0 <= out && close(out) < 0 && ok) {
+		perror("Could not write the output image file");
+		ok = 0;
+	}
+	freemanifest(&m);
+
+	if (!ok)
+		exit(1);
+
+	// The image itself goes to the standard output.
+	if (!tostdout) {
+		printf("Written = %jd bytes\n", (intmax_t)written);
+		printf("Holes = %jd bytes\n", (intmax_t)holes);
+		iostats();
+	}
+}
+
+static int
+parsemanifest(char const *file, Manifest *m)
+{
+	FILE *f;
+	char *line;
+	size_t cap;
+	int nline;
+	int ok;
+
+	memset(m, 0, sizeof(*m));
+	m->sector = 512;
+	if ((m->slots = (ImageSlot *)calloc(4 * F7_SLOTS_MAX, sizeof(ImageSlot))) == nil) {
+		fprintf(stderr, "Could not allocate the slot list.\n");
+		return 0;
+	}
+
+	if (strcmp(file, "-") == 0)
+		f = stdin;
+	else
+		f = fopen(file, "r");
+	if (f == nil) {
+		perror("Cannot open the manifest");
+		freemanifest(m);
+		return 0;
+	}
+
+	line = nil;
+	cap = 0;
+	ok = 1;
+	for (nline = 1; ok && getline(&line, &cap, f) != -1; ++nline) {
+		char *args[MANIFEST_ARGS];
+		char *save;
+		int n;
+
+		line[strcspn(line, "#")] = '\0';
+
+		n = 0;
+		for (char *t = strtok_r(line, " \t\r\n", &save); t != nil; t = strtok_r(nil, " \t\r\n", &save)) {
+			if (n == MANIFEST_ARGS) {
+				fprintf(stderr, "%s:%d: Too many arguments.\n", file, nline);
+				ok = 0;
+				break;
+			}
+			args[n++] = t;
+		}
+
+		if (ok && 0 < n)
+			ok = parseline(file, nline, n, args, m);
+	}
+
+	if (ok && ferror(f)) {
+		perror("Could not read the manifest");
+		ok = 0;
+	}
+	if (ok && m->disk == 0) {
+		fprintf(stderr, "%s: The disk size is missing.\n", file);
+		ok = 0;
+	}
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	if (!ok)
+		freemanifest(m);
+	return ok;
+}
+
+static int
+parseline(char const *file, int line, int argc, char **argv, Manifest *m)
+{
+	int entry = -1;
+
+	if (
+		2 <= argc
+		&& (strcmp(argv[0], "part") == 0 || strcmp(argv[0], "f7") == 0 || strcmp(argv[0], "slot") == 0)
+	) {
+		entry = atol2(argv[1]);
+		if (entry < 0 || 3 < entry) {
+			fprintf(stderr, "%s:%d: The partition entry must be 0-3.\n", file, line);
+			return 0;
+		}
+	}
+
+	if (strcmp(argv[0], "disk") == 0 && argc == 2 && m->disk == 0) {
+		m->disk = atolba(argv[1]);
+	} else if (strcmp(argv[0], "sector") == 0 && argc == 2) {
+		m->sector = atol2(argv[1]);
+		if (m->sector != 512 && m->sector != SECTOR_MAX) {
+			fprintf(stderr, "%s:%d: The sector size must be 512 or %d bytes.\n", file, line, SECTOR_MAX);
+			return 0;
+		}
+	} else if (strcmp(argv[0], "boot") == 0 && argc == 2 && m->boot == nil) {
+		if ((m->boot = strdup(argv[1])) == nil) {
+			fprintf(stderr, "Could not allocate the manifest.\n");
+			return 0;
+		}
+	} else if (strcmp(argv[0], "part") == 0 && (argc == 5 || argc == 6) && m->p[entry].type == 0x00) {
+		char *endptr;
+		long type;
+
+		errno = 0;
+		type = strtol(argv[2], &endptr, 16);
+		if (errno != 0 || *endptr != '\0' || type < 0x01 || 0xFF < type) {
+			fprintf(stderr, "%s:%d: The partition type must be 01-FF (hex).\n", file, line);
+			return 0;
+		}
+		if (argc == 6 && strcmp(argv[5], "active") != 0) {
+			fprintf(stderr, "%s:%d: Unknown flag (%s).\n", file, line, argv[5]);
+			return 0;
+		}
+
+		m->p[entry].boot = argc == 6? 0x80: 0x00;
+		m->p[entry].type = type;
+		m->p[entry].start = atolba(argv[3]);
+		m->p[entry].size = atolba(argv[4]);
+	} else if (strcmp(argv[0], "f7") == 0 && 2 <= argc && !m->f7[entry]) {
+		if (!f7_formatargs(argc, argv, 2, 0, &m->format[entry]) || m->format[entry].dryrun) {
+			fprintf(stderr, "%s:%d: Wrong F7h layout (the options are those of override).\n", file, line);
+			return 0;
+		}
+		m->f7[entry] = 1;
+	} else if (strcmp(argv[0], "slot") == 0 && argc == 4) {
+		ImageSlot *s = &m->slots[m->nslots];
+
+		if (m->nslots == 4 * F7_SLOTS_MAX) {
+			fprintf(stderr, "%s:%d: Too many slots.\n", file, line);
+			return 0;
+		}
+
+		s->entry = entry;
+		s->slot = atol2(argv[2]);
+		s->line = line;
+		if (s->slot < 0 || F7_SLOTS_MAX <= s->slot) {
+			fprintf(stderr, "%s:%d: The slot must be 0-%d.\n", file, line, F7_SLOTS_MAX - 1);
+			return 0;
+		}
+		if ((s->file = strdup(argv[3])) == nil) {
+			fprintf(stderr, "Could not allocate the manifest.\n");
+			return 0;
+		}
+		++m->nslots;
+	} else {
+		fprintf(stderr, "%s:%d: Unknown (or repeated) line.\n", file, line);
+		return 0;
+	}
+
+	return 1;
+}
+
+// The partitions (in logical sectors) and the layouts, with the slots marked.
+static int
+planimage(char const *file, Manifest *m, PartEntry *p, MetaF7 *meta, off_t *disk)
+{
+	int scale = m->sector / 512;
+
+	if (m->disk % scale != 0) {
+		fprintf(stderr, "The disk size must be a multiple of the sector size (%d bytes).\n", m->sector);
+		return 0;
+	}
+	*disk = m->disk / scale * m->sector;
+
+	memcpy(p, m->p, 4 * sizeof(PartEntry));
+	for (int i = 0; i < 4; ++i) {
+		if (p[i].type == 0x00)
+			continue;
+
+		if (p[i].start % scale != 0 || p[i].size % scale != 0) {
+			fprintf(
+				stderr
+				, "The partition #%d must be aligned to the sector size (%d bytes).\n"
+				, i
+				, m->sector
+			);
+			return 0;
+		}
+		p[i].start /= scale;
+		p[i].size /= scale;
+
+		// GPT protective MBR partitions are allowed to exceed the disk size.
+		if (p[i].type != 0xEE && m->disk / scale < p[i].start + p[i].size) {
+			fprintf(stderr, "The partition #%d is beyond the disk size.\n", i);
+			return 0;
+		}
+	}
+
+	// As read_ptable: GPT protective MBR partitions may overlap.
+	for (int a = 0; a < 4; ++a)
+		for (int b = a + 1; b < 4; ++b)
+			if (
+				p[a].type != 0x00 && p[a].type != 0xEE
+				&& p[b].type != 0x00 && p[b].type != 0xEE
+				&& p[a].start < p[b].start + p[b].size
+				&& p[b].start < p[a].start + p[a].size
+			) {
+				fprintf(stderr, "Overlapping partitions detected.\n");
+				return 0;
+			}
+
+	for (int i = 0; i < 4; ++i) {
+		if (!m->f7[i]) {
+			if (p[i].type == 0xF7) {
+				fprintf(stderr, "The F7h partition #%d has no layout (f7 line).\n", i);
+				return 0;
+			}
+			continue;
+		}
+
+		if (!f7_layout(p, i, m->sector, &m->format[i], &meta[i]))
+			return 0;
+		p[i].type = 0xF7;
+	}
+
+	for (int i = 0; i < m->nslots; ++i) {
+		ImageSlot const *s = &m->slots[i];
+
+		do {
+			if (!m->f7[s->entry])
+				fprintf(stderr, "%s:%d: The partition #%d is not F7h.\n", file, s->line, s->entry);
+			else if (meta[s->entry].count <= s->slot)
+				fprintf(stderr, "%s:%d: There is only %d slot/s.\n", file, s->line, meta[s->entry].count);
+			else if (f7_active(&meta[s->entry], s->slot))
+				fprintf(stderr, "%s:%d: The slot #%d was already given.\n", file, s->line, s->slot);
+			else
+				break;
+
+			return 0;
+		} while (0);
+		f7_mark(&meta[s->entry], s->slot, 1);
+	}
+
+	return 1;
+}
+
+static int
+cmpregion(void const *a, void const *b)
+{
+	off_t x = ((Region const *)a)->offset;
+	off_t y = ((Region const *)b)->offset;
+
+	return x < y? -1: y < x? 1: 0;
+}
+
+// Leaves n bytes untouched (or writes zeros, if it cannot seek).
+static int
+skip(int out, int seekable, off_t n, uchar const *zeros)
+{
+	if (n <= 0)
+		return 1;
+
+	if (seekable) {
+		if (lseek(out, n, SEEK_CUR) == (off_t)-1) {
+			perror("Could not seek the output image file");
+			return 0;
+		}
+		return 1;
+	}
+
+	while (0 < n) {
+		size_t count = n < IMAGE_CHUNK? n: IMAGE_CHUNK;
+
+		if (writefull(out, zeros, count) < (ssize_t)count) {
+			perror("Could not write the output image");
+			return 0;
+		}
+		throttle(count);
+		n -= count;
+	}
+	return 1;
+}
+
+static int
+emit(int out, Region const *r, uchar *buf)
+{
+	if (r->buf != nil) {
+		if (writefull(out, r->buf, r->length) < r->length) {
+			fprintf(stderr, "Could not write the %s: %s\n", r->what, strerror(errno));
+			return 0;
+		}
+		return 1;
+	}
+
+	for (off_t done = 0; done < r->length;) {
+		size_t count = r->length - done < IMAGE_CHUNK? r->length - done: IMAGE_CHUNK;
+		ssize_t n;
+
+		n = preadfull(r->fd, buf, count, r->srcoff + done);
+		if (n < 0) {
+			fprintf(stderr, "Could not read the %s: %s\n", r->what, strerror(errno));
+			return 0;
+		} else if ((size_t)n < count) {
+			fprintf(stderr, "The %s is shorter than expected.\n", r->what);
+			return 0;
+		}
+
+		if (writefull(out, buf, count) < (ssize_t)count) {
+			fprintf(stderr, "Could not write the %s: %s\n", r->what, strerror(errno));
+			return 0;
+		}
+		throttle(count);
+
+		if (r->idx != nil)
+			merklefeed(r->idx, buf, count);
+		done += count;
+	}
+	return 1;
+}
+
+static void
+freemanifest(Manifest *m)
+{
+	for (int i = 0; i < m->nslots; ++i)
+		free(m->slots[i].file);
+	free(m->slots);
+	free(m->boot);
+}
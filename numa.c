@@ -0,0 +1,112 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "numa.h"
+
+// As in linux/mempolicy.h (not always installed).
+#define MPOL_PREFERRED 1
+
+static int readnode(char const *path);
+
+int
+devnode(int fd)
+{
+	struct stat statbuf;
+	char link[64];
+	char path[PATH_MAX];
+	dev_t dev;
+	int node;
+
+	// Nothing to choose from.
+	if (access("/sys/devices/system/node/node1", F_OK) != 0)
+		return -1;
+
+	if (fstat(fd, &statbuf) != 0)
+		return -1;
+	dev = S_ISBLK(statbuf.st_mode)? statbuf.st_rdev: statbuf.st_dev;
+
+	snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	if (realpath(link, path) == nil)
+		return -1;
+
+	// Up from the disk (or partition) to the controller that has it.
+	for (;;) {
+		char *slash;
+
+		if ((node = readnode(path)) != -1)
+			return node;
+		if ((slash = strrchr(path, '/')) == nil || slash - path <= (int)strlen("/sys/devices"))
+			return -1;
+		*slash = '\0';
+	}
+}
+
+int
+numabind(int node)
+{
+	char path[64];
+	FILE *f;
+	cpu_set_t cpus;
+	unsigned long mask[NODE_MAX / (8 * sizeof(unsigned long))];
+	int from, to, ok;
+
+	if (node < 0 || NODE_MAX <= node)
+		return 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if ((f = fopen(path, "r")) == nil)
+		return 0;
+
+	// "0-3,8-11"
+	CPU_ZERO(&cpus);
+	ok = 0;
+	while (fscanf(f, "%d", &from) == 1) {
+		to = from;
+		if (fscanf(f, "-%d", &to) < 0)
+			break;
+		for (int cpu = from; cpu <= to && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, &cpus);
+		ok = 1;
+		if (fgetc(f) != ',')
+			break;
+	}
+	fclose(f);
+
+	if (!ok || sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		return 0;
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << node % (8 * sizeof(unsigned long));
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NODE_MAX + 1) == 0;
+}
+
+// -1 if there is none (or it is unknown).
+static int
+readnode(char const *dir)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int node;
+
+	if ((size_t)snprintf(path, sizeof(path), "%s/numa_node", dir) >= sizeof(path))
+		return -1;
+	if ((f = fopen(path, "r")) == nil)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
@@ -0,0 +1,12 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#define NODE_MAX 64
+
+// The NUMA node of the device (of its controller), or -1 if unknown
+// (for image files, the node of the device they are on).
+int devnode(int fd);
+// Pins the process to the CPUs of the node, and prefers its memory
+// (for what is allocated from now on). It returns 0 if it could not.
+int numabind(int node);
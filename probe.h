@@ -0,0 +1,80 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// Static tracepoints (USDT) of the "f7disk" provider, for bpftrace or perf.
+// With <sys/sdt.h> (systemtap-sdt-dev), they are built in, with a
+// semaphore each (see main.c): until something attaches to a probe, it
+// is a test and a branch, and neither its arguments nor its clock are
+// evaluated. Without it (or with F7_NOPROBES), they are compiled out.
+//
+//	op_start(command)	op_end(command, ns)
+//	ptable_parse(fd, ns)	header_read(entry, offset, version, ns)
+//	slot_start(entry, slot, offset, length)	slot_end(entry, slot, bytes, ns)
+//	read_start(offset, len)	read_done(offset, len, ns)
+//	write_start(offset, len)	write_done(offset, len, ns)
+//	verify_done(offset, len, ns)
+//	bitmap_commit(entry, slot, active, ns)
+//
+// Offsets are in bytes, and ns the latency of the operation.
+
+#if defined(__has_include) && !defined(F7_NOPROBES)
+	#if __has_include(<sys/sdt.h>)
+		#define F7_PROBES
+	#endif
+#endif
+
+#ifdef F7_PROBES
+	#define _SDT_HAS_SEMAPHORES 1
+	#include <sys/sdt.h>
+	#include <time.h>
+
+	// Incremented by the tracer while it is attached (in .probes).
+	extern unsigned short f7disk_op_start_semaphore;
+	extern unsigned short f7disk_op_end_semaphore;
+	extern unsigned short f7disk_ptable_parse_semaphore;
+	extern unsigned short f7disk_header_read_semaphore;
+	extern unsigned short f7disk_slot_start_semaphore;
+	extern unsigned short f7disk_slot_end_semaphore;
+	extern unsigned short f7disk_read_start_semaphore;
+	extern unsigned short f7disk_read_done_semaphore;
+	extern unsigned short f7disk_write_start_semaphore;
+	extern unsigned short f7disk_write_done_semaphore;
+	extern unsigned short f7disk_verify_done_semaphore;
+	extern unsigned short f7disk_bitmap_commit_semaphore;
+
+	#define PROBED(name) __builtin_expect(f7disk_##name##_semaphore != 0, 0)
+	#define PROBE1(name, a) \
+		do { if (PROBED(name)) DTRACE_PROBE1(f7disk, name, a); } while (0)
+	#define PROBE2(name, a, b) \
+		do { if (PROBED(name)) DTRACE_PROBE2(f7disk, name, a, b); } while (0)
+	#define PROBE3(name, a, b, c) \
+		do { if (PROBED(name)) DTRACE_PROBE3(f7disk, name, a, b, c); } while (0)
+	#define PROBE4(name, a, b, c, d) \
+		do { if (PROBED(name)) DTRACE_PROBE4(f7disk, name, a, b, c, d); } while (0)
+	// A clock for the latency given to 'name' (only while it is attached).
+	#define PROBECLOCK(name, t) \
+		struct timespec t = {0, 0}; \
+		if (PROBED(name)) \
+			clock_gettime(CLOCK_MONOTONIC, &t)
+	#define PROBENS(t) probens(&t)
+
+	// 0 if the clock was not read (attached in between).
+	static inline long long
+	probens(struct timespec const *t)
+	{
+		struct timespec now;
+
+		if (t->tv_sec == 0 && t->tv_nsec == 0)
+			return 0;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (now.tv_sec - t->tv_sec) * 1000000000LL + (now.tv_nsec - t->tv_nsec);
+	}
+#else
+	#define PROBE1(name, a) do {} while (0)
+	#define PROBE2(name, a, b) do {} while (0)
+	#define PROBE3(name, a, b, c) do {} while (0)
+	#define PROBE4(name, a, b, c, d) do {} while (0)
+	#define PROBECLOCK(name, t) do {} while (0)
+	#define PROBENS(t)
+#endif
@@ -3,16 +3,42 @@
 // licensed under the terms of GPLv2.
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <linux/fs.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "u.h"
 #include "f7disk.h"
 #include "ptable.h"
+#include "copy.h"
+#include "backend.h"
+#include "probe.h"
 
+// The sector size of the image files, detected once per descriptor
+// (a descriptor reused for another file is told by fstat, as for the
+// backends). The oldest one is replaced when it is full.
+#define SECTORS_MAX 16
+
+typedef struct {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	int sector;
+} Sector;
+
+static pthread_mutex_t sectorlock = PTHREAD_MUTEX_INITIALIZER;
+static Sector sectors[SECTORS_MAX];
+static int nsectors;
+
+static int imagesector(int fd, struct stat const *st);
+static int detectsector(int fd);
 static char const *strtype(int type);
 
 void
@@ -27,7 +53,7 @@ tablebrief(int argc, char **argv)
 
 	{
 		int fd;
-		fd = open(argv[2], O_RDONLY);
+		fd = devopen(argv[2], O_RDONLY);
 		if (fd == -1) {
 			perror("Cannot open the requested device/image file");
 			exit(1);
@@ -78,13 +104,14 @@ read_ptable(int fd, PartEntry *p)
 {
 	ssize_t n;
 	uchar mbr[512];
+	PROBECLOCK(ptable_parse, t);
 
-	if ((off_t)-1 == lseek(fd, 0, SEEK_SET)) {
-		perror("Could not seek the file offset");
-		return 0;
+	if (devptable(fd, p)) {
+		PROBE2(ptable_parse, fd, PROBENS(t));
+		return 1;
 	}
 
-	n = read(fd, mbr, 512);
+	n = preadfull(fd, mbr, 512, 0);
 	if (n != 512) {
 		if (n < 0)
 			perror("Cannot read the requested device/image file");
@@ -139,12 +166,12 @@ read_ptable(int fd, PartEntry *p)
 		}
 	}
 
-	off_t sectors = lseek(fd, 0, SEEK_END);
+	off_t sectors = bsize(fd);
 	if (sectors == (off_t)-1) {
 		perror("Could not retrieve the file size");
 		return 0;
 	}
-	sectors /= 512;
+	sectors /= lbasize(fd);
 
 	// GPT protective MBR partitions are allowed to exceed the disk size.
 	for (int i = 0; i < 4; ++i)
@@ -156,9 +183,169 @@ read_ptable(int fd, PartEntry *p)
 			return 0;
 		}
 
+	PROBE2(ptable_parse, fd, PROBENS(t));
 	return 1;
 }
 
+int
+lbasize(int fd)
+{
+	struct stat st;
+	int size;
+
+	if (fstat(fd, &st) != 0)
+		return 512;
+	if (S_ISREG(st.st_mode))
+		return imagesector(fd, &st);
+	if (!S_ISBLK(st.st_mode))
+		return 512;
+
+	if (ioctl(fd, BLKSSZGET, &size) != 0 || size < 512 || SECTOR_MAX < size) {
+		fprintf(stderr, "WARNING: Unknown logical sector size (assuming 512 bytes).\n");
+		return 512;
+	}
+	return size;
+}
+
+static int
+imagesector(int fd, struct stat const *st)
+{
+	Sector *s;
+	int sector, n;
+
+	pthread_mutex_lock(&sectorlock);
+	n = nsectors < SECTORS_MAX? nsectors: SECTORS_MAX;
+	for (int i = 0; i < n; ++i) {
+		s = &sectors[i];
+		if (s->fd == fd && s->dev == st->st_dev && s->ino == st->st_ino) {
+			sector = s->sector;
+			pthread_mutex_unlock(&sectorlock);
+			return sector;
+		}
+	}
+	pthread_mutex_unlock(&sectorlock);
+
+	sector = detectsector(fd);
+
+	pthread_mutex_lock(&sectorlock);
+	s = nil;
+	for (int i = 0; s == nil && i < n; ++i)
+		if (sectors[i].fd == fd)
+			s = &sectors[i];
+	if (s == nil)
+		s = &sectors[nsectors++ % SECTORS_MAX];
+	s->fd = fd;
+	s->dev = st->st_dev;
+	s->ino = st->st_ino;
+	s->sector = sector;
+	pthread_mutex_unlock(&sectorlock);
+	return sector;
+}
+
+// Image files use the classic 512-byte sectors, unless they hold a F7h
+// header (version 1) of 4 KiB ones, where their partition table says
+// (as mkimage writes them for 4Kn devices).
+static int
+detectsector(int fd)
+{
+	uchar mbr[512], header[512];
+
+	if (preadfull(fd, mbr, 512, 0) != 512 || (mbr[510] | mbr[511] << 8) != 0xAA55)
+		return 512;
+
+	for (int i = 0; i < 4; ++i) {
+		uchar const *e = &mbr[0x1BE + i * 0x10];
+
+		if (e[4] != 0xF7)
+			continue;
+		if (
+			preadfull(fd, header, 512, (off_t)getle(&e[8], 4) * SECTOR_MAX) == 512
+			&& header[0] == 0xF7 && header[1] == 0x01
+			&& memcmp(&header[2], "SYSIMG", 6) == 0
+			&& getle(&header[8], 2) == SECTOR_MAX
+		)
+			return SECTOR_MAX;
+	}
+	return 512;
+}
+
+// The optimal I/O size of the device, the best guess of its erase
+// block size (0 if unknown, as for image files).
+off_t
+erasesize(int fd)
+{
+	struct stat st;
+	uint size;
+
+	if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode))
+		return 0;
+	if (ioctl(fd, BLKIOOPT, &size) != 0)
+		return 0;
+	return size;
+}
+
+// Every lock gets its own open file description (reopening the device),
+// so they conflict between processes and daemon workers alike,
+// and it is released as soon as it is closed.
+int
+devlock(int fd, off_t start, off_t len, int type, int wait, char const *what)
+{
+	char path[32];
+	struct flock fl;
+	int lfd;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	lfd = open(path, type == F_WRLCK? O_WRONLY: O_RDONLY);
+	if (lfd < 0) {
+		fprintf(stderr, "Could not lock the %s: %s\n", what, strerror(errno));
+		return -1;
+	}
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+	while (fcntl(lfd, wait? F_OFD_SETLKW: F_OFD_SETLK, &fl) < 0) {
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN || errno == EACCES)
+			fprintf(stderr, "The %s is in use by another process.\n", what);
+		else
+			fprintf(stderr, "Could not lock the %s: %s\n", what, strerror(errno));
+		close(lfd);
+		return -1;
+	}
+	return lfd;
+}
+
+void
+devunlock(int lfd)
+{
+	if (0 <= lfd)
+		close(lfd);
+}
+
+uvlong
+getle(uchar const *buf, int len)
+{
+	uvlong v = 0;
+
+	for (int i = len - 1; 0 <= i; --i)
+		v = v << 8 | buf[i];
+	return v;
+}
+
+void
+putle(uchar *buf, uvlong v, int len)
+{
+	for (int i = 0; i < len; ++i) {
+		buf[i] = v & 0xFF;
+		v = v >> 8;
+	}
+}
+
 static char const *
 strtype(int type)
 {
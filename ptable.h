@@ -9,4 +9,28 @@ typedef struct {
 	vlong size;
 } PartEntry;
 
+#define SECTOR_MAX 4096 // Largest logical sector supported (4Kn).
+
 int read_ptable(int fd, PartEntry *p);
+// Logical sector size, in bytes (the LBA unit of the partition table);
+// that of an image file is detected once per descriptor.
+int lbasize(int fd);
+off_t erasesize(int fd);
+// OFD byte-range locks (advisory, between f7disk processes).
+// They return the lock (to be given to devunlock) or -1, after a message.
+int devlock(int fd, off_t start, off_t len, int type, int wait, char const *what);
+void devunlock(int lfd);
+// Little-endian fields of 'len' bytes (the on-disk formats).
+uvlong getle(uchar const *buf, int len);
+void putle(uchar *buf, uvlong v, int len);
+
+// Devices kept open (and parsed) by the daemon (see serve.c).
+// Outside of it, they just open the file or report a miss.
+int devopen(char const *path, int flags);
+int devptable(int fd, PartEntry *p);
+int devheader(int fd, int entry, uchar *header);
+// The payloads given as "-": how many there can be, and a new
+// descriptor of one (the first is the standard input; the others,
+// only in the daemon, are passed along with the request).
+int devinputs(void);
+int devinput(int n);
@@ -0,0 +1,295 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+// The boot-time query: which slots are active, and where they are,
+// for the shell (eval) of an initramfs. It reads the MBR and the F7h
+// header (two preads, a third for 4 KiB image files) and writes the answer at once, without stdio;
+// the partition table is only validated with --check.
+// Built with -DF7_QUERY_MAIN, it is a program of its own (o.f7query),
+// static and without the rest of f7disk.
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "ptable.h"
+#include "f7part.h"
+
+#define QUERY_OUT (64 * 1024) // Enough for F7_SLOTS_MAX offsets.
+
+typedef struct {
+	char buf[QUERY_OUT];
+	int n;
+} Out;
+
+static int query(char const *dev, int entry, int check);
+static int checkptable(int fd, uchar const *mbr, int sector);
+static int isheader(uchar const *header);
+static void outstr(Out *o, char const *s);
+static void outnum(Out *o, uvlong v);
+static void fail(char const *msg);
+
+#ifdef F7_QUERY_MAIN
+
+int
+main(int argc, char **argv)
+{
+	int check = argc == 4 && strcmp(argv[3], "--check") == 0;
+
+	if (
+		(argc != 3 && !check)
+		|| argv[2][0] < '0' || '3' < argv[2][0] || argv[2][1] != '\0'
+	) {
+		fail("Usage: f7query <file> <0-3> [--check]");
+		return 1;
+	}
+	return query(argv[1], argv[2][0] - '0', check)? 0: 1;
+}
+
+// As in ptable.c (which is not linked in).
+uvlong
+getle(uchar const *buf, int len)
+{
+	uvlong v = 0;
+
+	for (int i = len - 1; 0 <= i; --i)
+		v = v << 8 | buf[i];
+	return v;
+}
+
+#else
+
+#include <stdlib.h>
+
+#include "f7disk.h"
+
+void
+f7_query(int argc, char **argv)
+{
+	int check = argc == 5 && strcmp(argv[4], "--check") == 0;
+
+	if (
+		(argc != 4 && !check)
+		|| argv[3][0] < '0' || '3' < argv[3][0] || argv[3][1] != '\0'
+	) {
+		usage();
+		exit(1);
+	}
+	if (!query(argv[2], argv[3][0] - '0', check))
+		exit(1);
+}
+
+#endif
+
+// F7_VERSION, F7_SECTOR, F7_SLOTS, F7_BITMAP (as brief), F7_ACTIVE
+// (the active slots), F7_SIZE (of a slot, in bytes) and F7_OFFSET_<n>
+// (in bytes, from the beginning of the device) for every slot.
+static int
+query(char const *dev, int entry, int check)
+{
+	static Out o;
+	uchar mbr[512], header[512];
+	struct stat st;
+	int fd, sector;
+	int version, count, bits;
+	uvlong bitmap[F7_SLOTS_MAX / 64];
+	vlong start, first, size, every;
+	int active;
+
+	if ((fd = open(dev, O_RDONLY | O_CLOEXEC)) < 0) {
+		fail("Cannot open the requested device/image file.");
+		return 0;
+	}
+
+	sector = 512;
+	if (fstat(fd, &st) != 0)
+		st.st_mode = 0;
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &sector) != 0)
+		sector = 512;
+
+	if (pread(fd, mbr, 512, 0) != 512 || (mbr[510] | mbr[511] << 8) != 0xAA55) {
+		fail("Magic number (AA55h) not found.");
+		close(fd);
+		return 0;
+	}
+	if (mbr[0x1BE + entry * 0x10 + 4] != 0xF7) {
+		fail("Not a F7h partition.");
+		close(fd);
+		return 0;
+	}
+	start = getle(&mbr[0x1BE + entry * 0x10 + 8], 4);
+
+	// The header and the bitmap fit in 512 bytes, whatever the sector.
+	// Image files of 4 KiB sectors are told by their header (as lbasize).
+	if (pread(fd, header, 512, start * sector) != 512 || !isheader(header)) {
+		if (
+			!S_ISREG(st.st_mode)
+			|| pread(fd, header, 512, start * SECTOR_MAX) != 512
+			|| !isheader(header)
+			|| header[1] != 0x01
+			|| getle(&header[8], 2) != SECTOR_MAX
+		) {
+			fail("Header signature not found.");
+			close(fd);
+			return 0;
+		}
+		sector = SECTOR_MAX;
+	}
+	if (check && !checkptable(fd, mbr, sector)) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	memset(bitmap, 0, sizeof(bitmap));
+	version = header[1];
+	if (version == 0x00) {
+		if (sector != 512) {
+			fail("The F7h header expects 512-byte sectors.");
+			return 0;
+		}
+		first = getle(&header[8], 4);
+		size = getle(&header[12], 4);
+		every = size + getle(&header[16], 2);
+		count = header[19] + 1;
+		bitmap[0] = getle(&header[22], 2);
+		bits = 16;
+	} else {
+		count = getle(&header[10], 2);
+		if ((int)getle(&header[8], 2) != sector || count < 1 || F7_SLOTS_MAX < count) {
+			fail("Unsupported F7h header (sector size or slots).");
+			return 0;
+		}
+		first = getle(&header[16], 8);
+		size = getle(&header[24], 8);
+		every = size + getle(&header[32], 8);
+		if (LBA_MAX < first || LBA_MAX < size || 2 * LBA_MAX < every) {
+			fail("The F7h header bounds are impossible.");
+			return 0;
+		}
+		for (int i = 0; i < (count + 7) / 8; ++i)
+			bitmap[i / 8] |= (uvlong)header[F7_HEADER_V1 + i] << i % 8 * 8;
+		bits = (count + 7) / 8 * 8;
+	}
+
+	o.n = 0;
+	outstr(&o, "F7_VERSION=");
+	outnum(&o, version);
+	outstr(&o, "\nF7_SECTOR=");
+	outnum(&o, sector);
+	outstr(&o, "\nF7_SLOTS=");
+	outnum(&o, count);
+	outstr(&o, "\nF7_BITMAP=");
+	for (int i = (bits + 3) / 4 - 1; 0 <= i; --i)
+		o.buf[o.n++] = "0123456789ABCDEF"[bitmap[i / 16] >> i % 16 * 4 & 0xF];
+	outstr(&o, "\nF7_ACTIVE='");
+	active = 0;
+	for (int i = 0; i < count; ++i)
+		if (bitmap[i / 64] >> i % 64 & 0x1) {
+			if (active++)
+				outstr(&o, " ");
+			outnum(&o, i);
+		}
+	outstr(&o, "'\nF7_SIZE=");
+	outnum(&o, size * sector);
+	for (int i = 0; i < count; ++i) {
+		outstr(&o, "\nF7_OFFSET_");
+		outnum(&o, i);
+		outstr(&o, "=");
+		outnum(&o, (start + first + i * every) * sector);
+	}
+	outstr(&o, "\n");
+
+	return write(STDOUT_FILENO, o.buf, o.n) == o.n;
+}
+
+// As read_ptable: no overlapping partitions (but GPT protective MBR
+// ones), and none beyond the end of the device.
+static int
+checkptable(int fd, uchar const *mbr, int sector)
+{
+	uvlong bytes;
+	struct stat st;
+	vlong start[4], size[4];
+	int type[4];
+
+	if (fstat(fd, &st) != 0) {
+		fail("Could not retrieve the file size.");
+		return 0;
+	}
+	bytes = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+		fail("Could not retrieve the file size.");
+		return 0;
+	}
+
+	for (int i = 0; i < 4; ++i) {
+		type[i] = mbr[0x1BE + i * 0x10 + 4];
+		start[i] = getle(&mbr[0x1BE + i * 0x10 + 8], 4);
+		size[i] = getle(&mbr[0x1BE + i * 0x10 + 12], 4);
+	}
+
+	for (int a = 0; a < 4; ++a) {
+		if (type[a] == 0x00 || type[a] == 0xEE)
+			continue;
+
+		if ((vlong)(bytes / sector) < start[a] + size[a]) {
+			fail("At least one partition is larger than the file.");
+			return 0;
+		}
+		for (int b = a + 1; b < 4; ++b)
+			if (
+				type[b] != 0x00 && type[b] != 0xEE
+				&& start[a] < start[b] + size[b]
+				&& start[b] < start[a] + size[a]
+			) {
+				fail("Overlapping partitions detected.");
+				return 0;
+			}
+	}
+	return 1;
+}
+
+static int
+isheader(uchar const *header)
+{
+	return header[0] == 0xF7 && memcmp(&header[2], "SYSIMG", 6) == 0 && header[1] <= 0x01;
+}
+
+static void
+outstr(Out *o, char const *s)
+{
+	size_t n = strlen(s);
+
+	memcpy(&o->buf[o->n], s, n);
+	o->n += n;
+}
+
+static void
+outnum(Out *o, uvlong v)
+{
+	char digits[20];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	while (0 < n)
+		o->buf[o->n++] = digits[--n];
+}
+
+static void
+fail(char const *msg)
+{
+	struct iovec v[2] = {{(void *)msg, strlen(msg)}, {"\n", 1}};
+
+	writev(STDERR_FILENO, v, 2);
+}
@@ -0,0 +1,569 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "f7disk.h"
+#include "ptable.h"
+#include "f7part.h"
+#include "copy.h"
+#include "backend.h"
+#include "hash.h"
+#include "merkle.h"
+#include "digest.h"
+#include "compress.h"
+#include "iolimit.h"
+#include "journal.h"
+
+#define MOVE_STEP (64 * 1024 * 1024) // Bytes moved between journal saves.
+
+static int moveorder(MovePlan const *plan, int *order);
+static int clearsources(int fd, PartEntry const *p, int entry, MetaF7 *meta, MovePlan const *plan, SlotMove const *m);
+static int movesteps(int fd, MovePlan *plan, SlotMove const *m, char const *jnl);
+static int savestep(int fd, MovePlan const *plan, char const *jnl);
+static void moveindex(int fd, char const *file, PartEntry const *p, int entry, SlotMove const *m);
+static int samelayout(MetaF7 const *a, MetaF7 const *b);
+// The active slots are packed, in order, into the lowest slot numbers,
+// without padding and right after the header; the free space
+// is left together at the end of the partition.
+void
+f7_repack(int argc, char **argv)
+{
+	int fd;
+	int entry;
+	PartEntry p[4];
+	uchar header[F7_HEADER_MAX];
+	MetaF7 meta, layout;
+	MovePlan plan;
+	SlotMove *moves = plan.moves;
+	int n;
+	int dryrun;
+	vlong reclaimed, moved;
+	int lock;
+
+	if (argc < 4) {
+		usage();
+		exit(1);
+	}
+	if (5 <= argc && strcmp(argv[4], "--resume") == 0) {
+		f7_resumemoves(argc, argv);
+		return;
+	}
+	dryrun = 5 <= argc && strcmp(argv[4], "--dry-run") == 0;
+	ioargs(argc, argv, dryrun? 5: 4);
+
+	entry = atol2(argv[3]);
+	if (entry < 0 || 3 < entry) {
+		usage();
+		exit(1);
+	}
+
+	fd = devopen(argv[2], dryrun? O_RDONLY: O_RDWR);
+	if (fd == -1) {
+		perror("Cannot open the requested device/image file");
+		exit(1);
+	}
+
+	if (
+		!read_ptable(fd, p)
+		|| !f7_read_header(fd, p, entry, header)
+		|| !f7_retrieve_meta(header, &meta)
+	) {
+		close(fd);
+		exit(1);
+	}
+
+	layout = meta;
+	layout.first = 1;
+	layout.every = layout.size;
+	memset(layout.bitmap, 0, sizeof(layout.bitmap));
+
+	// Every slot moves down (or stays), as f7_moveslots expects.
+	n = 0;
+	for (int slot = 0; slot < meta.count; ++slot) {
+		if (!f7_active(&meta, slot))
+			continue;
+
+		moves[n].from = slot;
+		moves[n].to = n;
+		moves[n].src = f7_slotoffset(p, entry, &meta, slot);
+		moves[n].dst = f7_slotoffset(p, entry, &layout, n);
+		moves[n].length = f7_payload(fd, argv[2], p, entry, &meta, slot);
+		f7_mark(&layout, n, 1);
+		++n;
+	}
+
+	reclaimed =
+		meta.first + (meta.count - 1) * meta.every
+		- (layout.first + (meta.count - 1) * layout.every)
+	;
+
+	if (dryrun) {
+		for (int i = 0; i < n; ++i)
+			if (moves[i].src != moves[i].dst)
+				printf(
+					"Slot #%d -> #%d: to be moved (%jd bytes)\n"
+					, moves[i].from
+					, moves[i].to
+					, (intmax_t)moves[i].length
+				);
+	} else {
+		if ((lock = f7_lockall(fd, p, entry, meta.sector, &meta)) < 0) {
+			close(fd);
+			exit(1);
+		}
+
+		plan.old = meta;
+		plan.new = layout;
+		plan.n = n;
+		plan.next = 0;
+		plan.done = 0;
+		plan.backup = nil;
+		plan.backlen = 0;
+		if ((moved = f7_applyplan(fd, argv[2], p, entry, &plan)) < 0) {
+			devunlock(lock);
+			close(fd);
+			exit(1);
+		}
+		devunlock(lock);
+		printf("Moved = %lld bytes\n", moved);
+		iostats();
+	}
+	close(fd);
+
+	printf("Reclaimed = %lld bytes\n", reclaimed * meta.sector);
+}
+
+// The payload length is only known from the hash index;
+// otherwise, the whole slot is taken.
+off_t
+f7_payload(int fd, char const *file, PartEntry const *p, int entry, MetaF7 const *meta, int slot)
+{
+	char path[PATH_MAX];
+	Merkle m;
+	off_t length;
+	Zhead z;
+
+	// What is stored (the index covers the same).
+	if (zprobe(fd, f7_slotoffset(p, entry, meta, slot), &z) && z.stored <= meta->size * meta->sector)
+		return z.stored;
+
+	if (
+		!merklepath(fd, file, p, entry, slot, path, sizeof(path))
+		|| !merkleload(&m, path, f7_slotoffset(p, entry, meta, slot))
+	)
+		return meta->size * meta->sector;
+
+	length = m.length;
+	merklefree(&m);
+	return length;
+}
+
+// Every active slot keeps its number, at the offset of the new layout.
+int
+f7_planmoves(
+	int fd
+	, char const *file
+	, PartEntry const *p
+	, int entry
+	, MetaF7 const *old
+	, MetaF7 const *new
+	, SlotMove *moves
+	, int *n
+)
+{
+	*n = 0;
+	for (int slot = 0; slot < old->count; ++slot) {
+		SlotMove *m = &moves[*n];
+
+		if (!f7_active(old, slot))
+			continue;
+
+		if (new->count <= slot) {
+			fprintf(stderr, "The active slot #%d is beyond the new slot count.\n", slot);
+			return 0;
+		}
+
+		m->from = slot;
+		m->to = slot;
+		m->src = f7_slotoffset(p, entry, old, slot);
+		m->dst = f7_slotoffset(p, entry, new, slot);
+		m->length = f7_payload(fd, file, p, entry, old, slot);
+		if (new->size * new->sector < m->length) {
+			fprintf(
+				stderr
+				, "The slot #%d does not fit the new size (%jd bytes%s).\n"
+				, slot
+				, (intmax_t)m->length
+				, m->length == old->size * old->sector? ", without a hash index": ""
+			);
+			return 0;
+		}
+
+		++*n;
+	}
+	return 1;
+}
+
+// The moves must keep the order of the slots (as any layout does).
+// Those going down are done first, from the lowest one;
+// then, those going up, from the highest one.
+// This way, nothing is overwritten before it is read.
+//
+// The old header stays valid until the new one replaces it: a slot is
+// only cleared there when the data it points to is about to be
+// overwritten (by its own move, or by that of another slot, moved
+// before). Every move goes in steps of MOVE_STEP at most, journaled,
+// and an interrupted one can be done again from its last step.
+vlong
+f7_moveslots(
+	int fd
+	, char const *file
+	, PartEntry const *p
+	, int entry
+	, MetaF7 *meta
+	, MovePlan *plan
+	, char const *jnl
+)
+{
+	int order[F7_SLOTS_MAX];
+	int n = moveorder(plan, order);
+	vlong moved = 0;
+
+	while (plan->next < n) {
+		SlotMove const *m = &plan->moves[order[plan->next]];
+
+		moved += m->length - plan->done;
+		if (
+			!clearsources(fd, p, entry, meta, plan, m)
+			|| !movesteps(fd, plan, m, jnl)
+		)
+			return -1;
+
+		plan->next += 1;
+		plan->done = 0;
+		if (!savestep(fd, plan, jnl))
+			return -1;
+
+		moveindex(fd, file, p, entry, m);
+		if (m->from == m->to)
+			printf("Slot #%d: moved (%jd bytes)\n", m->from, (intmax_t)m->length);
+		else
+			printf("Slot #%d -> #%d: moved (%jd bytes)\n", m->from, m->to, (intmax_t)m->length);
+	}
+
+	return moved;
+}
+
+vlong
+f7_applyplan(int fd, char const *file, PartEntry const *p, int entry, MovePlan *plan)
+{
+	char path[PATH_MAX];
+	char const *jnl = nil;
+	MetaF7 meta = plan->old;
+	vlong moved;
+
+	if (!movepath(fd, file, p, entry, path, sizeof(path)))
+		fprintf(stderr, "WARNING: There is no place for the journal (see F7DISK_INDEX): it cannot be resumed.\n");
+	else if (movesave(plan, path))
+		jnl = path;
+
+	if (
+		(moved = f7_moveslots(fd, file, p, entry, &meta, plan, jnl)) < 0
+		|| !f7_write_header(fd, p, entry, &plan->new)
+	) {
+		if (jnl != nil)
+			fprintf(stderr, "It can be resumed (--resume).\n");
+		return -1;
+	}
+
+	if (jnl != nil)
+		journaldrop(jnl);
+	return moved;
+}
+
+// The header on disk must be that of the journal, with no other slot
+// in use (but those cleared by the moves).
+void
+f7_resumemoves(int argc, char **argv)
+{
+	int fd;
+	int entry;
+	PartEntry p[4];
+	uchar header[F7_HEADER_MAX];
+	char jnl[PATH_MAX];
+	MovePlan plan;
+	MetaF7 meta;
+	int lock;
+	vlong moved;
+
+	ioargs(argc, argv, 5);
+
+	entry = atol2(argv[3]);
+	if (entry < 0 || 3 < entry) {
+		usage();
+		exit(1);
+	}
+
+	fd = devopen(argv[2], O_RDWR);
+	if (fd == -1) {
+		perror("Cannot open the requested device/image file");
+		exit(1);
+	}
+
+	do {
+		if (!read_ptable(fd, p))
+			;
+		else if (!movepath(fd, argv[2], p, entry, jnl, sizeof(jnl)))
+			fprintf(stderr, "There is no place for the journal (see F7DISK_INDEX).\n");
+		else if (!moveload(&plan, jnl))
+			fprintf(stderr, "There is nothing to resume (%s).\n", jnl);
+		else
+			break;
+
+		close(fd);
+		exit(1);
+	} while (0);
+
+	if ((lock = f7_lockall(fd, p, entry, plan.old.sector, nil)) < 0) {
+		close(fd);
+		exit(1);
+	}
+
+	do {
+		if (!f7_read_header(fd, p, entry, header) || !f7_retrieve_meta(header, &meta))
+			break;
+
+		// Only the new header was left to be written.
+		if (samelayout(&meta, &plan.new) && memcmp(meta.bitmap, plan.new.bitmap, sizeof(meta.bitmap)) == 0) {
+			journaldrop(jnl);
+			devunlock(lock);
+			close(fd);
+			printf("Moved = 0 bytes\n");
+			return;
+		}
+
+		if (!samelayout(&meta, &plan.old)) {
+			fprintf(stderr, "The F7h layout is not the one of the journal.\n");
+			break;
+		}
+		for (int i = 0; i < F7_SLOTS_MAX / 64; ++i)
+			if ((meta.bitmap[i] & ~plan.old.bitmap[i]) != 0) {
+				fprintf(stderr, "Other slots are in use since the journal was saved.\n");
+				devunlock(lock);
+				close(fd);
+				exit(1);
+			}
+
+		if ((moved = f7_moveslots(fd, argv[2], p, entry, &meta, &plan, jnl)) < 0)
+			break;
+		if (!f7_write_header(fd, p, entry, &plan.new))
+			break;
+
+		journaldrop(jnl);
+		devunlock(lock);
+		close(fd);
+		printf("Moved = %lld bytes\n", moved);
+		iostats();
+		return;
+	} while (0);
+
+	devunlock(lock);
+	close(fd);
+	exit(1);
+}
+
+// The order of the moves done (see f7_moveslots). It returns how many.
+static int
+moveorder(MovePlan const *plan, int *order)
+{
+	int n = 0;
+
+	for (int i = 0; i < plan->n; ++i)
+		if (plan->moves[i].dst < plan->moves[i].src)
+			order[n++] = i;
+	for (int i = plan->n - 1; 0 <= i; --i)
+		if (plan->moves[i].src < plan->moves[i].dst)
+			order[n++] = i;
+	return n;
+}
+
+// The slots whose data is under the destination of 'm' (the order of
+// the moves leaves only those moved, and its own), durably.
+static int
+clearsources(int fd, PartEntry const *p, int entry, MetaF7 *meta, MovePlan const *plan, SlotMove const *m)
+{
+	int cleared = 0;
+
+	for (int i = 0; i < plan->n; ++i) {
+		SlotMove const *o = &plan->moves[i];
+
+		if (
+			!f7_active(meta, o->from)
+			|| o->src + o->length <= m->dst
+			|| m->dst + m->length <= o->src
+		)
+			continue;
+
+		if (!f7_commit(fd, p, entry, meta, o->from, 0))
+			return 0;
+		cleared = 1;
+	}
+
+	if (cleared && !bflush(fd)) {
+		perror("Could not flush the device");
+		return 0;
+	}
+	return 1;
+}
+
+// Downwards from the beginning, upwards from the end. A step longer
+// than the distance overwrites what it reads: it is read whole, and
+// journaled before it is written (so that it can be written again).
+static int
+movesteps(int fd, MovePlan *plan, SlotMove const *m, char const *jnl)
+{
+	off_t dist = m->dst < m->src? m->src - m->dst: m->dst - m->src;
+	uchar *buf = nil;
+	int ok = 1;
+
+	if (
+		0 < plan->backlen
+		&& (m->length < plan->done + plan->backlen || MOVE_STEP < plan->backlen || plan->backlen <= dist)
+	) {
+		fprintf(stderr, "The journal does not match the moves.\n");
+		return 0;
+	}
+	if (
+		dist < MOVE_STEP
+		&& dist < m->length - plan->done
+		&& (buf = (uchar *)malloc(MOVE_STEP)) == nil
+	) {
+		fprintf(stderr, "Could not allocate the copy buffer.\n");
+		return 0;
+	}
+	if (0 < plan->backlen) {
+		memcpy(buf, plan->backup, plan->backlen);
+		free(plan->backup);
+		plan->backup = buf;
+	}
+
+	while (ok && plan->done < m->length) {
+		off_t count = m->length - plan->done < MOVE_STEP? m->length - plan->done: MOVE_STEP;
+		off_t at;
+		Copy c;
+
+		// That of an interrupted step, as it was journaled.
+		if (0 < plan->backlen)
+			count = plan->backlen;
+		at = m->dst < m->src? plan->done: m->length - plan->done - count;
+
+		if (count <= dist) {
+			copyinit(&c, fd, fd, "slot");
+			c.srcoff = m->src + at;
+			c.dstoff = m->dst + at;
+			c.size = count;
+			if (!copydata(&c))
+				ok = 0;
+		} else {
+			if (plan->backlen == 0) {
+				if (preadfull(fd, buf, count, m->src + at) != count) {
+					perror("Could not read the slot");
+					ok = 0;
+					break;
+				}
+				throttle(count);
+				plan->backup = buf;
+				plan->backlen = count;
+				if (!savestep(fd, plan, jnl)) {
+					ok = 0;
+					break;
+				}
+			}
+			if (pwritefull(fd, buf, count, m->dst + at) != count) {
+				perror("Could not write the slot");
+				ok = 0;
+			}
+			throttle(count);
+		}
+		if (!ok)
+			break;
+
+		plan->backup = nil;
+		plan->backlen = 0;
+		plan->done += count;
+		// The next step (if it is journaled) saves it too.
+		if (plan->done < m->length && (m->length - plan->done <= dist || MOVE_STEP <= dist))
+			ok = savestep(fd, plan, jnl);
+	}
+
+	plan->backup = nil;
+	plan->backlen = 0;
+	free(buf);
+	return ok;
+}
+
+// The data reaches the device before the journal says so. A journal
+// that could not be saved is left as it was: it is still right if the
+// moves stop here.
+static int
+savestep(int fd, MovePlan const *plan, char const *jnl)
+{
+	if (jnl == nil)
+		return 1;
+	if (!bflush(fd)) {
+		perror("Could not flush the device");
+		return 0;
+	}
+	return movesave(plan, jnl);
+}
+
+// The index follows the slot (and its digests).
+static void
+moveindex(int fd, char const *file, PartEntry const *p, int entry, SlotMove const *m)
+{
+	char path[PATH_MAX], old[PATH_MAX];
+	Merkle idx;
+
+	if (!merklepath(fd, file, p, entry, m->from, old, sizeof(old)))
+		return;
+
+	if (!merkleload(&idx, old, m->src)) {
+		if (merklepath(fd, file, p, entry, m->to, path, sizeof(path)))
+			merkledrop(path);
+		return;
+	}
+
+	if (merklepath(fd, file, p, entry, m->to, path, sizeof(path))) {
+		if (m->from != m->to)
+			digestmove(old, path);
+		idx.offset = m->dst;
+		merklesave(&idx, path);
+	}
+	if (m->from != m->to)
+		merkledrop(old);
+	merklefree(&idx);
+}
+
+static int
+samelayout(MetaF7 const *a, MetaF7 const *b)
+{
+	return
+		a->version == b->version
+		&& a->sector == b->sector
+		&& a->count == b->count
+		&& a->first == b->first
+		&& a->size == b->size
+		&& a->every == b->every
+	;
+}
@@ -0,0 +1,902 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "f7disk.h"
+#include "ptable.h"
+#include "backend.h"
+#include "numa.h"
+
+// Requests are a single message: the arguments of the command
+// (NUL-terminated, starting with its name) and the descriptors
+// (SCM_RIGHTS) to be used as the standard input, output and error,
+// followed by those of the other payloads of load.
+// Every payload is opened by the caller (with its permissions): the
+// first one (or the bootloader, or the bundle) is passed as the
+// standard input, and the others are given as "-" (see devinput).
+// Only root and the user of the daemon are served.
+// The reply is a single byte: the exit status of the command.
+
+#define REQ_MAX 4096
+#define REQ_ARGS 32
+#define REQ_FDS (3 + REQ_ARGS)
+#define REQ_TIMEOUT 1000 // ms, from the connection to the request.
+#define WAIT_MAX 64 // Connections waiting for their request.
+
+// Parsed by the workers, when 'valid' (invalidated by mtime, the
+// headers of block devices, writes and reloads). It is shared
+// with them, so that it lasts from one request to the next.
+typedef struct {
+	int valid;
+	struct timespec mtime;
+	PartEntry p[4];
+	int hvalid[4];
+	uchar header[4][SECTOR_MAX]; // The whole header sector.
+} DevCache;
+
+typedef struct Dev Dev;
+struct Dev {
+	Dev *next;
+	char *path;
+	int fd;
+	int writable;
+	dev_t dev;
+	ino_t ino;
+	int busy;
+	int node; // NUMA (-1 if unknown).
+	DevCache *cache;
+};
+
+typedef struct Job Job;
+struct Job {
+	Job *next;
+	Dev *dev;
+	int writes;
+	int conn;
+	uid_t uid;
+	struct timespec since;
+	int nfds;
+	int fds[REQ_FDS];
+	int argc;
+	char *argv[REQ_ARGS + 2];
+	char buf[REQ_MAX + 1];
+	pid_t pid;
+};
+
+typedef struct {
+	char const *name;
+	void (*run)(int argc, char **argv);
+	int writes;
+} Cmd;
+
+// The throughput of the workers of a NUMA node (while any is running).
+typedef struct {
+	int active;
+	struct timespec since;
+	double busy; // s.
+	double bytes;
+} Node;
+
+static Cmd const cmds[] = {
+	{"load", f7_load, 1},
+	{"load-bundle", f7_loadbundle, 1},
+	{"clear", f7_clear, 1},
+	{"reset", f7_reset, 1},
+	{"brief", f7_brief, 0},
+	{"cpboot", f7_cpboot, 1},
+};
+
+extern char const *name;
+
+static Dev *devs;
+static Job *waiting;
+static int nwaiting;
+static Job *running;
+static Job *pending;
+static int numa = 1; // Workers on the node of their device.
+static Node nodes[NODE_MAX];
+// The device of the request being run (only in the worker process)...
+static Dev *served;
+// ...and the descriptors of its other payloads.
+static int *inputs;
+static int ninputs;
+
+static void accepted(int conn);
+static int request(Job *j);
+static void start(Job *j);
+static void reap(void);
+static void reply(int conn, int status);
+static void dropjob(Job *j);
+static Dev *devget(char const *path, int errfd);
+static void devrefresh(Dev *d);
+static void devdrop(Dev *d);
+static int isserved(int fd);
+static double elapsed(struct timespec const *since);
+
+void
+f7_serve(int argc, char **argv)
+{
+	int lfd, sfd;
+	sigset_t mask;
+	struct sockaddr_un addr;
+	struct stat statbuf;
+
+	if (argc == 4 && strcmp(argv[3], "--no-numa") == 0) {
+		numa = 0;
+	} else if (argc != 3) {
+		usage();
+		exit(1);
+	}
+
+	if (sizeof(addr.sun_path) <= strlen(argv[2])) {
+		fprintf(stderr, "The socket path is too long.\n");
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[2]);
+
+	// A stale socket from a previous run.
+	if (lstat(argv[2], &statbuf) == 0 && S_ISSOCK(statbuf.st_mode))
+		unlink(argv[2]);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	do {
+		if (lfd == -1)
+			perror("Could not create the socket");
+		else if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			perror("Could not bind the socket");
+		else if (listen(lfd, 16) < 0)
+			perror("Could not listen on the socket");
+		else
+			break;
+
+		exit(1);
+	} while (0);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (
+		sigprocmask(SIG_BLOCK, &mask, nil) < 0
+		|| (sfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1
+	) {
+		perror("Could not watch the workers");
+		close(lfd);
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	// Nothing blocks here: a client that does not send its request
+	// (or a slow device) does not stall the others.
+	for (;;) {
+		struct pollfd pfd[2 + WAIT_MAX];
+		int npfd = 2;
+		int timeout = -1;
+		Job **q;
+
+		pfd[0].fd = sfd;
+		pfd[0].events = POLLIN;
+		// The others wait in the backlog.
+		pfd[1].fd = nwaiting < WAIT_MAX? lfd: -1;
+		pfd[1].events = POLLIN;
+		for (Job *j = waiting; j != nil; j = j->next) {
+			int left = REQ_TIMEOUT - (int)(elapsed(&j->since) * 1000);
+
+			pfd[npfd].fd = j->conn;
+			pfd[npfd].events = POLLIN;
+			++npfd;
+			if (timeout < 0 || left < timeout)
+				timeout = left < 0? 0: left;
+		}
+
+		if (poll(pfd, npfd, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Could not wait for requests");
+			exit(1);
+		}
+
+		// In the order of the descriptors above.
+		q = &waiting;
+		for (int i = 2; i < npfd; ++i) {
+			Job *j = *q;
+
+			if (pfd[i].revents == 0 && elapsed(&j->since) * 1000 < REQ_TIMEOUT) {
+				q = &j->next;
+				continue;
+			}
+
+			*q = j->next;
+			--nwaiting;
+			if (pfd[i].revents == 0) {
+				fprintf(stderr, "A client did not send its request.\n");
+				dropjob(j);
+			} else if (!request(j)) {
+				j->next = *q;
+				*q = j;
+				++nwaiting;
+				q = &j->next;
+			}
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			struct signalfd_siginfo info;
+
+			if (read(sfd, &info, sizeof(info)) < 0 && errno != EAGAIN)
+				perror("Could not read the worker signals");
+			reap();
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			int conn = accept4(lfd, nil, nil, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+			if (conn == -1)
+				perror("Could not accept a request");
+			else
+				accepted(conn);
+		}
+	}
+}
+
+void
+f7_call(int argc, char **argv)
+{
+	int fd;
+	int payload;
+	int fds[REQ_FDS];
+	int nfds;
+	size_t len;
+	char buf[REQ_MAX];
+	char path[PATH_MAX];
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	struct cmsghdr *cmsg;
+	uchar status;
+	ssize_t n;
+
+	if (argc < 4 || REQ_ARGS < argc - 3) {
+		usage();
+		exit(1);
+	}
+
+	if (sizeof(addr.sun_path) <= strlen(argv[2])) {
+		fprintf(stderr, "The socket path is too long.\n");
+		exit(1);
+	}
+
+	// The arguments are edited in place.
+	// The daemon has its own working directory.
+	if (5 <= argc) {
+		if (realpath(argv[4], path) == nil) {
+			perror("Cannot resolve the requested device/image file");
+			exit(1);
+		}
+		argv[4] = path;
+	}
+
+	// The payloads are opened here (with the caller's permissions).
+	payload = -1;
+	if (strcmp(argv[3], "load") == 0 && 8 <= argc)
+		payload = 7;
+	else if (strcmp(argv[3], "cpboot") == 0 && 6 <= argc)
+		payload = 5;
+	else if (strcmp(argv[3], "load-bundle") == 0 && 7 <= argc)
+		payload = 6;
+
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	nfds = 3;
+
+	// The other payloads of load follow, as "-" (keeping their alignment;
+	// the first one is at the start of the slot, so it needs none).
+	if (payload == 7) {
+		char *at = strrchr(argv[7], '@');
+
+		if (at != nil && strncmp(at, "@align=", 7) == 0)
+			*at = '\0';
+
+		for (int i = 8; i < argc && strncmp(argv[i], "--", 2) != 0; ++i) {
+			char *file;
+
+			at = strrchr(argv[i], '@');
+			if (at == nil || strncmp(at, "@align=", 7) != 0)
+				at = &argv[i][strlen(argv[i])];
+
+			if (at == argv[i] + 1 && argv[i][0] == '-') {
+				fprintf(stderr, "Only the first payload can be the standard input.\n");
+				exit(1);
+			}
+
+			if ((file = strndup(argv[i], at - argv[i])) == nil) {
+				fprintf(stderr, "Could not allocate the request.\n");
+				exit(1);
+			}
+			if ((fds[nfds] = open(file, O_RDONLY)) == -1) {
+				fprintf(stderr, "Cannot open the payload %s: %s\n", file, strerror(errno));
+				exit(1);
+			}
+			free(file);
+			++nfds;
+
+			at[-1] = '-';
+			argv[i] = &at[-1];
+		}
+	}
+
+	if (0 <= payload && strcmp(argv[payload], "-") != 0) {
+		fds[0] = open(argv[payload], O_RDONLY);
+		if (fds[0] == -1) {
+			fprintf(stderr, "Cannot open the payload %s: %s\n", argv[payload], strerror(errno));
+			exit(1);
+		}
+		argv[payload] = "-";
+	}
+
+	len = 0;
+	for (int i = 3; i < argc; ++i) {
+		size_t l = strlen(argv[i]) + 1;
+
+		if (sizeof(buf) - len < l) {
+			fprintf(stderr, "The request is too long.\n");
+			exit(1);
+		}
+		memcpy(&buf[len], argv[i], l);
+		len += l;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[2]);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("Could not connect to the daemon");
+		exit(1);
+	}
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	if (sendmsg(fd, &msg, 0) != (ssize_t)len) {
+		perror("Could not send the request");
+		close(fd);
+		exit(1);
+	}
+
+	while ((n = read(fd, &status, 1)) < 0 && errno == EINTR)
+		;
+	close(fd);
+
+	if (n != 1) {
+		fprintf(stderr, "The daemon did not reply.\n");
+		exit(1);
+	}
+	exit(status);
+}
+
+int
+devopen(char const *path, int flags)
+{
+	int fd;
+
+	if (
+		served != nil
+		&& strcmp(path, served->path) == 0
+		&& ((flags & O_ACCMODE) == O_RDONLY || served->writable)
+	)
+		fd = dup(served->fd);
+	else
+		fd = bopen(path, flags);
+
+	// Its sector size is detected once, here (see lbasize).
+	if (fd != -1)
+		lbasize(fd);
+	return fd;
+}
+
+int
+devptable(int fd, PartEntry *p)
+{
+	if (!isserved(fd) || !served->cache->valid)
+		return 0;
+
+	memcpy(p, served->cache->p, sizeof(served->cache->p));
+	return 1;
+}
+
+int
+devheader(int fd, int entry, uchar *header)
+{
+	DevCache *c;
+
+	if (!isserved(fd) || !(c = served->cache)->valid || !c->hvalid[entry])
+		return 0;
+
+	memcpy(header, c->header[entry], SECTOR_MAX);
+	return 1;
+}
+
+int
+devinputs(void)
+{
+	return served != nil? 1 + ninputs: 1;
+}
+
+int
+devinput(int n)
+{
+	if (n == 0)
+		return dup(STDIN_FILENO);
+	if (served == nil || ninputs < n) {
+		errno = EBADF;
+		return -1;
+	}
+	return dup(inputs[n - 1]);
+}
+
+static int
+isserved(int fd)
+{
+	struct stat statbuf;
+
+	return
+		served != nil
+		&& fstat(fd, &statbuf) == 0
+		&& statbuf.st_dev == served->dev
+		&& statbuf.st_ino == served->ino;
+}
+
+// The peer is identified as it connects.
+static void
+accepted(int conn)
+{
+	Job *j;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		perror("Could not identify a client");
+		close(conn);
+		return;
+	}
+
+	if ((j = (Job *)calloc(1, sizeof(Job))) == nil) {
+		fprintf(stderr, "Could not allocate a request.\n");
+		close(conn);
+		return;
+	}
+	j->conn = conn;
+	j->uid = cred.uid;
+	clock_gettime(CLOCK_MONOTONIC, &j->since);
+
+	j->next = waiting;
+	waiting = j;
+	++nwaiting;
+}
+
+// It returns 0 if the request has not arrived yet.
+static int
+request(Job *j)
+{
+	Cmd const *cmd;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(REQ_FDS * sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	int conn = j->conn;
+	ssize_t n;
+
+	iov.iov_base = j->buf;
+	iov.iov_len = REQ_MAX;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(conn, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (n <= 0) {
+		if (n < 0)
+			perror("Could not receive a request");
+		dropjob(j);
+		return 1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (
+		cmsg == nil
+		|| cmsg->cmsg_level != SOL_SOCKET
+		|| cmsg->cmsg_type != SCM_RIGHTS
+		|| cmsg->cmsg_len < CMSG_LEN(3 * sizeof(int))
+		|| (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0
+	) {
+		// Any descriptor received is closed along with the socket.
+		fprintf(stderr, "Malformed request (descriptors).\n");
+		reply(conn, 1);
+		dropjob(j);
+		return 1;
+	}
+	j->nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(j->fds, CMSG_DATA(cmsg), j->nfds * sizeof(int));
+
+	// Its requests can read and write whatever the daemon can.
+	if (j->uid != 0 && j->uid != geteuid()) {
+		fprintf(stderr, "Refused a request of the uid %d.\n", (int)j->uid);
+		dprintf(j->fds[2], "The daemon only serves root and its own user.\n");
+		reply(conn, 1);
+		dropjob(j);
+		return 1;
+	}
+
+	if (j->buf[n - 1] != '\0') {
+		dprintf(j->fds[2], "Malformed request.\n");
+		reply(conn, 1);
+		dropjob(j);
+		return 1;
+	}
+
+	j->argv[j->argc++] = (char *)name;
+	for (char *s = j->buf; s < &j->buf[n]; s += strlen(s) + 1) {
+		if (REQ_ARGS < j->argc) {
+			dprintf(j->fds[2], "Too many arguments.\n");
+			reply(conn, 1);
+			dropjob(j);
+			return 1;
+		}
+		j->argv[j->argc++] = s;
+	}
+	j->argv[j->argc] = nil;
+
+	if (strcmp(j->argv[1], "reload") == 0) {
+		for (Dev *d = devs, *next; d != nil; d = next) {
+			next = d->next;
+			if (d->busy)
+				d->cache->valid = 0;
+			else
+				devdrop(d);
+		}
+		reply(conn, 0);
+		dropjob(j);
+		return 1;
+	}
+
+	cmd = nil;
+	for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i)
+		if (strcmp(j->argv[1], cmds[i].name) == 0)
+			cmd = &cmds[i];
+
+	if (cmd == nil || j->argc < 3) {
+		dprintf(j->fds[2], "Unsupported request.\n");
+		reply(conn, 1);
+		dropjob(j);
+		return 1;
+	}
+	j->writes = cmd->writes;
+
+	if ((j->dev = devget(j->argv[2], j->fds[2])) == nil) {
+		reply(conn, 1);
+		dropjob(j);
+		return 1;
+	}
+
+	// Requests for the same device are run one at a time.
+	if (j->dev->busy) {
+		Job **q = &pending;
+
+		while (*q != nil)
+			q = &(*q)->next;
+		*q = j;
+	} else {
+		start(j);
+	}
+	return 1;
+}
+
+static void
+start(Job *j)
+{
+	Dev *d = j->dev;
+
+	d->busy = 1;
+
+	j->pid = fork();
+	if (j->pid == 0) {
+		sigset_t mask;
+		Cmd const *cmd = nil;
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, nil);
+		signal(SIGPIPE, SIG_DFL);
+
+		for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i)
+			if (strcmp(j->argv[1], cmds[i].name) == 0)
+				cmd = &cmds[i];
+
+		// Its buffers (and threads) too.
+		if (numa && 0 <= d->node)
+			numabind(d->node);
+
+		// Any error is for the log of the daemon (the command reports it again).
+		served = d;
+		devrefresh(d);
+
+		for (int i = 0; i < 3; ++i)
+			if (dup2(j->fds[i], i) == -1)
+				_exit(1);
+		inputs = &j->fds[3];
+		ninputs = j->nfds - 3;
+		cmd->run(j->argc, j->argv);
+		exit(0);
+	}
+
+	for (int i = 0; i < j->nfds; ++i)
+		close(j->fds[i]);
+	j->nfds = 0;
+
+	if (j->pid == -1) {
+		perror("Could not run a request");
+		d->busy = 0;
+		reply(j->conn, 1);
+		dropjob(j);
+		return;
+	}
+
+	j->next = running;
+	running = j;
+
+	if (0 <= d->node && d->node < NODE_MAX && nodes[d->node].active++ == 0)
+		clock_gettime(CLOCK_MONOTONIC, &nodes[d->node].since);
+}
+
+static void
+reap(void)
+{
+	pid_t pid;
+	int wstatus;
+	struct rusage usage;
+
+	while ((pid = wait4(-1, &wstatus, WNOHANG, &usage)) > 0) {
+		Job **q, *j;
+		Dev *d;
+
+		for (q = &running; *q != nil && (*q)->pid != pid; q = &(*q)->next)
+			;
+		if ((j = *q) == nil)
+			continue;
+		*q = j->next;
+
+		if (WIFEXITED(wstatus))
+			reply(j->conn, WEXITSTATUS(wstatus));
+		else
+			reply(j->conn, 128 + WTERMSIG(wstatus));
+
+		d = j->dev;
+		d->busy = 0;
+
+		// What the worker read and wrote (in 512-byte units).
+		if (0 <= d->node && d->node < NODE_MAX) {
+			Node *n = &nodes[d->node];
+
+			n->bytes += 512.0 * (usage.ru_inblock + usage.ru_oublock);
+			if (--n->active == 0) {
+				n->busy += elapsed(&n->since);
+				fprintf(
+					stderr
+					, "Node %d = %.1f MB/s (%.0f MB in %.1f s)\n"
+					, d->node
+					, 0 < n->busy? n->bytes / n->busy / 1e6: 0
+					, n->bytes / 1e6
+					, n->busy
+				);
+			}
+		}
+		// Block devices do not update their mtime.
+		if (j->writes)
+			d->cache->valid = 0;
+		dropjob(j);
+
+		for (q = &pending; *q != nil && (*q)->dev != d; q = &(*q)->next)
+			;
+		if ((j = *q) != nil) {
+			*q = j->next;
+			start(j);
+		}
+	}
+}
+
+static void
+reply(int conn, int status)
+{
+	uchar b = status;
+
+	if (write(conn, &b, 1) != 1)
+		perror("Could not reply to a request");
+}
+
+static void
+dropjob(Job *j)
+{
+	for (int i = 0; i < j->nfds; ++i)
+		close(j->fds[i]);
+	close(j->conn);
+	free(j);
+}
+
+static Dev *
+devget(char const *path, int errfd)
+{
+	Dev *d;
+	struct stat statbuf;
+
+	if (stat(path, &statbuf) < 0) {
+		dprintf(errfd, "Cannot open the requested device/image file: %s\n", strerror(errno));
+		return nil;
+	}
+
+	for (d = devs; d != nil; d = d->next)
+		if (strcmp(d->path, path) == 0)
+			break;
+
+	// Replaced (e.g. a new image file with the same name).
+	if (
+		d != nil && !d->busy
+		&& (statbuf.st_dev != d->dev || statbuf.st_ino != d->ino)
+	) {
+		devdrop(d);
+		d = nil;
+	}
+
+	if (d != nil)
+		return d;
+
+	if ((d = (Dev *)calloc(1, sizeof(Dev))) == nil || (d->path = strdup(path)) == nil) {
+		free(d);
+		dprintf(errfd, "Could not allocate a device.\n");
+		return nil;
+	}
+	d->cache = (DevCache *)mmap(
+		nil
+		, sizeof(DevCache)
+		, PROT_READ | PROT_WRITE
+		, MAP_SHARED | MAP_ANONYMOUS
+		, -1
+		, 0
+	);
+	if (d->cache == MAP_FAILED) {
+		dprintf(errfd, "Could not allocate a device: %s\n", strerror(errno));
+		free(d->path);
+		free(d);
+		return nil;
+	}
+
+	d->writable = 1;
+	d->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (d->fd == -1 && (errno == EACCES || errno == EROFS)) {
+		d->writable = 0;
+		d->fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (d->fd == -1 || fstat(d->fd, &statbuf) < 0) {
+		dprintf(errfd, "Cannot open the requested device/image file: %s\n", strerror(errno));
+		if (0 <= d->fd)
+			close(d->fd);
+		munmap(d->cache, sizeof(DevCache));
+		free(d->path);
+		free(d);
+		return nil;
+	}
+
+	d->dev = statbuf.st_dev;
+	d->ino = statbuf.st_ino;
+	d->node = devnode(d->fd);
+	d->next = devs;
+	devs = d;
+	return d;
+}
+
+// In the worker, before the command. Other processes can write block
+// devices (with no mtime to tell it): their headers are read again.
+static void
+devrefresh(Dev *d)
+{
+	DevCache *c = d->cache;
+	struct stat statbuf;
+	uchar header[SECTOR_MAX];
+	int sector;
+
+	if (
+		fstat(d->fd, &statbuf) < 0
+		|| statbuf.st_mtim.tv_sec != c->mtime.tv_sec
+		|| statbuf.st_mtim.tv_nsec != c->mtime.tv_nsec
+	)
+		c->valid = 0;
+
+	sector = lbasize(d->fd);
+	if (c->valid && S_ISBLK(statbuf.st_mode))
+		for (int entry = 0; c->valid && entry < 4; ++entry)
+			if (
+				c->hvalid[entry]
+				&& (
+					pread(d->fd, header, sector, c->p[entry].start * sector) != sector
+					|| memcmp(header, c->header[entry], sector) != 0
+				)
+			)
+				c->valid = 0;
+
+	if (c->valid)
+		return;
+
+	c->mtime = statbuf.st_mtim;
+	if (!read_ptable(d->fd, c->p))
+		return;
+	for (int entry = 0; entry < 4; ++entry)
+		c->hvalid[entry] =
+			c->p[entry].type == 0xF7
+			&& pread(d->fd, c->header[entry], sector, c->p[entry].start * sector) == sector;
+	c->valid = 1;
+}
+
+static void
+devdrop(Dev *d)
+{
+	Dev **q;
+
+	for (q = &devs; *q != d; q = &(*q)->next)
+		;
+	*q = d->next;
+
+	close(d->fd);
+	munmap(d->cache, sizeof(DevCache));
+	free(d->path);
+	free(d);
+}
+
+static double
+elapsed(struct timespec const *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
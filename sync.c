@@ -0,0 +1,436 @@
+// Copyright © 2019-2020 Mikel Cazorla Pérez
+// This file is part of f7disk,
+// licensed under the terms of GPLv2.
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "u.h"
+#include "f7disk.h"
+#include "ptable.h"
+#include "f7part.h"
+#include "copy.h"
+#include "hash.h"
+#include "merkle.h"
+#include "iolimit.h"
+
+#define HASH_CHUNK (1024 * 1024)
+
+// Per slot, both sides (target first, as fd[]).
+typedef struct {
+	off_t offset[2];
+	int todo;
+	Merkle idx[2];
+	int indexed[2];
+	uvlong hash[2];
+} SlotSync;
+
+typedef struct {
+	int fd;
+	int side;
+	off_t length;
+	int count;
+	SlotSync *slots;
+	int ok;
+} HashJob;
+
+static int syncentry(int fd[2], char **files, PartEntry p[2][4], int entry);
+static vlong syncdelta(
+	int fd[2]
+	, Merkle const *g
+	, Merkle const *t
+	, off_t src
+	, off_t dst
+);
+static void *hashslots(void *arg);
+
+void
+f7_sync(int argc, char **argv)
+{
+	int fd[2];
+	char *files[2];
+	int entry;
+	PartEntry p[2][4];
+	int ok;
+
+	if (argc < 4) {
+		usage();
+		exit(1);
+	}
+
+	entry = -1;
+	if (5 <= argc && strncmp(argv[4], "--", 2) != 0) {
+		entry = atol2(argv[4]);
+		if (entry < 0 || 3 < entry) {
+			usage();
+			exit(1);
+		}
+	}
+	ioargs(argc, argv, entry < 0? 4: 5);
+
+	// fd[0] is the target, fd[1] the golden image (as in the copy engine).
+	files[0] = argv[3];
+	files[1] = argv[2];
+	fd[1] = devopen(argv[2], O_RDONLY);
+	if (fd[1] == -1) {
+		perror("Cannot open the requested device/image file");
+		exit(1);
+	}
+	fd[0] = devopen(argv[3], O_RDWR);
+	if (fd[0] == -1) {
+		perror("Cannot open the requested device/image file");
+		close(fd[1]);
+		exit(1);
+	}
+
+	if (!read_ptable(fd[1], p[1]) || !read_ptable(fd[0], p[0])) {
+		close(fd[0]);
+		close(fd[1]);
+		exit(1);
+	}
+
+	ok = 1;
+	if (0 <= entry) {
+		ok = syncentry(fd, files, p, entry);
+	} else {
+		int any = 0;
+
+		for (int i = 0; ok && i < 4; ++i) {
+			if (p[1][i].type != 0xF7)
+				continue;
+
+			printf("Entry #%d:\n", i);
+			ok = syncentry(fd, files, p, i);
+			any = 1;
+		}
+
+		if (!any) {
+			fprintf(stderr, "The golden image has no F7h partitions.\n");
+			ok = 0;
+		}
+	}
+
+	close(fd[0]);
+	close(fd[1]);
+	if (!ok)
+		exit(1);
+	iostats();
+}
+
+static int
+syncentry(int fd[2], char **files, PartEntry p[2][4], int entry)
+{
+	uchar header[2][F7_HEADER_MAX];
+	MetaF7 meta[2];
+	HashJob job[2];
+	pthread_t thread[2];
+	SlotSync *slots;
+	char path[PATH_MAX];
+	MetaF7 bitmap;
+	int lock, glock;
+	int todo;
+	int copies;
+	vlong bytes;
+	int ok;
+
+	if (
+		!f7_read_header(fd[1], p[1], entry, header[1])
+		|| !f7_retrieve_meta(header[1], &meta[1])
+		|| !f7_read_header(fd[0], p[0], entry, header[0])
+		|| !f7_retrieve_meta(header[0], &meta[0])
+	)
+		return 0;
+
+	if (
+		meta[0].version != meta[1].version
+		|| meta[0].sector != meta[1].sector
+		|| meta[0].count != meta[1].count
+		|| meta[0].first != meta[1].first
+		|| meta[0].size != meta[1].size
+		|| meta[0].every != meta[1].every
+	) {
+		fprintf(stderr, "The F7h layouts differ (the target must be overridden first).\n");
+		return 0;
+	}
+
+	if ((slots = (SlotSync *)calloc(meta[1].count, sizeof(SlotSync))) == nil) {
+		fprintf(stderr, "Could not allocate the slot list.\n");
+		return 0;
+	}
+
+	// The slots active on both sides are compared by content.
+	// If both have a hash index, the roots are enough;
+	// otherwise, each side is hashed in its own thread.
+	todo = 0;
+	for (int slot = 0; slot < meta[1].count; ++slot) {
+		SlotSync *s = &slots[slot];
+
+		for (int i = 0; i < 2; ++i) {
+			s->offset[i] = f7_slotoffset(p[i], entry, &meta[i], slot);
+			s->indexed[i] =
+				f7_active(&meta[i], slot)
+				&& merklepath(fd[i], files[i], p[i], entry, slot, path, sizeof(path))
+				&& merkleload(&s->idx[i], path, s->offset[i]);
+		}
+
+		s->todo =
+			f7_active(&meta[0], slot) && f7_active(&meta[1], slot)
+			&& !(s->indexed[0] && s->indexed[1]);
+		todo += s->todo;
+	}
+
+	ok = 1;
+	if (todo != 0) {
+		int started = 0;
+		int err;
+
+		for (; started < 2; ++started) {
+			job[started].fd = fd[started];
+			job[started].side = started;
+			job[started].length = meta[started].size * meta[started].sector;
+			job[started].count = meta[started].count;
+			job[started].slots = slots;
+			job[started].ok = 0;
+			if ((err = pthread_create(&thread[started], nil, hashslots, &job[started])) != 0) {
+				fprintf(stderr, "Could not start the hashing: %s\n", strerror(err));
+				break;
+			}
+		}
+		for (int i = 0; i < started; ++i)
+			pthread_join(thread[i], nil);
+
+		ok = started == 2 && job[0].ok && job[1].ok;
+	}
+
+	// The target bitmap, as it is on disk.
+	bitmap = meta[0];
+	copies = 0;
+	bytes = 0;
+	lock = -1;
+	glock = -1;
+	for (int slot = 0; ok && slot < meta[1].count; ++slot) {
+		SlotSync *s = &slots[slot];
+		Merkle *g = s->indexed[1]? &s->idx[1]: nil;
+		Merkle *t = s->indexed[0]? &s->idx[0]: nil;
+		off_t src = s->offset[1];
+		off_t dst = s->offset[0];
+		int indexable;
+		vlong moved;
+
+		indexable = merklepath(fd[0], files[0], p[0], entry, slot, path, sizeof(path));
+
+		if (!f7_active(&meta[1], slot) && !f7_active(&bitmap, slot))
+			continue;
+
+		// The target slot is not in use by another process.
+		lock = devlock(fd[0], dst, meta[0].size * meta[0].sector, F_WRLCK, 0, "slot");
+		if (lock < 0) {
+			ok = 0;
+			break;
+		}
+
+		if (!f7_active(&meta[1], slot)) {
+			if (!(ok = f7_commit(fd[0], p[0], entry, &bitmap, slot, 0)))
+				break;
+			if (indexable)
+				merkledrop(path);
+			printf("Slot #%d: cleared\n", slot);
+			devunlock(lock);
+			lock = -1;
+			continue;
+		}
+
+		// Nor is the golden slot being written (as dump does).
+		glock = devlock(fd[1], src, meta[1].size * meta[1].sector, F_RDLCK, 0, "golden slot");
+		if (glock < 0) {
+			ok = 0;
+			break;
+		}
+
+		if (f7_active(&bitmap, slot)) {
+			if (
+				g != nil && t != nil
+				? merkleroot(g) == merkleroot(t)
+				: s->hash[0] == s->hash[1]
+			) {
+				printf("Slot #%d: unchanged\n", slot);
+				devunlock(glock);
+				glock = -1;
+				devunlock(lock);
+				lock = -1;
+				continue;
+			}
+
+			// It is not active while it is being copied.
+			if (!(ok = f7_commit(fd[0], p[0], entry, &bitmap, slot, 0)))
+				break;
+		}
+
+		if (
+			g != nil && t != nil
+			&& g->shift == t->shift
+			&& g->length == t->length
+		) {
+			// Only the blocks that differ.
+			if ((moved = syncdelta(fd, g, t, src, dst)) < 0) {
+				ok = 0;
+				break;
+			}
+		} else {
+			Copy c;
+
+			copyinit(&c, fd[0], fd[1], "slot");
+			c.srcoff = src;
+			c.dstoff = dst;
+			// Without an index, the payload length is unknown.
+			c.size = g != nil? g->length: meta[1].size * meta[1].sector;
+			c.reflink = 1;
+			if (!(ok = copydata(&c)))
+				break;
+			moved = c.size;
+		}
+
+		// The golden index is also valid for the target.
+		if (indexable) {
+			if (g != nil) {
+				g->offset = dst;
+				merklesave(g, path);
+			} else {
+				merkledrop(path);
+			}
+		}
+
+		if (!(ok = f7_commit(fd[0], p[0], entry, &bitmap, slot, 1)))
+			break;
+		devunlock(glock);
+		glock = -1;
+		devunlock(lock);
+		lock = -1;
+
+		printf("Slot #%d: copied (%lld bytes)\n", slot, moved);
+		++copies;
+		bytes += moved;
+	}
+
+	devunlock(glock);
+	devunlock(lock);
+	for (int slot = 0; slot < meta[1].count; ++slot)
+		for (int i = 0; i < 2; ++i)
+			if (slots[slot].indexed[i])
+				merklefree(&slots[slot].idx[i]);
+	free(slots);
+
+	if (!ok)
+		return 0;
+
+	// Leftovers beyond the slot count.
+	if (memcmp(bitmap.bitmap, meta[1].bitmap, sizeof(bitmap.bitmap)) != 0) {
+		memcpy(bitmap.bitmap, meta[1].bitmap, sizeof(bitmap.bitmap));
+		if (!f7_commit(fd[0], p[0], entry, &bitmap, -1, 0))
+			return 0;
+	}
+
+	printf("Copied = %d slot/s (%lld bytes)\n", copies, bytes);
+	return 1;
+}
+
+// Copies the blocks whose hashes differ, descending the trees.
+// It returns how many bytes were copied, or -1 on error.
+static vlong
+syncdelta(int fd[2], Merkle const *g, Merkle const *t, off_t src, off_t dst)
+{
+	uchar *leaves;
+	vlong moved;
+	off_t block = (off_t)1 << g->shift;
+
+	if ((leaves = (uchar *)malloc(g->nleaves)) == nil) {
+		fprintf(stderr, "Could not allocate the block list.\n");
+		return -1;
+	}
+
+	merklediff(g, t, leaves);
+
+	moved = 0;
+	for (vlong i = 0; i < g->nleaves;) {
+		vlong j;
+		Copy c;
+
+		if (!leaves[i]) {
+			++i;
+			continue;
+		}
+
+		// Runs of blocks are copied at once.
+		for (j = i; j < g->nleaves && leaves[j]; ++j)
+			;
+
+		copyinit(&c, fd[0], fd[1], "slot");
+		c.srcoff = src + i * block;
+		c.dstoff = dst + i * block;
+		c.size = j * block < g->length? j * block - i * block: g->length - i * block;
+		c.reflink = 1;
+		if (!copydata(&c)) {
+			free(leaves);
+			return -1;
+		}
+
+		moved += c.size;
+		i = j;
+	}
+
+	free(leaves);
+	return moved;
+}
+
+static void *
+hashslots(void *arg)
+{
+	HashJob *job = (HashJob *)arg;
+	uchar *buf;
+
+	if ((buf = (uchar *)malloc(HASH_CHUNK)) == nil) {
+		fprintf(stderr, "Could not allocate the hashing buffer.\n");
+		return nil;
+	}
+
+	for (int slot = 0; slot < job->count; ++slot) {
+		SlotSync *s = &job->slots[slot];
+		off_t offset, rem;
+		Xxh64 h;
+
+		if (!s->todo)
+			continue;
+
+		offset = s->offset[job->side];
+		xxh64init(&h, 0);
+		for (rem = job->length; 0 < rem;) {
+			size_t count = rem < HASH_CHUNK? rem: HASH_CHUNK;
+			ssize_t n = preadfull(job->fd, buf, count, offset);
+
+			if (n < (ssize_t)count) {
+				if (n < 0)
+					perror("Could not read a slot");
+				else
+					fprintf(stderr, "Could not read a whole slot.\n");
+				free(buf);
+				return nil;
+			}
+
+			throttle(count);
+			xxh64update(&h, buf, count);
+			offset += count;
+			rem -= count;
+		}
+		s->hash[job->side] = xxh64final(&h);
+	}
+
+	free(buf);
+	job->ok = 1;
+	return nil;
+}
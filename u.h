@@ -5,6 +5,7 @@
 typedef unsigned char uchar;
 typedef unsigned int uint;
 typedef long long vlong;
+typedef unsigned long long uvlong;
 
 #ifndef nil
 	#define nil NULL